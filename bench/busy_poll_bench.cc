@@ -0,0 +1,84 @@
+//空闲线程忙等(iomanager.busy_poll_us)对唤醒延迟的影响
+//外部线程每隔一段时间往socketpair写入当前时间，IOManager中的协程阻塞读取，
+//统计从写入到协程读到数据的延迟，分别在不忙等和忙等时运行
+//
+//编译(在仓库根目录下):
+//  g++ -std=c++11 -O2 -I. bench/busy_poll_bench.cc myserver/*.cc myserver/http/*.cc -o busy_poll_bench -lyaml-cpp -lpthread -ldl
+//
+//运行: ./busy_poll_bench [消息数] [发送间隔us] [最长忙等us]
+
+#include "myserver/iomanager.h"
+#include "myserver/hook.h"
+#include "myserver/clock.h"
+#include "myserver/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+static int s_count = 20000;
+static int s_interval = 50;
+static uint32_t s_spin = 100;
+
+static void Bench(uint32_t spin){
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)){
+        perror("socketpair");
+        return;
+    }
+    std::vector<uint64_t> lat;
+    lat.reserve(s_count);
+    {
+        cc::IOManager iom(1, false, "bench");
+        iom.setBusyPoll(spin);
+        iom.schedule([&lat, fds](){
+            uint64_t ts = 0;
+            for(int i = 0; i < s_count; ++i){
+                if(read(fds[0], &ts, sizeof(ts)) != sizeof(ts)){
+                    break;
+                }
+                lat.push_back(cc::GetMonotonicUS() - ts);
+            }
+        });
+        std::thread writer([fds](){
+            for(int i = 0; i < s_count; ++i){
+                uint64_t ts = cc::GetMonotonicUS();
+                if(write(fds[1], &ts, sizeof(ts)) != sizeof(ts)){
+                    break;
+                }
+                usleep(s_interval);
+            }
+        });
+        writer.join();
+    }
+    close(fds[0]);
+    close(fds[1]);
+    if(lat.empty()){
+        return;
+    }
+    std::sort(lat.begin(), lat.end());
+    printf("busy_poll_us=%-4u p50 %4lu us  p99 %4lu us  p999 %4lu us\n", spin
+           , (unsigned long)lat[lat.size() / 2]
+           , (unsigned long)lat[lat.size() * 99 / 100]
+           , (unsigned long)lat[lat.size() * 999 / 1000]);
+}
+
+int main(int argc, char** argv){
+    if(argc > 1){
+        s_count = atoi(argv[1]);
+    }
+    if(argc > 2){
+        s_interval = atoi(argv[2]);
+    }
+    if(argc > 3){
+        s_spin = atoi(argv[3]);
+    }
+    CC_LOG_ROOT()->setLevel(cc::LogLevel::ERROR);
+    CC_LOG_NAME("system")->setLevel(cc::LogLevel::ERROR);
+    Bench(0);
+    Bench(s_spin);
+    return 0;
+}
@@ -0,0 +1,104 @@
+//协程切换开销的微基准测试
+//对比 swapcontext 与 fiber_context.h 中的汇编切换，以及 Fiber::call/back 的一次往返
+//
+//编译(在仓库根目录下):
+//  g++ -std=c++11 -O2 -I. bench/fiber_switch_bench.cc myserver/*.cc myserver/http/*.cc -o fiber_switch_bench -lyaml-cpp -lpthread -ldl
+//加上 -DCC_FIBER_UCONTEXT 则Fiber退回ucontext实现，可以对比Fiber层面的差异
+//
+//运行: ./fiber_switch_bench [切换次数]
+
+#include "myserver/fiber.h"
+#include "myserver/fiber_context.h"
+#include "myserver/util.h"
+#include "myserver/log.h"
+#include <ucontext.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const size_t STACK_SIZE = 64 * 1024;
+static uint64_t s_rounds = 1000000;
+
+//swapcontext
+static ucontext_t s_uc_main;
+static ucontext_t s_uc_co;
+
+static void UcontextFunc(){
+    while(true){
+        swapcontext(&s_uc_co, &s_uc_main);
+    }
+}
+
+static void BenchUcontext(){
+    void* stack = malloc(STACK_SIZE);
+    getcontext(&s_uc_co);
+    s_uc_co.uc_link = nullptr;
+    s_uc_co.uc_stack.ss_sp = stack;
+    s_uc_co.uc_stack.ss_size = STACK_SIZE;
+    makecontext(&s_uc_co, &UcontextFunc, 0);
+
+    uint64_t start = cc::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++i){
+        swapcontext(&s_uc_main, &s_uc_co);
+    }
+    uint64_t used = cc::GetCurrentUS() - start;
+    printf("%-24s %10.1f ns/switch\n", "swapcontext", used * 1000.0 / (s_rounds * 2));
+    free(stack);
+}
+
+//fiber_context.h (当前编译选择的实现)
+static cc::FiberContext s_ctx_main;
+static cc::FiberContext s_ctx_co;
+
+static void ContextFunc(){
+    while(true){
+        cc::SwapContext(&s_ctx_co, &s_ctx_main);
+    }
+}
+
+static void BenchFiberContext(){
+    void* stack = malloc(STACK_SIZE);
+    cc::MakeContext(&s_ctx_co, stack, STACK_SIZE, &ContextFunc);
+
+    uint64_t start = cc::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++i){
+        cc::SwapContext(&s_ctx_main, &s_ctx_co);
+    }
+    uint64_t used = cc::GetCurrentUS() - start;
+    printf("%-24s %10.1f ns/switch\n",
+           CC_FIBER_USE_UCONTEXT ? "SwapContext(ucontext)" : "SwapContext(asm)",
+           used * 1000.0 / (s_rounds * 2));
+    free(stack);
+}
+
+//Fiber::call / Fiber::back
+static void BenchFiber(){
+    cc::Fiber::GetThis();
+    cc::Fiber::ptr fiber(new cc::Fiber([](){
+        for(uint64_t i = 0; i < s_rounds; ++i){
+            cc::Fiber::GetThis()->back();
+        }
+    }, STACK_SIZE, true));
+
+    uint64_t start = cc::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++i){
+        fiber->call();
+    }
+    uint64_t used = cc::GetCurrentUS() - start;
+    //让协程正常结束
+    fiber->call();
+    printf("%-24s %10.1f ns/switch\n", "Fiber::call/back", used * 1000.0 / (s_rounds * 2));
+}
+
+int main(int argc, char** argv){
+    if(argc > 1){
+        s_rounds = strtoull(argv[1], nullptr, 10);
+    }
+    CC_LOG_ROOT()->setLevel(cc::LogLevel::ERROR);
+    CC_LOG_NAME("system")->setLevel(cc::LogLevel::ERROR);
+
+    printf("rounds=%lu\n", (unsigned long)s_rounds);
+    BenchUcontext();
+    BenchFiberContext();
+    BenchFiber();
+    return 0;
+}
@@ -0,0 +1,62 @@
+//调度优先级测试
+//一个调度线程被大量LOW任务占满时，从外部线程提交一个探测任务，
+//分别以LOW/NORMAL/HIGH提交，统计它从提交到开始执行的延迟
+//
+//编译(在仓库根目录下):
+//  g++ -std=c++11 -O2 -I. bench/priority_bench.cc myserver/*.cc myserver/http/*.cc -o priority_bench -lyaml-cpp -lpthread -ldl
+//
+//运行: ./priority_bench [LOW任务数]
+
+#include "myserver/iomanager.h"
+#include "myserver/util.h"
+#include "myserver/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+
+static int s_lowTasks = 20000;
+static std::atomic<int> s_lowDone(0);
+
+static void Spin(){
+    volatile int x = 0;
+    for(int i = 0; i < 20000; ++i){
+        x = x + i;
+    }
+    s_lowDone.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void BenchProbe(int priority, const char* name){
+    std::atomic<uint64_t> latency(0);
+    std::atomic<int> lowBefore(0);
+    s_lowDone = 0;
+    {
+        cc::IOManager iom(1, false, "bench");
+        iom.schedule([&iom](){
+            for(int i = 0; i < s_lowTasks; ++i){
+                iom.schedule(&Spin, -1, cc::Scheduler::LOW);
+            }
+        });
+        //等调度线程开始处理LOW任务
+        usleep(20 * 1000);
+        uint64_t start = cc::GetCurrentUS();
+        iom.schedule([&latency, &lowBefore, start](){
+            latency = cc::GetCurrentUS() - start;
+            lowBefore = s_lowDone.load();
+        }, -1, priority);
+    }
+    printf("probe %-6s: latency %8lu us, %d/%d LOW tasks done before it\n"
+           , name, (unsigned long)latency.load(), lowBefore.load(), s_lowTasks);
+}
+
+int main(int argc, char** argv){
+    if(argc > 1){
+        s_lowTasks = atoi(argv[1]);
+    }
+    CC_LOG_ROOT()->setLevel(cc::LogLevel::ERROR);
+    CC_LOG_NAME("system")->setLevel(cc::LogLevel::ERROR);
+    BenchProbe(cc::Scheduler::LOW, "LOW");
+    BenchProbe(cc::Scheduler::NORMAL, "NORMAL");
+    BenchProbe(cc::Scheduler::HIGH, "HIGH");
+    return 0;
+}
@@ -0,0 +1,110 @@
+//调度回调任务的内存分配和吞吐测试
+//统计稳态下每调度一个任务的堆分配次数，以及Callback与std::function本身的分配情况
+//
+//编译(在仓库根目录下):
+//  g++ -std=c++17 -O2 -I. bench/schedule_alloc_bench.cc myserver/*.cc myserver/http/*.cc -o schedule_alloc_bench -lyaml-cpp -lpthread -ldl
+//
+//运行: ./schedule_alloc_bench [任务数]
+
+#include "myserver/iomanager.h"
+#include "myserver/callback.h"
+#include "myserver/util.h"
+#include "myserver/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <functional>
+#include <new>
+
+static std::atomic<uint64_t> s_allocs(0);
+
+void* operator new(size_t size){
+    s_allocs.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size);
+    if(!p){
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept{
+    free(p);
+}
+
+static uint64_t s_tasks = 1000000;
+static std::atomic<uint64_t> s_done(0);
+
+struct Conn{
+    int fd = 0;
+    void handle(std::shared_ptr<int> v, int n) { fd += *v + n;}
+};
+
+//接近TcpServer::startAccept里std::bind(&handleClient, self, client)的捕获大小
+static void BenchCallbackSize(){
+    Conn conn;
+    std::shared_ptr<int> v = std::make_shared<int>(1);
+    uint64_t before = s_allocs;
+    for(int i = 0; i < 1000; ++i){
+        cc::Callback cb(std::bind(&Conn::handle, &conn, v, i));
+        cb();
+    }
+    uint64_t cb_allocs = s_allocs - before;
+    before = s_allocs;
+    for(int i = 0; i < 1000; ++i){
+        std::function<void()> cb(std::bind(&Conn::handle, &conn, v, i));
+        cb();
+    }
+    uint64_t fn_allocs = s_allocs - before;
+    printf("bind(member, ptr, shared_ptr, int): Callback %.2f allocs, std::function %.2f allocs\n"
+           , cb_allocs / 1000.0, fn_allocs / 1000.0);
+}
+
+static void BenchSchedule(){
+    cc::IOManager iom(2, false, "bench");
+    std::shared_ptr<int> v = std::make_shared<int>(1);
+    iom.schedule([&iom, v](){
+        //预热: 让队列、回调协程的内存都分配好
+        for(uint64_t i = 0; i < 10000; ++i){
+            iom.schedule([v](){ s_done.fetch_add(*v, std::memory_order_relaxed);});
+        }
+        while(s_done < 10000){
+            cc::Fiber::YieldToReady();
+        }
+        s_done = 0;
+        uint64_t before = s_allocs;
+        uint64_t start = cc::GetCurrentUS();
+        for(uint64_t i = 0; i < s_tasks; ++i){
+            iom.schedule([v, i](){ s_done.fetch_add(*v + (i & 0), std::memory_order_relaxed);});
+            if((i & 1023) == 1023){
+                //不让队列无限增长
+                while(s_done + 4096 < i){
+                    cc::Fiber::YieldToReady();
+                }
+            }
+        }
+        while(s_done < s_tasks){
+            cc::Fiber::YieldToReady();
+        }
+        uint64_t us = cc::GetCurrentUS() - start;
+        uint64_t allocs = s_allocs - before;
+        printf("schedule %lu tasks: %.3f allocs/task, %.1f ns/task\n"
+               , (unsigned long)s_tasks, (double)allocs / s_tasks, us * 1000.0 / s_tasks);
+    });
+}
+
+int main(int argc, char** argv){
+    if(argc > 1){
+        s_tasks = strtoull(argv[1], nullptr, 10);
+    }
+    CC_LOG_ROOT()->setLevel(cc::LogLevel::ERROR);
+    CC_LOG_NAME("system")->setLevel(cc::LogLevel::ERROR);
+    printf("sizeof(Callback) = %zu, inline %zu bytes\n"
+           , sizeof(cc::Callback), (size_t)cc::Callback::INLINE_SIZE);
+    BenchCallbackSize();
+    BenchSchedule();
+    return 0;
+}
@@ -0,0 +1,68 @@
+//调度器运行统计测试
+//对比开启/关闭任务计时(scheduler.task_timing)时调度空任务的开销，并打印一次统计快照
+//
+//编译(在仓库根目录下):
+//  g++ -std=c++11 -O2 -I. bench/scheduler_stats_bench.cc myserver/*.cc myserver/http/*.cc -o scheduler_stats_bench -lyaml-cpp -lpthread -ldl
+//
+//运行: ./scheduler_stats_bench [任务数]
+
+#include "myserver/iomanager.h"
+#include "myserver/hook.h"
+#include "myserver/util.h"
+#include "myserver/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+
+static uint64_t s_tasks = 1000000;
+
+static void Bench(bool timing){
+    std::atomic<uint64_t> done(0);
+    std::atomic<bool> finished(false);
+    cc::Scheduler::Stats stats;
+    uint64_t us = 0;
+    {
+        cc::IOManager iom(4, false, "stats");
+        iom.setTaskTiming(timing);
+        iom.schedule([&](){
+            uint64_t start = cc::GetCurrentUS();
+            for(uint64_t i = 0; i < s_tasks; ++i){
+                iom.schedule([&done](){ done.fetch_add(1, std::memory_order_relaxed);});
+                if((i & 1023) == 1023){
+                    while(done + 4096 < i){
+                        cc::Fiber::YieldToReady();
+                    }
+                }
+            }
+            //一些会挂起的任务，让排队和执行时间分布有层次
+            for(int i = 0; i < 1000; ++i){
+                iom.schedule([&done](){
+                    usleep(100);
+                    done.fetch_add(1, std::memory_order_relaxed);
+                });
+            }
+            while(done < s_tasks + 1000){
+                cc::Fiber::YieldToReady();
+            }
+            us = cc::GetCurrentUS() - start;
+            finished = true;
+        });
+        while(!finished){
+            usleep(1000);
+        }
+        iom.getStats(stats);
+    }
+    printf("task_timing=%d: %.1f ns/task\n%s", timing, us * 1000.0 / s_tasks
+           , stats.toString().c_str());
+}
+
+int main(int argc, char** argv){
+    if(argc > 1){
+        s_tasks = strtoull(argv[1], nullptr, 10);
+    }
+    CC_LOG_ROOT()->setLevel(cc::LogLevel::ERROR);
+    CC_LOG_NAME("system")->setLevel(cc::LogLevel::ERROR);
+    Bench(false);
+    Bench(true);
+    return 0;
+}
@@ -0,0 +1,125 @@
+//Task异步IO带超时的多线程压力测试
+//每个socketpair上一个Task反复读1字节，交替使用很短(1ms)和很长的超时，
+//另一个Task隔0~2ms写1字节，fd不断在就绪和不就绪之间切换，短超时经常和事件同时到达。
+//检查: 长超时的读不能返回ETIMEDOUT(被上一次等待的到期处理误伤)，所有写入的字节都被读到，
+//时间轮不被重复挂入的截止时间破坏(CC_ASSERT)
+//
+//编译(在仓库根目录下，Task需要C++20):
+//  g++ -std=c++20 -O2 -I. bench/task_io_stress.cc myserver/*.cc myserver/http/*.cc -o task_io_stress -lyaml-cpp -lpthread -ldl
+//
+//运行: ./task_io_stress [socketpair数] [每对写入字节数] [常驻注册0/1]
+
+#include "myserver/task.h"
+#include "myserver/config.h"
+#include "myserver/clock.h"
+#include "myserver/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <random>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+
+static int s_pairs = 64;
+static int s_bytes = 2000;
+
+static std::atomic<uint64_t> s_reads(0);
+static std::atomic<uint64_t> s_timeouts(0);
+static std::atomic<uint64_t> s_falseTimeouts(0);
+static std::atomic<uint64_t> s_errors(0);
+static std::atomic<int> s_finished(0);
+
+static cc::Task<void> Reader(int fd){
+    char c = 0;
+    int got = 0;
+    for(uint64_t i = 0; got < s_bytes; ++i){
+        bool is_short = i & 1;
+        ssize_t n = co_await cc::AsyncRead(fd, &c, 1, is_short ? 1 : 100000);
+        if(n == 1){
+            ++got;
+            s_reads.fetch_add(1, std::memory_order_relaxed);
+        } else if(n == -1 && errno == ETIMEDOUT){
+            if(is_short){
+                s_timeouts.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                s_falseTimeouts.fetch_add(1, std::memory_order_relaxed);
+            }
+        } else {
+            s_errors.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+    }
+    s_finished.fetch_add(1, std::memory_order_relaxed);
+}
+
+static cc::Task<void> Writer(int fd, unsigned seed){
+    std::minstd_rand rng(seed);
+    char c = 'x';
+    for(int i = 0; i < s_bytes; ++i){
+        co_await cc::AsyncSleep(rng() % 3);
+        if(co_await cc::AsyncWrite(fd, &c, 1) != 1){
+            s_errors.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+    }
+    s_finished.fetch_add(1, std::memory_order_relaxed);
+}
+
+int main(int argc, char** argv){
+    if(argc > 1){
+        s_pairs = atoi(argv[1]);
+    }
+    if(argc > 2){
+        s_bytes = atoi(argv[2]);
+    }
+    if(argc > 3){
+        cc::Config::Lookup<bool>("iomanager.persistent_events")->setValue(atoi(argv[3]) != 0);
+    }
+    CC_LOG_ROOT()->setLevel(cc::LogLevel::ERROR);
+    CC_LOG_NAME("system")->setLevel(cc::LogLevel::ERROR);
+
+    std::vector<int> fds(s_pairs * 2);
+    for(int i = 0; i < s_pairs; ++i){
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[i * 2])){
+            perror("socketpair");
+            return 1;
+        }
+        //由FdManager管理，socket被设置为非阻塞
+        cc::FdMgr::GetInstance()->get(fds[i * 2], true);
+        cc::FdMgr::GetInstance()->get(fds[i * 2 + 1], true);
+    }
+    uint64_t start = cc::GetMonotonicMS();
+    {
+        cc::IOManager iom(4, false, "stress");
+        for(int i = 0; i < s_pairs; ++i){
+            cc::CoSpawn(Reader(fds[i * 2]), &iom);
+            cc::CoSpawn(Writer(fds[i * 2 + 1], i + 1), &iom);
+        }
+        while(s_finished.load(std::memory_order_relaxed) < s_pairs * 2){
+            usleep(10 * 1000);
+        }
+    }
+    for(auto fd : fds){
+        cc::FdMgr::GetInstance()->del(fd);
+        close(fd);
+    }
+    bool ok = s_falseTimeouts == 0 && s_errors == 0
+              && s_reads == (uint64_t)s_pairs * s_bytes;
+    printf("reads=%lu timeouts=%lu false_timeouts=%lu errors=%lu in %lu ms ok=%d\n"
+           , (unsigned long)s_reads.load(), (unsigned long)s_timeouts.load()
+           , (unsigned long)s_falseTimeouts.load(), (unsigned long)s_errors.load()
+           , (unsigned long)(cc::GetMonotonicMS() - start), ok);
+    return ok ? 0 : 1;
+}
+
+#else
+
+int main(){
+    printf("task_io_stress requires -std=c++20\n");
+    return 0;
+}
+
+#endif
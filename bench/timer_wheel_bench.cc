@@ -0,0 +1,83 @@
+//定时器管理的微基准测试
+//对比 std::set 和分层时间轮两种实现: 先放入大量存活的定时器，
+//然后模拟连接的建立和关闭，不断取消一个旧定时器、添加一个新定时器
+//
+//编译(在仓库根目录下):
+//  g++ -std=c++11 -O2 -I. bench/timer_wheel_bench.cc myserver/*.cc myserver/http/*.cc -o timer_wheel_bench -lyaml-cpp -lpthread -ldl
+//
+//运行: ./timer_wheel_bench [存活定时器数] [churn次数]
+
+#include "myserver/timer.h"
+#include "myserver/config.h"
+#include "myserver/util.h"
+#include "myserver/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <random>
+
+static size_t s_live = 1000000;
+static size_t s_churn = 2000000;
+
+class BenchTimerManager : public cc::TimerManager{
+protected:
+    void onTimerInsertedAtFront() override {}
+};
+
+static void Bench(bool wheel){
+    cc::Config::Lookup<bool>("timer.wheel")->setValue(wheel);
+    BenchTimerManager manager;
+    std::mt19937 rng(1);
+    //读超时在 1s ~ 120s 之间
+    std::uniform_int_distribution<uint64_t> timeout(1000, 120 * 1000);
+    std::vector<cc::Timer::ptr> timers;
+    timers.reserve(s_live);
+
+    uint64_t start = cc::GetCurrentUS();
+    for(size_t i = 0; i < s_live; ++i){
+        timers.push_back(manager.addTimer(timeout(rng), [](){}));
+    }
+    uint64_t fill = cc::GetCurrentUS() - start;
+
+    std::uniform_int_distribution<size_t> pick(0, s_live - 1);
+    std::vector<cc::Callback> cbs;
+    start = cc::GetCurrentUS();
+    for(size_t i = 0; i < s_churn; ++i){
+        size_t idx = pick(rng);
+        timers[idx]->cancel();
+        timers[idx] = manager.addTimer(timeout(rng), [](){});
+        //空闲循环也会频繁查询下一个定时器、检查超时
+        if((i & 1023) == 0){
+            manager.getNextTimer();
+            manager.listExpireCb(cbs);
+            cbs.clear();
+        }
+    }
+    uint64_t churn = cc::GetCurrentUS() - start;
+
+    start = cc::GetCurrentUS();
+    for(auto& t : timers){
+        t->cancel();
+    }
+    uint64_t cancel = cc::GetCurrentUS() - start;
+
+    printf("%-6s live=%zu fill %7.1f ns/add   churn %7.1f ns/(cancel+add)   cancel %7.1f ns\n",
+           wheel ? "wheel" : "set", s_live,
+           fill * 1000.0 / s_live,
+           churn * 1000.0 / s_churn,
+           cancel * 1000.0 / s_live);
+}
+
+int main(int argc, char** argv){
+    if(argc > 1){
+        s_live = strtoull(argv[1], nullptr, 10);
+    }
+    if(argc > 2){
+        s_churn = strtoull(argv[2], nullptr, 10);
+    }
+    CC_LOG_ROOT()->setLevel(cc::LogLevel::ERROR);
+    CC_LOG_NAME("system")->setLevel(cc::LogLevel::ERROR);
+
+    Bench(false);
+    Bench(true);
+    return 0;
+}
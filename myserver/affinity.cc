@@ -0,0 +1,118 @@
+#include "affinity.h"
+#include "log.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+namespace cc{
+
+static Logger::ptr g_logger = CC_LOG_NAME("system");
+
+static thread_local int t_bound_cpu = -1;
+static thread_local int t_bound_node = -1;
+
+std::vector<int> ParseCpuList(const std::string& str){
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while(pos < str.size()){
+        size_t end = str.find(',', pos);
+        if(end == std::string::npos){
+            end = str.size();
+        }
+        std::string item = str.substr(pos, end - pos);
+        pos = end + 1;
+        if(item.empty()){
+            continue;
+        }
+        char* p = nullptr;
+        long first = strtol(item.c_str(), &p, 10);
+        long last = first;
+        if(*p == '-'){
+            last = strtol(p + 1, &p, 10);
+        }
+        if(*p != '\0' || first < 0 || last < first){
+            CC_LOG_ERROR(g_logger) << "invalid cpu list item: " << item;
+            continue;
+        }
+        for(long i = first; i <= last; ++i){
+            cpus.push_back((int)i);
+        }
+    }
+    return cpus;
+}
+
+int GetCpuNode(int cpu){
+    //cpuN目录下有一个nodeM的链接
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR* dir = opendir(path.c_str());
+    if(!dir){
+        return 0;
+    }
+    int node = 0;
+    while(struct dirent* ent = readdir(dir)){
+        if(strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0'
+                && ent->d_name[4] <= '9'){
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+//节点掩码，节点数不超过unsigned long的位数
+static bool NodeMask(int node, unsigned long& mask){
+    if(node < 0 || node >= (int)(sizeof(mask) * 8)){
+        return false;
+    }
+    mask = 1ul << node;
+    return true;
+}
+
+bool BindThisThread(int cpu){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set)){
+        CC_LOG_ERROR(g_logger) << "sched_setaffinity cpu=" << cpu << " fail, errno="
+            << errno << " errstr=" << strerror(errno);
+        return false;
+    }
+    int node = GetCpuNode(cpu);
+    unsigned long mask = 0;
+    if(NodeMask(node, mask)
+            && syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8)){
+        CC_LOG_WARN(g_logger) << "set_mempolicy node=" << node << " fail, errno="
+            << errno << " errstr=" << strerror(errno);
+    }
+    t_bound_cpu = cpu;
+    t_bound_node = node;
+    return true;
+}
+
+int GetBoundCpu(){
+    return t_bound_cpu;
+}
+
+int GetBoundNode(){
+    return t_bound_node;
+}
+
+bool BindMemory(void* addr, size_t len, int node){
+    unsigned long mask = 0;
+    if(!NodeMask(node, mask)){
+        return false;
+    }
+    if(syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0)){
+        CC_LOG_WARN(g_logger) << "mbind node=" << node << " fail, errno="
+            << errno << " errstr=" << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,33 @@
+#ifndef __CC_AFFINITY_H__
+#define __CC_AFFINITY_H__
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+//CPU亲和性和NUMA内存放置
+//调度线程绑定到固定的核上，并把之后在本线程缺页的内存优先放到该核所在的NUMA节点，
+//协程栈按绑定的节点分配(mbind)，即使协程被同节点的其他线程窃取执行，栈也留在本节点。
+//直接使用sched_setaffinity/set_mempolicy/mbind系统调用，不依赖libnuma；
+//没有NUMA的机器上节点都是0，内存策略调用失败时只记录日志
+namespace cc{
+
+//解析CPU列表，格式同taskset -c/cpuset，例如"0-3,8,10-11"
+std::vector<int> ParseCpuList(const std::string& str);
+
+//cpu所在的NUMA节点，读取失败返回0
+int GetCpuNode(int cpu);
+
+//把当前线程绑定到cpu上，并把本线程的内存分配策略设为优先使用cpu所在的节点
+bool BindThisThread(int cpu);
+
+//当前线程绑定的cpu和NUMA节点，未绑定返回-1
+int GetBoundCpu();
+int GetBoundNode();
+
+//让[addr, addr + len)中还没有缺页的内存优先分配在node上，addr需要按页对齐
+bool BindMemory(void* addr, size_t len, int node);
+
+}
+
+#endif
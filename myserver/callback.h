@@ -0,0 +1,182 @@
+#ifndef __CC_CALLBACK_H__
+#define __CC_CALLBACK_H__
+
+#include <new>
+#include <utility>
+#include <functional>
+#include <type_traits>
+#include <stddef.h>
+
+namespace cc{
+
+/**
+ * 只能移动的void()回调，调度器、定时器、事件上下文中用它代替std::function<void()>
+ * 可调用对象不超过INLINE_SIZE字节(并且移动不抛异常)时直接放在对象内部，不分配内存；
+ * 更大的才放到堆上。std::function本身也能放进内联缓冲区，转换时不会再分配。
+ * 任务在队列之间只移动不拷贝，稳态下调度一个任务不需要分配内存
+ */
+class Callback{
+    //Fn&能否以()调用
+    template<class Fn>
+    struct IsCallable{
+        template<class U>
+        static auto Test(int) -> decltype(std::declval<U&>()(), std::true_type());
+        template<class U>
+        static std::false_type Test(...);
+        static const bool value = decltype(Test<Fn>(0))::value;
+    };
+public:
+    //内联缓冲区的大小，加上操作表指针整个对象正好一个缓存行
+    static const size_t INLINE_SIZE = 56;
+
+    Callback() noexcept {}
+    Callback(std::nullptr_t) noexcept {}
+
+    template<class F, class Fn = typename std::decay<F>::type
+             ,class = typename std::enable_if<!std::is_same<Fn, Callback>::value
+                        && IsCallable<Fn>::value>::type>
+    Callback(F&& f){
+        //空的std::function或者函数指针当作空回调
+        if(IsNull(f)){
+            return;
+        }
+        init<Fn>(std::forward<F>(f), std::integral_constant<bool, FitsInline<Fn>()>());
+    }
+
+    Callback(Callback&& other) noexcept{
+        moveFrom(other);
+    }
+
+    Callback& operator=(Callback&& other) noexcept{
+        if(this != &other){
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    Callback& operator=(std::nullptr_t) noexcept{
+        reset();
+        return *this;
+    }
+
+    template<class F, class Fn = typename std::decay<F>::type
+             ,class = typename std::enable_if<!std::is_same<Fn, Callback>::value
+                        && IsCallable<Fn>::value>::type>
+    Callback& operator=(F&& f){
+        Callback tmp(std::forward<F>(f));
+        reset();
+        moveFrom(tmp);
+        return *this;
+    }
+
+    Callback(const Callback&) = delete;
+    Callback& operator=(const Callback&) = delete;
+
+    ~Callback(){
+        reset();
+    }
+
+    explicit operator bool() const noexcept { return m_ops != nullptr;}
+
+    void operator()(){
+        m_ops->invoke(m_storage);
+    }
+
+    void reset() noexcept{
+        if(m_ops){
+            m_ops->destroy(m_storage);
+            m_ops = nullptr;
+        }
+    }
+
+    void swap(Callback& other) noexcept{
+        Callback tmp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    //可调用对象是否放在内联缓冲区中
+    bool isInline() const { return m_ops && m_ops->isInline;}
+private:
+    //按类型生成的操作表
+    struct Ops{
+        void (*invoke)(void* p);
+        //从src移动构造到dst，并析构src
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* p);
+        bool isInline;
+    };
+
+    template<class Fn>
+    static constexpr bool FitsInline(){
+        return sizeof(Fn) <= INLINE_SIZE && alignof(Fn) <= alignof(void*)
+               && std::is_nothrow_move_constructible<Fn>::value;
+    }
+
+    template<class Fn>
+    struct InlineOps{
+        static void Invoke(void* p) { (*static_cast<Fn*>(p))();}
+        static void Move(void* dst, void* src){
+            Fn* f = static_cast<Fn*>(src);
+            new (dst) Fn(std::move(*f));
+            f->~Fn();
+        }
+        static void Destroy(void* p) { static_cast<Fn*>(p)->~Fn();}
+        static const Ops s_ops;
+    };
+
+    template<class Fn>
+    struct HeapOps{
+        static void Invoke(void* p) { (**static_cast<Fn**>(p))();}
+        static void Move(void* dst, void* src){
+            *static_cast<Fn**>(dst) = *static_cast<Fn**>(src);
+        }
+        static void Destroy(void* p) { delete *static_cast<Fn**>(p);}
+        static const Ops s_ops;
+    };
+
+    template<class Fn>
+    static bool IsNull(const Fn&) { return false;}
+    template<class R, class... Args>
+    static bool IsNull(const std::function<R(Args...)>& f) { return !f;}
+    template<class R, class... Args>
+    static bool IsNull(R (* const& f)(Args...)) { return f == nullptr;}
+
+    template<class Fn, class F>
+    void init(F&& f, std::true_type){
+        new (m_storage) Fn(std::forward<F>(f));
+        m_ops = &InlineOps<Fn>::s_ops;
+    }
+
+    template<class Fn, class F>
+    void init(F&& f, std::false_type){
+        *reinterpret_cast<Fn**>(m_storage) = new Fn(std::forward<F>(f));
+        m_ops = &HeapOps<Fn>::s_ops;
+    }
+
+    void moveFrom(Callback& other) noexcept{
+        if(other.m_ops){
+            other.m_ops->move(m_storage, other.m_storage);
+            m_ops = other.m_ops;
+            other.m_ops = nullptr;
+        }
+    }
+private:
+    alignas(void*) unsigned char m_storage[INLINE_SIZE];
+    const Ops* m_ops = nullptr;
+};
+
+template<class Fn>
+const Callback::Ops Callback::InlineOps<Fn>::s_ops = {
+    &Callback::InlineOps<Fn>::Invoke, &Callback::InlineOps<Fn>::Move
+    ,&Callback::InlineOps<Fn>::Destroy, true};
+
+template<class Fn>
+const Callback::Ops Callback::HeapOps<Fn>::s_ops = {
+    &Callback::HeapOps<Fn>::Invoke, &Callback::HeapOps<Fn>::Move
+    ,&Callback::HeapOps<Fn>::Destroy, false};
+
+}
+
+#endif
@@ -4,11 +4,20 @@
 #include "log.h"
 #include "config.h"
 #include "util.h"
+#include "clock.h"
 #include "singleton.h"
 #include "thread.h"
 #include "macro.h"
 #include "fiber.h"
+#include "codel.h"
+#include "histogram.h"
+#include "affinity.h"
 #include "scheduler.h"
+#include "fiber_sync.h"
+#include "channel.h"
+#include "parallel.h"
+#include "fiber_local.h"
+#include "task.h"
 #include "iomanager.h"
 #include "hook.h"
 
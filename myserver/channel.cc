@@ -0,0 +1,197 @@
+#include "channel.h"
+#include "scheduler.h"
+#include "iomanager.h"
+#include "macro.h"
+
+namespace cc{
+
+static inline void CpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+ChannelWaitState::ptr ChannelWaitState::Create(){
+    ptr st(new ChannelWaitState);
+    st->scheduler = Scheduler::GetThis();
+    st->fiber = Fiber::GetThis();
+    CC_ASSERT2(st->scheduler && st->fiber.get() != Scheduler::GetMainFiber()
+               , "channel must wait inside a scheduled fiber");
+    return st;
+}
+
+bool ChannelWaitState::wake(ChannelBase* by, bool is_timeout){
+    int s = state.load(std::memory_order_acquire);
+    do{
+        //已经被别的通道或者定时器唤醒
+        if(s == CLAIMED || s == DONE){
+            return false;
+        }
+    }while(!state.compare_exchange_weak(s, CLAIMED, std::memory_order_acq_rel));
+    wokenBy = by;
+    timedout = is_timeout;
+    //DONE之后等待者可能马上返回，先取出需要的字段
+    Scheduler* sc = scheduler;
+    Fiber::ptr f = fiber;
+    //只有抢到唤醒权的一方会走到这里，可以直接移出
+    Callback resume = std::move(cb);
+    state.store(DONE, std::memory_order_release);
+    //还没有让出的协程自己会看到DONE，不用调度
+    if(s == WAITING){
+        if(resume){
+            sc->schedule(&resume);
+        } else {
+            sc->schedule(&f);
+        }
+    }
+    return true;
+}
+
+void ChannelBase::notify(Direction dir){
+    //与addWaiter中的屏障配对: 要么这里看到等待者，要么等待者挂上后看到数据
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_waitCount[dir].load(std::memory_order_relaxed) == 0){
+        return;
+    }
+    while(true){
+        ChannelWaitState::ptr st;
+        {
+            Spinlock::Lock lock(m_mutex);
+            if(m_waiters[dir].empty()){
+                return;
+            }
+            st = std::move(m_waiters[dir].front());
+            m_waiters[dir].pop_front();
+            m_waitCount[dir].fetch_sub(1, std::memory_order_relaxed);
+        }
+        //已经超时或者被其他通道唤醒的等待者跳过
+        if(st->wake(this, false)){
+            return;
+        }
+    }
+}
+
+void ChannelBase::close(){
+    m_closed.store(true, std::memory_order_release);
+    std::deque<ChannelWaitState::ptr> waiters[2];
+    {
+        Spinlock::Lock lock(m_mutex);
+        for(int i = 0; i < 2; ++i){
+            waiters[i].swap(m_waiters[i]);
+            m_waitCount[i].store(0, std::memory_order_relaxed);
+        }
+    }
+    for(int i = 0; i < 2; ++i){
+        for(auto& st : waiters[i]){
+            st->wake(this, false);
+        }
+    }
+}
+
+bool ChannelBase::addWaiter(Direction dir, const ChannelWaitState::ptr& st){
+    Spinlock::Lock lock(m_mutex);
+    m_waiters[dir].push_back(st);
+    m_waitCount[dir].fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    //挂上之前对端可能已经放入/取走了数据，或者通道已经关闭
+    if(ready(dir)){
+        m_waiters[dir].pop_back();
+        m_waitCount[dir].fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void ChannelBase::delWaiter(Direction dir, const ChannelWaitState::ptr& st){
+    Spinlock::Lock lock(m_mutex);
+    auto& waiters = m_waiters[dir];
+    for(auto it = waiters.begin(); it != waiters.end(); ++it){
+        if(*it == st){
+            waiters.erase(it);
+            m_waitCount[dir].fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+bool ChannelBase::Park(const ChannelWaitState::ptr& st, uint64_t deadline_ms){
+    Timer::ptr timer;
+    if(deadline_ms != ~0ull){
+        uint64_t now = GetNowMS();
+        if(deadline_ms <= now){
+            //已经到期，抢到唤醒权就是超时，否则已经被通道唤醒
+            if(st->wake(nullptr, true)){
+                return false;
+            }
+        } else {
+            IOManager* iom = IOManager::GetThis();
+            CC_ASSERT2(iom, "channel timeout requires an IOManager");
+            std::weak_ptr<ChannelWaitState> weak_st(st);
+            timer = iom->addInlineTimer(deadline_ms - now, [weak_st](){
+                ChannelWaitState::ptr s = weak_st.lock();
+                if(s){
+                    s->wake(nullptr, true);
+                }
+            });
+        }
+    }
+    int expected = ChannelWaitState::PENDING;
+    if(st->state.compare_exchange_strong(expected, ChannelWaitState::WAITING
+                , std::memory_order_acq_rel)){
+        Fiber::YieldToHold();
+    }
+    //唤醒者正在写结果，很快就会完成
+    while(st->state.load(std::memory_order_acquire) != ChannelWaitState::DONE){
+        CpuRelax();
+    }
+    if(timer){
+        timer->cancel();
+    }
+    return !st->timedout;
+}
+
+bool ChannelBase::wait(Direction dir, uint64_t deadline_ms){
+    ChannelWaitState::ptr st = ChannelWaitState::Create();
+    if(!addWaiter(dir, st)){
+        return true;
+    }
+    if(!Park(st, deadline_ms)){
+        delWaiter(dir, st);
+        return false;
+    }
+    return true;
+}
+
+bool ChannelBase::WaitAny(const std::vector<ChannelBase*>& chans, uint64_t deadline_ms
+                          ,ChannelBase*& woken){
+    ChannelWaitState::ptr st = ChannelWaitState::Create();
+    for(size_t i = 0; i < chans.size(); ++i){
+        if(!chans[i]->addWaiter(RECV, st)){
+            //已经有通道就绪，摘掉前面挂上的
+            for(size_t j = 0; j < i; ++j){
+                chans[j]->delWaiter(RECV, st);
+            }
+            //前面的通道可能已经抢到了唤醒权，需要告诉调用者
+            if(!st->wake(nullptr, false)){
+                while(st->state.load(std::memory_order_acquire) != ChannelWaitState::DONE){
+                    CpuRelax();
+                }
+                woken = st->wokenBy;
+            }
+            return true;
+        }
+    }
+    bool ok = Park(st, deadline_ms);
+    woken = st->wokenBy;
+    //唤醒它的通道已经把它摘掉了
+    for(auto& i : chans){
+        if(i != woken){
+            i->delWaiter(RECV, st);
+        }
+    }
+    return ok;
+}
+
+}
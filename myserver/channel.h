@@ -0,0 +1,274 @@
+#ifndef __CC_CHANNEL_H__
+#define __CC_CHANNEL_H__
+
+#include <memory>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+#include "fiber.h"
+#include "thread.h"
+#include "noncopyable.h"
+#include "clock.h"
+#include "callback.h"
+
+//协程之间传递数据的有界通道，类似go的channel
+//数据放在一个定长的环形队列中，每个槽带一个序号(Dmitry Vyukov的有界MPMC队列)，
+//收发都不加锁，单生产者单消费者时也就是无锁的。
+//队列满/空时收发的协程挂起，由对端取走/放入数据后唤醒；只有存在挂起的协程时才会加锁。
+//超时等待使用当前IOManager的定时器。
+namespace cc{
+
+class Scheduler;
+class ChannelBase;
+
+//一次挂起等待，可以同时挂在多个通道上(Select)，只会被唤醒一次
+struct ChannelWaitState{
+    using ptr = std::shared_ptr<ChannelWaitState>;
+    enum State{
+        //已经挂到通道上，协程还没有让出
+        PENDING,
+        //协程已经(或即将)让出，唤醒时需要重新调度
+        WAITING,
+        //唤醒者正在写入结果
+        CLAIMED,
+        //已经被唤醒
+        DONE
+    };
+    std::atomic<int> state = {PENDING};
+    Scheduler* scheduler = nullptr;
+    Fiber::ptr fiber;
+    //不为空时唤醒调度cb而不是fiber(Task中的等待)
+    Callback cb;
+    //唤醒它的通道，超时为nullptr
+    ChannelBase* wokenBy = nullptr;
+    bool timedout = false;
+
+    //以当前协程创建
+    static ptr Create();
+    //抢占唤醒权，成功则写入结果并重新调度等待的协程
+    bool wake(ChannelBase* by, bool timedout);
+};
+
+//通道中与元素类型无关的部分: 挂起、唤醒和关闭
+class ChannelBase : Noncopyable{
+friend class ChannelAwaiterBase;
+public:
+    //关闭通道，唤醒所有等待者。关闭后不能再发送，已经放入的数据仍然可以接收
+    void close();
+    bool isClosed() const { return m_closed.load(std::memory_order_acquire);}
+protected:
+    enum Direction{
+        //等待接收的协程
+        RECV = 0,
+        //等待发送的协程
+        SEND = 1
+    };
+    ChannelBase() {}
+    virtual ~ChannelBase() {}
+
+    //是否可以不挂起地完成对应方向的操作(有数据可收/有空间可发)，或者已经关闭
+    virtual bool ready(Direction dir) const = 0;
+
+    //放入/取出数据之后调用，唤醒一个对端的等待者
+    void notify(Direction dir);
+
+    //等待直到对应方向可能就绪、通道关闭或者超时，超时返回false
+    //deadline_ms 截止时间(GetNowMS的基准)，~0ull表示不超时
+    bool wait(Direction dir, uint64_t deadline_ms);
+
+    //把st挂到通道上。挂上之后再检查一次，已经就绪则摘下并返回false
+    bool addWaiter(Direction dir, const ChannelWaitState::ptr& st);
+    void delWaiter(Direction dir, const ChannelWaitState::ptr& st);
+
+    //挂起当前协程直到st被唤醒或者超时，超时返回false
+    static bool Park(const ChannelWaitState::ptr& st, uint64_t deadline_ms);
+    //Select: 在多个通道上等待接收，woken返回唤醒它的通道
+    static bool WaitAny(const std::vector<ChannelBase*>& chans, uint64_t deadline_ms
+                        ,ChannelBase*& woken);
+    //被chan唤醒却从别的通道取到了数据，把唤醒转交给chan上的下一个等待者
+    static void Forward(ChannelBase* chan, Direction dir) { chan->notify(dir);}
+private:
+    Spinlock m_mutex;
+    std::deque<ChannelWaitState::ptr> m_waiters[2];
+    //挂起的等待者数量，为0时收发不需要加锁
+    std::atomic<size_t> m_waitCount[2] = {{0}, {0}};
+    std::atomic<bool> m_closed = {false};
+};
+
+template<class T>
+class Channel : public ChannelBase{
+public:
+    using ptr = std::shared_ptr<Channel>;
+
+    //capacity 最多缓存的元素个数，至少为1
+    Channel(size_t capacity)
+        :m_capacity(capacity ? capacity : 1)
+        ,m_cells(new Cell[m_capacity]) {
+        for(size_t i = 0; i < m_capacity; ++i){
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~Channel(){
+        delete[] m_cells;
+    }
+
+    size_t getCapacity() const { return m_capacity;}
+
+    //不挂起地发送，队列满或者已经关闭返回false
+    bool trySend(const T& v){
+        T tmp(v);
+        return trySend(std::move(tmp));
+    }
+
+    bool trySend(T&& v){
+        if(isClosed()){
+            return false;
+        }
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        while(true){
+            Cell& cell = m_cells[pos % m_capacity];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if(diff == 0){
+                //槽是空的，抢占这个位置
+                if(m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                    cell.data = std::move(v);
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    notify(RECV);
+                    return true;
+                }
+            } else if(diff < 0){
+                //满了
+                return false;
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    //不挂起地接收，队列空返回false
+    bool tryRecv(T& v){
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        while(true){
+            Cell& cell = m_cells[pos % m_capacity];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(diff == 0){
+                if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                    v = std::move(cell.data);
+                    cell.seq.store(pos + m_capacity, std::memory_order_release);
+                    notify(SEND);
+                    return true;
+                }
+            } else if(diff < 0){
+                //空的
+                return false;
+            } else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    //发送，队列满时挂起当前协程。通道已经关闭返回false
+    bool send(const T& v){
+        T tmp(v);
+        return send(std::move(tmp));
+    }
+
+    bool send(T&& v){
+        while(!trySend(std::move(v))){
+            if(isClosed()){
+                return false;
+            }
+            wait(SEND, ~0ull);
+        }
+        return true;
+    }
+
+    //接收，队列空时挂起当前协程
+    //通道关闭且数据已经取完，或者超时返回false
+    //timeout_ms 超时时间(毫秒)，~0ull表示不超时，需要在IOManager中使用
+    bool recv(T& v, uint64_t timeout_ms = ~0ull){
+        uint64_t deadline = timeout_ms == ~0ull ? ~0ull : Deadline(timeout_ms);
+        while(!tryRecv(v)){
+            if(isClosed()){
+                //关闭前放入的数据
+                return tryRecv(v);
+            }
+            if(!wait(RECV, deadline)){
+                return tryRecv(v);
+            }
+        }
+        return true;
+    }
+
+    /**
+     * 同时在多个通道上接收，类似go的select
+     * 返回收到数据的通道下标；全部关闭且没有数据返回-1；超时返回-2
+     */
+    static int Select(const std::vector<Channel*>& chans, T& v, uint64_t timeout_ms = ~0ull){
+        uint64_t deadline = timeout_ms == ~0ull ? ~0ull : Deadline(timeout_ms);
+        std::vector<ChannelBase*> opened;
+        ChannelBase* woken = nullptr;
+        while(true){
+            //已经关闭且取完的通道不再等待
+            opened.clear();
+            for(size_t i = 0; i < chans.size(); ++i){
+                if(chans[i]->tryRecv(v)
+                        || (chans[i]->isClosed() && chans[i]->tryRecv(v))){
+                    if(woken && woken != chans[i]){
+                        Forward(woken, RECV);
+                    }
+                    return i;
+                }
+                if(!chans[i]->isClosed()){
+                    opened.push_back(chans[i]);
+                }
+            }
+            if(opened.empty()){
+                return -1;
+            }
+            woken = nullptr;
+            if(!WaitAny(opened, deadline, woken)){
+                for(size_t i = 0; i < chans.size(); ++i){
+                    if(chans[i]->tryRecv(v)){
+                        return i;
+                    }
+                }
+                return -2;
+            }
+        }
+    }
+protected:
+    bool ready(Direction dir) const override{
+        if(isClosed()){
+            return true;
+        }
+        if(dir == RECV){
+            size_t pos = m_head.load(std::memory_order_relaxed);
+            return m_cells[pos % m_capacity].seq.load(std::memory_order_acquire) == pos + 1;
+        }
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        return m_cells[pos % m_capacity].seq.load(std::memory_order_acquire) == pos;
+    }
+private:
+    static uint64_t Deadline(uint64_t timeout_ms){
+        return GetNowMS() + timeout_ms;
+    }
+private:
+    struct Cell{
+        std::atomic<size_t> seq;
+        T data;
+    };
+    const size_t m_capacity;
+    Cell* m_cells;
+    //生产者和消费者各自修改的位置放在不同的缓存行
+    alignas(64) std::atomic<size_t> m_tail = {0};
+    alignas(64) std::atomic<size_t> m_head = {0};
+};
+
+}
+
+#endif
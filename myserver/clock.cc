@@ -0,0 +1,171 @@
+#include "clock.h"
+#include "config.h"
+#include "log.h"
+#include <atomic>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+namespace cc{
+
+static Logger::ptr g_logger = CC_LOG_NAME("system");
+
+static ConfigVar<std::string>::ptr g_clock_source =
+    Config::Lookup<std::string>("clock.source", "coarse", "monotonic clock source: coarse, monotonic or tsc");
+
+enum ClockSource{
+    COARSE,
+    MONOTONIC,
+    TSC
+};
+
+//时钟源及其TSC校准参数，创建后不再修改
+//配置可能在调度线程读取时钟的同时被修改，切换时发布一个新的快照，读取方一次load取得一致的参数
+//旧的快照可能还有线程在用，不释放；只有切换到tsc时才分配，数量很少
+struct ClockState{
+    ClockSource source;
+    //TSC换算: ns = tsc_base_ns + ((tsc - tsc_base) * tsc_mult) >> 32
+    uint64_t tsc_base;
+    uint64_t tsc_base_ns;
+    uint64_t tsc_mult;
+};
+static const ClockState s_coarse_state = {COARSE, 0, 0, 0};
+static const ClockState s_monotonic_state = {MONOTONIC, 0, 0, 0};
+static std::atomic<const ClockState*> s_clock_state(&s_coarse_state);
+
+static uint64_t ReadClock(clockid_t id){
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1000 * 1000 * 1000ul + ts.tv_nsec;
+}
+
+//对照CLOCK_MONOTONIC忙等10ms，计算每个TSC周期对应的纳秒数
+static bool CalibrateTsc(ClockState& state){
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    //CPUID.80000007H:EDX[8] invariant TSC，频率恒定且不受节能状态影响
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8))){
+        return false;
+    }
+    uint64_t ns0 = ReadClock(CLOCK_MONOTONIC);
+    uint64_t tsc0 = __rdtsc();
+    uint64_t ns1 = 0;
+    do{
+        ns1 = ReadClock(CLOCK_MONOTONIC);
+    } while(ns1 - ns0 < 10 * 1000 * 1000);
+    uint64_t tsc1 = __rdtsc();
+    if(tsc1 <= tsc0){
+        return false;
+    }
+    state.tsc_mult = ((ns1 - ns0) << 32) / (tsc1 - tsc0);
+    state.tsc_base = tsc1;
+    state.tsc_base_ns = ns1;
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void SetClockSource(const std::string& name){
+    if(name == "tsc"){
+        ClockState state = {TSC, 0, 0, 0};
+        if(CalibrateTsc(state)){
+            s_clock_state.store(new ClockState(state), std::memory_order_release);
+            CC_LOG_INFO(g_logger) << "clock source tsc, mult=" << state.tsc_mult;
+            return;
+        }
+        CC_LOG_WARN(g_logger) << "invariant tsc not available, fall back to monotonic";
+        s_clock_state.store(&s_monotonic_state, std::memory_order_release);
+    } else if(name == "monotonic"){
+        s_clock_state.store(&s_monotonic_state, std::memory_order_release);
+    } else {
+        if(name != "coarse"){
+            CC_LOG_ERROR(g_logger) << "unknown clock.source " << name << ", use coarse";
+        }
+        s_clock_state.store(&s_coarse_state, std::memory_order_release);
+    }
+}
+
+struct _ClockIniter{
+    _ClockIniter(){
+        SetClockSource(g_clock_source->getValue());
+        g_clock_source->addListener([](const std::string& old_value, const std::string& new_value){
+            SetClockSource(new_value);
+        });
+    }
+};
+static _ClockIniter s_clock_initer;
+
+//单调时间，纳秒
+static uint64_t ReadMonotonicNS(const ClockState* state){
+    switch(state->source){
+#if defined(__x86_64__)
+        case TSC: {
+            uint64_t tsc = __rdtsc();
+            //其他核上的TSC可能略小于校准时的值
+            if(tsc < state->tsc_base){
+                return state->tsc_base_ns;
+            }
+            return state->tsc_base_ns
+                + (uint64_t)(((unsigned __int128)(tsc - state->tsc_base) * state->tsc_mult) >> 32);
+        }
+#endif
+        case MONOTONIC:
+            return ReadClock(CLOCK_MONOTONIC);
+        default:
+            return ReadClock(CLOCK_MONOTONIC_COARSE);
+    }
+}
+
+uint64_t GetMonotonicMS(){
+    return ReadMonotonicNS(s_clock_state.load(std::memory_order_acquire)) / (1000 * 1000);
+}
+
+uint64_t GetMonotonicUS(){
+    const ClockState* state = s_clock_state.load(std::memory_order_acquire);
+    //微秒级的时间不使用低精度时钟
+    if(state->source == COARSE){
+        return ReadClock(CLOCK_MONOTONIC) / 1000;
+    }
+    return ReadMonotonicNS(state) / 1000;
+}
+
+//当前线程是否开启了时间缓存
+static thread_local bool t_now_cached = false;
+static thread_local uint64_t t_now_ms = 0;
+//系统时间只在缓存的单调时间变化后才重新读取
+static thread_local uint64_t t_wall_updated_ms = ~0ull;
+static thread_local time_t t_wall_sec = 0;
+
+uint64_t GetNowMS(){
+    if(t_now_cached){
+        return t_now_ms;
+    }
+    return GetMonotonicMS();
+}
+
+time_t GetNowSeconds(){
+    if(!t_now_cached){
+        return time(0);
+    }
+    if(t_wall_updated_ms != t_now_ms){
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        t_wall_sec = ts.tv_sec;
+        t_wall_updated_ms = t_now_ms;
+    }
+    return t_wall_sec;
+}
+
+void UpdateNow(){
+    t_now_ms = GetMonotonicMS();
+    t_now_cached = true;
+}
+
+void ClearNow(){
+    t_now_cached = false;
+    t_wall_updated_ms = ~0ull;
+}
+
+}
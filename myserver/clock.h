@@ -0,0 +1,35 @@
+#ifndef __CC_CLOCK_H__
+#define __CC_CLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+
+//时钟服务
+//定时器、超时使用单调时钟，不受系统时间修改的影响。
+//时钟源由配置clock.source决定:
+//  coarse:    CLOCK_MONOTONIC_COARSE，只读一次vDSO中的数据，精度为内核tick(通常1~4ms)，默认
+//  monotonic: CLOCK_MONOTONIC，精确到纳秒，开销稍大
+//  tsc:       rdtsc，启动时对照CLOCK_MONOTONIC校准，要求CPU支持invariant TSC，否则退回monotonic
+//调度线程缓存当前时间: 每次epoll_wait返回、每次取到任务时刷新一次，
+//期间定时器、日志等读取的都是缓存的时间，不再重复调用时钟。
+//没有缓存的线程(非调度线程)每次直接读取时钟。
+
+namespace cc{
+
+//单调时钟，直接读取时钟源
+uint64_t GetMonotonicMS();
+uint64_t GetMonotonicUS();
+
+//当前线程缓存的单调时间(毫秒)
+uint64_t GetNowMS();
+//当前线程缓存的系统时间(秒)，日志使用
+time_t GetNowSeconds();
+
+//刷新当前线程缓存的时间，并开启缓存
+void UpdateNow();
+//关闭当前线程的时间缓存，线程不再是事件循环时调用
+void ClearNow();
+
+}
+
+#endif
@@ -0,0 +1,47 @@
+#include "codel.h"
+#include "log.h"
+
+namespace cc{
+
+static Logger::ptr g_logger = CC_LOG_NAME("system");
+
+CoDel::CoDel(uint64_t target, uint64_t interval)
+    :m_target(target)
+    ,m_interval(interval){
+}
+
+void CoDel::update(uint64_t sojourn, uint64_t now){
+    if(sojourn <= m_target){
+        //队列排空过(排队时间回落)，退出过载
+        //先读再写，正常情况下不写共享的缓存行
+        if(m_firstAboveTime.load(std::memory_order_relaxed) != 0){
+            m_firstAboveTime.store(0, std::memory_order_relaxed);
+        }
+        if(m_overloaded.load(std::memory_order_relaxed)){
+            bool expected = true;
+            if(m_overloaded.compare_exchange_strong(expected, false
+                        , std::memory_order_relaxed)){
+                CC_LOG_INFO(g_logger) << "CoDel leave overload, sojourn=" << sojourn << "ms";
+            }
+        }
+        return;
+    }
+    uint64_t first = m_firstAboveTime.load(std::memory_order_relaxed);
+    if(first == 0){
+        //刚高于target，interval之后还没回落才算过载
+        m_firstAboveTime.compare_exchange_strong(first, now + m_interval
+                    , std::memory_order_relaxed);
+        return;
+    }
+    if(now >= first && !m_overloaded.load(std::memory_order_relaxed)){
+        bool expected = false;
+        if(m_overloaded.compare_exchange_strong(expected, true
+                    , std::memory_order_relaxed)){
+            ++m_overloadCount;
+            CC_LOG_WARN(g_logger) << "CoDel enter overload, sojourn=" << sojourn
+                << "ms target=" << m_target << "ms interval=" << m_interval << "ms";
+        }
+    }
+}
+
+}
@@ -0,0 +1,49 @@
+#ifndef __CC_CODEL_H__
+#define __CC_CODEL_H__
+
+#include <stdint.h>
+#include <atomic>
+
+namespace cc{
+
+/**
+ * CoDel(Controlled Delay)过载检测，用任务在队列中的等待时间(sojourn)判断调度器是否过载
+ * 只看队列长度分不清突发和持续过载；CoDel看的是排队时间在interval内有没有回到target以下:
+ * 突发时队列很快会被排空，等待时间回落；持续过载时形成常驻队列，等待时间一直高于target。
+ * 调度线程每取出一个任务调用update()，传入该队列中最老任务的等待时间，
+ * 这样本地队列按LIFO取任务时，新任务等待时间很短也不会掩盖队列中积压的老任务。
+ * 过载期间，等待时间超过target的任务(连接、请求)应当快速失败，而不是继续排队拖慢所有人
+ * 多个调度线程并发更新，只用原子变量，不加锁
+ */
+class CoDel{
+public:
+    //target: 可以接受的排队时间(毫秒)
+    //interval: 排队时间持续高于target多久认为过载(毫秒)
+    CoDel(uint64_t target = 5, uint64_t interval = 100);
+
+    void setTarget(uint64_t v) { m_target = v;}
+    void setInterval(uint64_t v) { m_interval = v;}
+    uint64_t getTarget() const { return m_target;}
+    uint64_t getInterval() const { return m_interval;}
+
+    //记录一次排队时间，sojourn为队列中最老任务的等待时间，now为当前单调时间(毫秒)
+    void update(uint64_t sojourn, uint64_t now);
+
+    //是否处于过载状态
+    bool isOverloaded() const { return m_overloaded.load(std::memory_order_relaxed);}
+    //排队时间为sojourn的任务是否应该被丢弃: 过载并且等待时间超过target
+    bool shouldDrop(uint64_t sojourn) const { return sojourn > m_target && isOverloaded();}
+    //进入过载状态的次数
+    uint64_t getOverloadCount() const { return m_overloadCount;}
+private:
+    uint64_t m_target;
+    uint64_t m_interval;
+    //排队时间第一次高于target之后再过interval的时刻，0表示当前低于target
+    std::atomic<uint64_t> m_firstAboveTime {0};
+    std::atomic<bool> m_overloaded {false};
+    std::atomic<uint64_t> m_overloadCount {0};
+};
+
+}
+
+#endif
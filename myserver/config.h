@@ -85,6 +85,31 @@ public:
 
 };
 
+//bool与string之间的转换不经过boost，使用YAML的写法
+//lexical_cast只认"1"/"0"，配置文件中的true/false会转换失败；
+//而且gcc 12 -O2下lexical_cast<std::string>(bool)内联后会误报-Wrestrict
+template<>
+class LexicalCast<std::string, bool> {
+public:
+    bool operator()(const std::string& v){
+        //YAML的bool写法(true/false/yes/no/on/off等)，其余按lexical_cast处理("1"/"0")
+        YAML::Node node = YAML::Load(v);
+        bool rt = false;
+        if(node.IsScalar() && YAML::convert<bool>::decode(node, rt)){
+            return rt;
+        }
+        return boost::lexical_cast<bool>(v);
+    }
+};
+
+template<>
+class LexicalCast<bool, std::string> {
+public:
+    std::string operator()(const bool& v){
+        return v ? "true" : "false";
+    }
+};
+
 //vector与string类型的偏特化版本，以下部分均类似
 template<class T>
 class LexicalCast<std::string, std::vector<T> >{
@@ -1,11 +1,18 @@
 #include "fd_manager.h"
 #include "hook.h"
+#include "log.h"
+#include "macro.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <new>
 
 namespace cc{
 
+static cc::Logger::ptr g_logger = CC_LOG_NAME("system");
+
 FdCtx::FdCtx(int fd)
     :m_isInit(false)
     ,m_isSocket(false)
@@ -15,7 +22,7 @@ FdCtx::FdCtx(int fd)
     ,m_fd(fd)
     ,m_recvTimeout(-1)
     ,m_sendTimeout(-1){
-    init();
+    m_eventCtx.fd = fd;
 }
 
 FdCtx::~FdCtx(){
@@ -78,6 +85,12 @@ void FdCtx::setTimeout(int type, uint64_t v){
     }
 }
 
+void FdCtx::resetEventContext(){
+    IOManager::FdContext::MutexType::Lock lock(m_eventCtx.mutex);
+    m_eventCtx.registered = 0;
+    m_eventCtx.ready = IOManager::NONE;
+}
+
 //获取超时时间
 uint64_t FdCtx::getTimeout(int type){
     if(type == SO_RCVTIMEO){
@@ -87,49 +100,134 @@ uint64_t FdCtx::getTimeout(int type){
     }
 }
 
-//
+FdManager::ChunkDir* FdManager::NewDir(size_t count, ChunkDir* prev){
+    ChunkDir* dir = new ChunkDir;
+    dir->count = count;
+    dir->chunks = new std::atomic<FdCtx*>[count];
+    dir->prev = prev;
+    for(size_t i = 0; i < count; ++i){
+        dir->chunks[i].store(i < (prev ? prev->count : 0)
+                    ? prev->chunks[i].load(std::memory_order_relaxed) : nullptr
+                , std::memory_order_relaxed);
+    }
+    return dir;
+}
+
+//块目录按RLIMIT_NOFILE的软限制分配，最多MAX_INIT_FDS，程序提高限制后再扩大
 FdManager::FdManager(){
-    m_datas.resize(64);
+    rlim_t max_fd = MAX_INIT_FDS;
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < max_fd){
+        max_fd = rl.rlim_cur;
+    }
+    m_dir.store(NewDir((max_fd + CHUNK_SIZE - 1) >> CHUNK_SHIFT, nullptr)
+                , std::memory_order_relaxed);
+}
 
+FdManager::~FdManager(){
+    ChunkDir* dir = m_dir.load(std::memory_order_relaxed);
+    for(size_t i = 0; i < dir->count; ++i){
+        FdCtx* chunk = dir->chunks[i].load(std::memory_order_relaxed);
+        if(chunk){
+            for(size_t j = 0; j < CHUNK_SIZE; ++j){
+                chunk[j].~FdCtx();
+            }
+            free(chunk);
+        }
+    }
+    while(dir){
+        ChunkDir* prev = dir->prev;
+        delete[] dir->chunks;
+        delete dir;
+        dir = prev;
+    }
 }
 
-//获取,根据auto_create判断是否自动创建
-FdCtx::ptr FdManager::get(int fd, bool auto_create){
-    if(fd == -1){
+FdCtx* FdManager::allocChunk(size_t index){
+    MutexType::Lock lock(m_mutex);
+    ChunkDir* dir = m_dir.load(std::memory_order_relaxed);
+    if(index < dir->count){
+        //其他线程先分配了，用它的
+        FdCtx* chunk = dir->chunks[index].load(std::memory_order_relaxed);
+        if(chunk){
+            return chunk;
+        }
+    } else {
+        size_t count = dir->count ? dir->count : 1;
+        while(count <= index){
+            count <<= 1;
+        }
+        dir = NewDir(count, dir);
+        m_dir.store(dir, std::memory_order_release);
+    }
+    //FdCtx按缓存行对齐，C++17之前的new不保证超过16字节的对齐
+    void* mem = nullptr;
+    if(posix_memalign(&mem, alignof(FdCtx), sizeof(FdCtx) * CHUNK_SIZE)){
+        throw std::bad_alloc();
+    }
+    FdCtx* chunk = (FdCtx*)mem;
+    for(size_t j = 0; j < CHUNK_SIZE; ++j){
+        new (&chunk[j]) FdCtx((index << CHUNK_SHIFT) + j);
+    }
+    dir->chunks[index].store(chunk, std::memory_order_release);
+    return chunk;
+}
+
+FdCtx::ptr FdManager::slot(int fd, bool alloc){
+    if(fd < 0){
         return nullptr;
     }
-    RWMutexType::ReadLock lock(m_mutex);
-    //查看是否已经创建
-    if((int)m_datas.size() <= fd) {
-        //没有且不自动创建
-        if(auto_create == false){
+    size_t index = (size_t)fd >> CHUNK_SHIFT;
+    ChunkDir* dir = m_dir.load(std::memory_order_acquire);
+    FdCtx* chunk = index < dir->count
+                ? dir->chunks[index].load(std::memory_order_acquire) : nullptr;
+    if(CC_UNLIKELY(!chunk)){
+        if(!alloc){
             return nullptr;
         }
-    } else {
-        //如果有或者不用自动创建
-        if(m_datas[fd] || !auto_create){
-            return m_datas[fd];
-        }
+        chunk = allocChunk(index);
+    }
+    return &chunk[fd & (CHUNK_SIZE - 1)];
+}
+
+//获取,根据auto_create判断是否自动创建
+FdCtx::ptr FdManager::get(int fd, bool auto_create){
+    FdCtx::ptr ctx = slot(fd, auto_create);
+    if(!ctx){
+        return nullptr;
+    }
+    //已经被管理
+    if(CC_LIKELY(ctx->m_live.load(std::memory_order_acquire))){
+        return ctx;
+    }
+    if(!auto_create){
+        return nullptr;
     }
-    lock.unlock();
 
     //没有但需要自动创建
-    RWMutexType::WriteLock lock2(m_mutex);
-    if (fd >= (int)m_datas.size()) {
-        m_datas.resize(fd * 1.5);
+    MutexType::Lock lock(m_mutex);
+    if(!ctx->m_live.load(std::memory_order_relaxed)){
+        ctx->m_isInit = false;
+        ctx->init();
+        ctx->resetEventContext();
+        ctx->m_live.store(true, std::memory_order_release);
     }
-    FdCtx::ptr ctx(new FdCtx(fd));
-    m_datas[fd] = ctx;
     return ctx;
 }
 
 void FdManager::del(int fd){
-    RWMutexType::WriteLock lock(m_mutex);
+    FdCtx::ptr ctx = slot(fd, false);
     //没有找到
-    if((int)m_datas.size() <= fd) {
+    if(!ctx){
         return;
-    } 
-    m_datas[fd].reset();
+    }
+    //fd关闭后内核已经把它从epoll中删除，同一个fd号再使用时需要重新注册
+    ctx->resetEventContext();
+    if(!ctx->m_live.load(std::memory_order_acquire)){
+        return;
+    }
+    MutexType::Lock lock(m_mutex);
+    ctx->m_live.store(false, std::memory_order_release);
 }
 
-}
\ No newline at end of file
+}
@@ -8,17 +8,23 @@
 // #include <sys/types.h>
 #include "singleton.h"
 #include <vector>
+#include <atomic>
 
 //更好的管理socket文件，
 //使用fdmanager管理每个socket fd，
 //并且为每个socket文件隐式的设置为O_NONBLOCK非阻塞
+//每个fd只有一条记录FdCtx，同时保存阻塞模式、超时时间和IOManager的事件等待者，
+//记录存放在按fd下标访问的分块表中，块分配后不会移动也不会释放，读取不需要加锁
+//一条记录在x86-64上是384字节(大部分是读写两个事件的等待者)，每块256条约96KB，只在用到时分配
 
 namespace cc{
 //FdCtx存储每一个fd相关的信息，并由FdManager管理每一个FdCtx，FdManager为单例类
-class FdCtx : public std::enable_shared_from_this<FdCtx>{
+//按缓存行对齐，相邻fd的记录不会互相伪共享
+class alignas(64) FdCtx{
 
 public:
-    using ptr = std::shared_ptr<FdCtx>;
+    //记录常驻在FdManager的表中，由表持有，这里只是指针
+    using ptr = FdCtx*;
     FdCtx(int fd);
     ~FdCtx();
     bool init() ;
@@ -35,41 +41,77 @@ public:
 
     void setTimeout(int type, uint64_t v);
     uint64_t getTimeout(int type);
+
+    //IOManager在该fd上的事件等待者
+    IOManager::FdContext& getEventContext() { return m_eventCtx;}
+    //清除常驻注册的状态，fd关闭或者记录重新创建时调用
+    void resetEventContext();
 private:
+    friend class FdManager;
+    //是否被FdManager管理(get(fd, true)之后，del之前)
+    std::atomic<bool> m_live = {false};
     //是否初始化
-    bool m_isInit : 1;
+    bool m_isInit;
     //是否是socket
-    bool m_isSocket : 1;
+    bool m_isSocket;
     //是否 hook非阻塞
-    bool m_sysNonblock : 1;
+    bool m_sysNonblock;
     //是否 用户主动设置非阻塞
-    bool m_userNonblock : 1;
+    bool m_userNonblock;
     //是否关闭
-    bool m_isClosed : 1;
+    bool m_isClosed;
     //文件描述符
     int m_fd;
     //读超时时间/毫秒
     uint64_t m_recvTimeout;
     //写超时时间毫秒
     uint64_t m_sendTimeout;
-    //cc::IOManager* m_iomanager;
+    //IOManager的事件上下文
+    IOManager::FdContext m_eventCtx;
 };
 
 class FdManager{
 public:
-    using RWMutexType = RWMutex;
+    using MutexType = Spinlock;
+    //按RLIMIT_NOFILE的软限制预先分配块目录，之后按需分配块、扩大目录
     FdManager();
+    ~FdManager();
 
+    //获取fd的记录，auto_create为true时没有则创建并初始化
+    //fd没有被管理时返回nullptr
     FdCtx::ptr get(int fd, bool auto_create = false);
     void del(int fd);
+
+    //获取fd所在的记录，不关心是否被管理，IOManager用来存放事件等待者
+    //alloc为false时所在的块还没有分配则返回nullptr
+    FdCtx::ptr slot(int fd, bool alloc);
 private:
-    RWMutexType m_mutex;
-    std::vector<FdCtx::ptr> m_datas;
+    //每块的记录数
+    static const size_t CHUNK_SHIFT = 8;
+    static const size_t CHUNK_SIZE = 1 << CHUNK_SHIFT;
+    //目录初始最多覆盖的fd数，软限制很大或者不受限时不会一开始就分配巨大的目录
+    static const size_t MAX_INIT_FDS = 1 << 16;
 
+    //块目录，扩大时复制一份更大的发布出去，旧目录挂在prev上直到析构才释放
+    //读者可能还在用旧目录，块指针不会移动，旧目录里的块仍然有效
+    struct ChunkDir{
+        size_t count;
+        std::atomic<FdCtx*>* chunks;
+        ChunkDir* prev;
+    };
+    static ChunkDir* NewDir(size_t count, ChunkDir* prev);
+
+    //分配第index块，必要时扩大目录，加锁进行
+    FdCtx* allocChunk(size_t index);
+private:
+    //创建和删除记录、分配块和扩大目录时加锁，读取不加锁
+    MutexType m_mutex;
+    //当前的块目录
+    std::atomic<ChunkDir*> m_dir;
 };
 
 typedef Singleton<FdManager> FdMgr;
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -4,19 +4,32 @@
 #include "macro.h"
 #include "log.h"
 #include "scheduler.h"
+#include "affinity.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
 
 //协程模块主要包括协程的构造，析构，切换，执行
 //构造分为主协程和普通协程 (在不使用main线程的情况下，主协程 = 调度协程)
 //主协程不分配栈空间
 //子协程绑定一个协程入口函数(mainfunc)，当执行该协程时，
 //切换到其入口函数，并在其中执行其cb(协程具体实现)
-//切换基于swapcontext执行，关注切换时当前上下文保存给谁
+//切换基于SwapContext(默认为汇编实现，可退回swapcontext)执行，关注切换时当前上下文保存给谁
 
 namespace cc
 {
 
 static Logger::ptr g_logger = CC_LOG_NAME("system");
 
+static inline void CpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
 //全局静态变量，用于生成协程id
 static std::atomic<uint64_t> s_fiber_id {0};
 //全局静态变量，用于统计当前的协程数
@@ -28,23 +41,181 @@ static thread_local Fiber* t_fiber = nullptr;
 //当前线程中的主协程
 static thread_local Fiber::ptr t_threadFiber = nullptr;
 
+//已经分配的协程局部存储槽位数，以及每个槽位的值的析构函数
+static std::atomic<size_t> s_local_slots {0};
+static void (*s_local_destroyers[Fiber::LOCAL_SLOTS])(void*);
+
 static ConfigVar<uint32_t>::ptr g_fiber_stack_size = 
     Config::Lookup<uint32_t>("fiber.stack_size", 128 * 1024, "fiber stack size");
-
-
-class MallocStackAllocator{
+static ConfigVar<uint32_t>::ptr g_fiber_stack_cache_size = 
+    Config::Lookup<uint32_t>("fiber.stack_cache_size", 256, "max cached fiber stacks per thread");
+static ConfigVar<bool>::ptr g_fiber_stack_trim = 
+    Config::Lookup<bool>("fiber.stack_trim", false, "release cold pages of cached fiber stacks");
+static ConfigVar<uint32_t>::ptr g_fiber_stack_trim_keep = 
+    Config::Lookup<uint32_t>("fiber.stack_trim_keep", 16 * 1024, "bytes kept resident at the top of a trimmed stack");
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_size = 
+    Config::Lookup<uint32_t>("fiber.shared_stack_size", 1024 * 1024, "per-thread shared stack size");
+
+//创建协程时使用，避免每次都对配置项加锁
+static uint32_t s_fiber_stack_size = 0;
+static uint32_t s_fiber_stack_cache_size = 0;
+static bool s_fiber_stack_trim = false;
+static uint32_t s_fiber_stack_trim_keep = 0;
+static uint32_t s_fiber_shared_stack_size = 0;
+
+struct _FiberIniter{
+    _FiberIniter(){
+        s_fiber_stack_size = g_fiber_stack_size->getValue();
+        s_fiber_stack_cache_size = g_fiber_stack_cache_size->getValue();
+        s_fiber_stack_trim = g_fiber_stack_trim->getValue();
+        s_fiber_stack_trim_keep = g_fiber_stack_trim_keep->getValue();
+        s_fiber_shared_stack_size = g_fiber_shared_stack_size->getValue();
+
+        g_fiber_stack_size->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            s_fiber_stack_size = new_value;
+        });
+        g_fiber_stack_cache_size->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            s_fiber_stack_cache_size = new_value;
+        });
+        g_fiber_stack_trim->addListener([](const bool& old_value, const bool& new_value){
+            s_fiber_stack_trim = new_value;
+        });
+        g_fiber_stack_trim_keep->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            s_fiber_stack_trim_keep = new_value;
+        });
+        //已经分配的共享栈不受影响
+        g_fiber_shared_stack_size->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            s_fiber_shared_stack_size = new_value;
+        });
+    }
+};
+static _FiberIniter s_fiber_initer;
+
+//mmap分配协程栈，在栈的低地址端(栈向下增长)多映射一个PROT_NONE的保护页，
+//栈溢出时立刻触发SIGSEGV，而不是悄悄踩坏相邻的内存。
+//释放的栈放入当前线程的缓存中，下次创建协程直接复用，超过fiber.stack_cache_size才munmap。
+//开启fiber.stack_trim时，放入缓存的栈除了栈顶的fiber.stack_trim_keep字节外，
+//其余页用MADV_DONTNEED还给内核，下次使用时按需重新缺页。
+class MmapStackAllocator{
 public:
     static void* Alloc(size_t size){
-        return malloc(size);
+        size = AlignSize(size);
+        StackCache* cache = GetCache();
+        if(cache){
+            //栈大小通常都相同，从后往前找很快就能找到
+            auto& stacks = cache->stacks;
+            for(size_t i = stacks.size(); i > 0; --i){
+                if(stacks[i - 1].second == size){
+                    void* vp = stacks[i - 1].first;
+                    stacks.erase(stacks.begin() + (i - 1));
+                    return vp;
+                }
+            }
+        }
+
+        size_t page = PageSize();
+        void* base = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if(base == MAP_FAILED){
+            CC_LOG_ERROR(g_logger) << "mmap fiber stack fail, size=" << size
+                                   << " errno=" << errno << " errstr=" << strerror(errno);
+            throw std::bad_alloc();
+        }
+        //保护页
+        if(mprotect(base, page, PROT_NONE)){
+            CC_LOG_ERROR(g_logger) << "mprotect fiber stack guard page fail, errno="
+                                   << errno << " errstr=" << strerror(errno);
+        }
+        //绑定了CPU的线程，栈放在本节点上，协程被其他节点的线程执行时也不会在那边缺页
+        int node = GetBoundNode();
+        if(node >= 0){
+            BindMemory((char*)base + page, size, node);
+        }
+        return (char*)base + page;
     }
 
     static void Dealloc(void *vp, size_t size){
-        return free(vp);
+        size = AlignSize(size);
+        StackCache* cache = GetCache();
+        if(cache && cache->stacks.size() < s_fiber_stack_cache_size){
+            size_t keep = AlignSize(s_fiber_stack_trim_keep);
+            if(s_fiber_stack_trim && size > keep){
+                madvise(vp, size - keep, MADV_DONTNEED);
+            }
+            cache->stacks.push_back(std::make_pair(vp, size));
+            return;
+        }
+        Unmap(vp, size);
+    }
+
+private:
+    //线程退出时释放缓存的栈
+    struct StackCache{
+        std::vector<std::pair<void*, size_t> > stacks;
+
+        ~StackCache();
+    };
+
+    static size_t PageSize(){
+        static size_t s_page_size = sysconf(_SC_PAGESIZE);
+        return s_page_size;
+    }
+
+    //按页对齐
+    static size_t AlignSize(size_t size){
+        size_t page = PageSize();
+        return (size + page - 1) / page * page;
+    }
+
+    static void Unmap(void* vp, size_t size){
+        size_t page = PageSize();
+        munmap((char*)vp - page, size + page);
     }
 
+    static StackCache* GetCache();
 };
 
-using StackAllocator = MallocStackAllocator;
+//线程退出时，缓存析构之后仍可能有协程被析构(例如thread_local的协程指针)，此时直接munmap
+static thread_local bool t_stack_cache_destroyed = false;
+
+MmapStackAllocator::StackCache::~StackCache(){
+    t_stack_cache_destroyed = true;
+    for(auto& i : stacks){
+        Unmap(i.first, i.second);
+    }
+}
+
+MmapStackAllocator::StackCache* MmapStackAllocator::GetCache(){
+    if(t_stack_cache_destroyed){
+        return nullptr;
+    }
+    static thread_local StackCache s_cache;
+    return &s_cache;
+}
+
+using StackAllocator = MmapStackAllocator;
+
+//线程共享栈，所有共享栈协程都在这块栈上运行，第一次使用时分配
+//occupant是栈上当前内容所属的协程，只有另一个共享栈协程要切入时才把它的内容拷贝出去，
+//同一个协程反复挂起/恢复不需要任何拷贝
+//协程可能在其他线程上被析构，occupant的修改需要加锁
+struct SharedStack{
+    Spinlock mutex;
+    void* stack = nullptr;
+    size_t size = 0;
+    Fiber* occupant = nullptr;
+
+    ~SharedStack(){
+        Spinlock::Lock lock(mutex);
+        if(occupant){
+            occupant->m_sharedOwner = nullptr;
+        }
+        if(stack){
+            StackAllocator::Dealloc(stack, size);
+        }
+    }
+};
+static thread_local SharedStack t_shared_stack;
 
 uint64_t Fiber::GetFiberId(){
     if(t_fiber){
@@ -60,12 +231,7 @@ Fiber::Fiber(){
     m_state = EXEC;
     //将当前协程设置为正在执行
     SetThis(this);
-    //getcontext(ucontext_t *ucp):
-    //获取当前上下文, 并将其保存到ucp指针所指的结构中。
-
-    if(getcontext(&m_ctx)){
-        CC_ASSERT2(false, "getcontext");
-    }
+    //主协程的上下文在第一次切出时保存，不需要初始化
 
     ++s_fiber_count;
     CC_LOG_DEBUG(g_logger) << "Fiber::Fiber main";
@@ -73,37 +239,28 @@ Fiber::Fiber(){
 
 //构造子协程；所有协程的入口函数都是一样的MainFunc或者CallerMainFunc
 //构造函数参数包含入口函数，栈大小
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller) 
+Fiber::Fiber(Callback cb, size_t stacksize, bool use_caller, bool shared_stack) 
     :m_id(++s_fiber_id)
-    ,m_cb(cb){
+    ,m_cb(std::move(cb)){
 
     ++s_fiber_count;
-    m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
+#if !CC_FIBER_USE_UCONTEXT
+    //共享栈依赖汇编切换保存的栈指针，ucontext下退回独立栈
+    //共享栈协程只能swapIn，use_caller的协程通过call执行，不能使用共享栈
+    if(shared_stack && !use_caller){
+        m_sharedStack = true;
+        //上下文在第一次切入时才在共享栈上创建
+        CC_LOG_DEBUG(g_logger) << "Fiber::Fiber shared stack id = " << m_id;
+        return;
+    }
+#endif
+    m_stacksize = stacksize ? stacksize : s_fiber_stack_size;
     m_stack = StackAllocator::Alloc(m_stacksize);
-    if(getcontext(&m_ctx)){
-        CC_ASSERT2(false, "getcontext");
-    }
-
-    //uc_link指向下一个需要调度的协程
-    //对于普通协程，只需要切换回主协程
-    m_ctx.uc_link = nullptr;
-    //当前上下文的栈指针
-    m_ctx.uc_stack.ss_sp = m_stack;
-    //当前上下文的栈空间大小
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
-    //void makecontext(ucontext_t *ucp, void (*func)(), int argc, ...);
-    //  修改由getcontext获取到的上下文指针ucp，将其与一个函数func进行绑定，支持指定func运行时的参数，argc: 函数入口参数的个数
-    //  在调用makecontext之前，必须手动给ucp分配一段内存空间，存储在ucp->uc_stack中，这段内存空间将作为func函数运行时的栈空间，
-    //  同时也可以指定ucp->uc_link，表示函数运行结束后恢复uc_link指向的上下文，
-    //  如果不赋值uc_link，那func函数结束时必须调用setcontext或swapcontext以重新指定一个有效的上下文，否则程序就跑飞了
-    //  makecontext执行完后，ucp就与函数func绑定了，调用setcontext或swapcontext激活ucp时，func就会被运行
-    
+
     //不使用main所在的线程,绑定主协程(此时主协程就是调度协程)
-    if(!use_caller){
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);
-    }else{
-        makecontext(&m_ctx, &Fiber::CallerMainFunc, 0);
+    if(MakeContext(&m_ctx, m_stack, m_stacksize,
+                   use_caller ? &Fiber::CallerMainFunc : &Fiber::MainFunc)){
+        CC_ASSERT2(false, "makecontext");
     }
     
     CC_LOG_DEBUG(g_logger) << "Fiber::Fiber id = " << m_id;
@@ -111,7 +268,19 @@ Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
 
 Fiber::~Fiber(){
     --s_fiber_count;
-    if(m_stack){
+    clearLocals();
+    if(m_sharedStack){
+        //HOLD状态的共享栈协程也可能被析构(例如调度器退出时还在等待事件)，只需要丢弃栈内容
+        CC_ASSERT(m_state != EXEC);
+        SharedStack* ss = m_sharedOwner;
+        if(ss){
+            Spinlock::Lock lock(ss->mutex);
+            if(ss->occupant == this){
+                ss->occupant = nullptr;
+            }
+        }
+        free(m_savedStack);
+    } else if(m_stack){
         //这些状态的协程都可以被析构
         CC_ASSERT(m_state == TERM || m_state == EXCEPT || m_state == INIT);
         //回收空间
@@ -133,37 +302,40 @@ Fiber::~Fiber(){
 //重置协程函数，及状态，由新的cb重新获取之前的栈空间
 //INIT, TERM
 //重置内存，或者该协程执行完，但是可以使用栈中分配的空间继续执行
-void Fiber::reset(std::function<void()> cb){
-    CC_ASSERT(m_stack);
+void Fiber::reset(Callback cb){
+    CC_ASSERT(m_stack || m_sharedStack);
     CC_ASSERT(m_state == TERM || m_state == EXCEPT || m_state == INIT);
 
-    m_cb = cb;
-    if(getcontext(&m_ctx)){
-        CC_ASSERT2(false, "getcontext");
+    //复用的协程不能带着上一个任务的局部存储
+    clearLocals();
+    m_cb = std::move(cb);
+    if(m_sharedStack){
+        //新任务可以在任意线程上开始，上下文在切入时创建
+        m_stackThread = -1;
+        m_savedSize = 0;
+        m_state = INIT;
+        return;
     }
-
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-    
     //绑定的是协程入口函数，里面封装了cb
     //MainFunc中会执行cb
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    if(MakeContext(&m_ctx, m_stack, m_stacksize, &Fiber::MainFunc)){
+        CC_ASSERT2(false, "makecontext");
+    }
     m_state = INIT;
 }
 
 
-// int swapcontext(ucontext_t *oucp, const ucontext_t *ucp);
-// 恢复ucp指向的上下文，同时将当前的上下文存储到oucp中，
-// 和setcontext一样，swapcontext也不会返回，而是会跳转到ucp上下文对应的函数中执行，相当于调用了函数
-// swapcontext是sylar非对称协程实现的关键，线程主协程和子协程用这个接口进行上下文切换
+// int SwapContext(FiberContext* from, FiberContext* to);
+// 恢复to指向的上下文，同时将当前的上下文存储到from中，
+// 和swapcontext一样，SwapContext不会立即返回，而是会跳转到to上下文对应的函数中执行，相当于调用了函数
+// 这是sylar非对称协程实现的关键，线程主协程和子协程用这个接口进行上下文切换
 // 主协程切换到当前协程
-// 关于swapcontext如何切换，例如在某个函数执行中，f1调用了swap，那么会将当前函数的上下文保存在oucp，切换到f1的上下文
+// 关于SwapContext如何切换，例如在某个函数执行中，f1调用了swap，那么会将当前函数的上下文保存在from，切换到f1的上下文
 void Fiber::call(){
+    CC_ASSERT(!m_sharedStack);
     SetThis(this);
     m_state = EXEC;
-    CC_LOG_ERROR(g_logger) << getId();
-    if(swapcontext(&t_threadFiber->m_ctx, &m_ctx)){
+    if(SwapContext(&t_threadFiber->m_ctx, &m_ctx)){
         CC_ASSERT2(false, "swapcontext");
     }
 }
@@ -171,20 +343,50 @@ void Fiber::call(){
 // 普通协程执行back()
 void Fiber::back(){
     SetThis(t_threadFiber.get());
-    if (swapcontext(&m_ctx, &t_threadFiber->m_ctx)){
+    if (SwapContext(&m_ctx, &t_threadFiber->m_ctx)){
         CC_ASSERT2(false, "swapcontext");
     }
 }
 
 //调度协程切换到当前协程
-void Fiber::swapIn(){
+Fiber::State Fiber::swapIn(){
+    //协程登记了事件或定时器之后、换出完成之前，唤醒方就可能把它调度到其他线程，
+    //等原线程保存完上下文再切入
+    while(m_running.exchange(true, std::memory_order_acquire)){
+        CpuRelax();
+    }
+    //已经结束的协程被过期的唤醒再次调度
+    if(m_state == TERM || m_state == EXCEPT){
+        State state = m_state;
+        m_running.store(false, std::memory_order_release);
+        return state;
+    }
 
     SetThis(this);
     CC_ASSERT(m_state != EXEC);
+    if(m_sharedStack){
+        switchInSharedStack();
+    }
     m_state = EXEC;
-    if(swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx)) {
+    if(SwapContext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx)) {
         CC_ASSERT2(false, "swapcontext");
     }
+    if(m_state == EXEC){
+        m_state = HOLD;
+    }
+    State state = m_state;
+    //已经结束的共享栈协程，栈上的内容不需要再保存
+    if(m_sharedStack && (state == TERM || state == EXCEPT)){
+        SharedStack& ss = t_shared_stack;
+        Spinlock::Lock lock(ss.mutex);
+        if(ss.occupant == this){
+            ss.occupant = nullptr;
+            m_sharedOwner = nullptr;
+        }
+    }
+    //上下文已经保存，之后其他线程可以切入
+    m_running.store(false, std::memory_order_release);
+    return state;
     //未引入调度器
     // if(swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {
     //     CC_ASSERT2(false, "swapcontext");
@@ -194,7 +396,7 @@ void Fiber::swapIn(){
 //切换到后台执行，调度协程切换到主协程
 void Fiber::swapOut(){
     SetThis(Scheduler::GetMainFiber());
-    if (swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx)){
+    if (SwapContext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx)){
         CC_ASSERT2(false, "swapcontext");
     }
     // 未引入调度器
@@ -203,6 +405,60 @@ void Fiber::swapOut(){
     // }
 }  
 
+//共享栈切换，在调度协程(独立栈)上执行
+//协程挂起期间它的栈内容可能被拷贝走，所以其他协程不能持有指向它栈上对象的指针
+void Fiber::switchInSharedStack(){
+#if !CC_FIBER_USE_UCONTEXT
+    SharedStack& ss = t_shared_stack;
+    if(!ss.stack){
+        ss.size = s_fiber_shared_stack_size;
+        ss.stack = StackAllocator::Alloc(ss.size);
+    }
+    //栈上保存了指向自身的指针，只能回到原来的线程、原来的地址上继续执行
+    if(m_stackThread == -1){
+        m_stackThread = GetThreadId();
+    }
+    CC_ASSERT2(m_stackThread == GetThreadId(), "shared stack fiber resumed on another thread");
+
+    Spinlock::Lock lock(ss.mutex);
+    if(ss.occupant == this){
+        return;
+    }
+    char* top = (char*)ss.stack + ss.size;
+    if(ss.occupant){
+        ss.occupant->saveSharedStack(top);
+        ss.occupant->m_sharedOwner = nullptr;
+    }
+    if(m_state == INIT){
+        if(MakeContext(&m_ctx, ss.stack, ss.size, &Fiber::MainFunc)){
+            CC_ASSERT2(false, "makecontext");
+        }
+    } else {
+        CC_ASSERT((char*)m_ctx.sp + m_savedSize == top);
+        memcpy(m_ctx.sp, m_savedStack, m_savedSize);
+    }
+    ss.occupant = this;
+    m_sharedOwner = &ss;
+#endif
+}
+
+void Fiber::saveSharedStack(char* top){
+#if !CC_FIBER_USE_UCONTEXT
+    size_t len = top - (char*)m_ctx.sp;
+    //缓冲区保持和实际使用量相当，挂起的协程只占用它真正用到的内存
+    if(len > m_savedCapacity || len < m_savedCapacity / 2){
+        free(m_savedStack);
+        m_savedStack = (char*)malloc(len);
+        if(!m_savedStack){
+            throw std::bad_alloc();
+        }
+        m_savedCapacity = len;
+    }
+    memcpy(m_savedStack, m_ctx.sp, len);
+    m_savedSize = len;
+#endif
+}
+
 //设置当前协程
 void Fiber::SetThis(Fiber *f){
     t_fiber = f;
@@ -221,6 +477,34 @@ Fiber::ptr Fiber::GetThis(){
     return t_fiber->shared_from_this();
 }
 
+Fiber* Fiber::GetThisPtr(){
+    if(t_fiber){
+        return t_fiber;
+    }
+    return GetThis().get();
+}
+
+//槽位只分配不回收，FiberLocal通常定义为全局或静态变量
+size_t Fiber::AllocLocalSlot(void (*destroy)(void*)){
+    size_t slot = s_local_slots++;
+    CC_ASSERT2(slot < LOCAL_SLOTS, "too many FiberLocal");
+    s_local_destroyers[slot] = destroy;
+    return slot;
+}
+
+void Fiber::clearLocals(){
+    //值的析构函数中可能又设置了其他槽，直到全部清空
+    while(m_localSet){
+        uint32_t set = m_localSet;
+        m_localSet = 0;
+        for(size_t i = 0; set; ++i, set >>= 1){
+            if((set & 1) && s_local_destroyers[i]){
+                s_local_destroyers[i](m_locals[i]);
+            }
+        }
+    }
+}
+
 //切换回主协程，设置为Ready状态
 void Fiber::YieldToReady(){
     Fiber::ptr cur = GetThis();
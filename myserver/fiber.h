@@ -1,13 +1,17 @@
 #ifndef __CC_FIBER_H__
 #define __CC_FIBER_H__
 
-#include <ucontext.h>
+#include "fiber_context.h"
+#include "callback.h"
 #include <functional>
+#include <atomic>
 #include <memory>
 
 namespace cc{
 
 class Scheduler;
+struct SharedStack;
+template<class T> class FiberLocal;
 
 // 非对称协程模型，也就是子协程只能和线程主协程切换，
 // 而不能和另一个子协程切换，并且在程序结束时，一定要再切回主协程
@@ -15,6 +19,8 @@ class Scheduler;
 // 若没有任务需要执行则执行idle()，其思想主要在run()中体现。
 class Fiber : public std::enable_shared_from_this<Fiber>{
 friend class Scheduler;
+friend struct SharedStack;
+template<class T> friend class FiberLocal;
 public:
     
     using ptr = std::shared_ptr<Fiber>;
@@ -41,17 +47,22 @@ public:
     //cb: 协程所执行的函数
     //stacksize: 协程栈大小
     //是否在Mainfiber上调度 
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false);
+    //shared_stack: 使用线程共享栈，切换时才把栈上实际用到的部分拷贝出去，
+    //             适合大量长时间挂起、栈很浅的协程(例如空闲连接)，只能由调度器swapIn执行
+    Fiber(Callback cb, size_t stacksize = 0, bool use_caller = false, bool shared_stack = false);
     ~Fiber();
 
     //重置协程函数，及状态
     //INIT, TERM
     //重置内存，或者该协程执行完，但是可以使用栈中分配的空间继续执行
-    void reset(std::function<void()> cb);
+    void reset(Callback cb);
     
     //swapIn和swapOut是和调度器搭配使用的
     //调度协程切换到当前协程(如果不使用main所在的线程，调度协程就是主协程，负责是单独的调度协程)
-    void swapIn();
+    //返回协程被换出时的状态，直接swapOut换出的EXEC状态记为HOLD
+    //挂起的协程可能在换出完成之前就被其他线程唤醒并调度，swapIn会等它在原线程上换出完成；
+    //swapIn返回后协程可能已经在其他线程上运行，调用者只能使用返回的状态，不能再读写协程的状态
+    State swapIn();
     //切换到后台执行也可理解为切换到主协程
     void swapOut();
     
@@ -90,6 +101,27 @@ public:
     //获取协程id
     static uint64_t GetFiberId();
     State getState() {return m_state;}
+    //是否使用共享栈
+    bool isSharedStack() const { return m_sharedStack;}
+    //共享栈协程运行过的线程，之后只能在该线程上恢复，-1表示还未运行
+    int getStackThread() const { return m_stackThread;}
+    //调度优先级(见Scheduler::Priority)，协程每次被重新调度时沿用
+    int getPriority() const { return m_priority;}
+    void setPriority(int v) { m_priority = v;}
+
+    //协程局部存储(见fiber_local.h)的槽位数
+    static const size_t LOCAL_SLOTS = 16;
+    //分配一个协程局部存储槽位，destroy为槽中值的析构函数，值直接放在槽中时为nullptr
+    static size_t AllocLocalSlot(void (*destroy)(void*));
+    //当前线程正在执行的协程，不增加引用计数；没有时同GetThis()创建主协程
+    static Fiber* GetThisPtr();
+    //析构所有协程局部存储的值，reset和析构时调用
+    void clearLocals();
+private:
+    //切入共享栈协程前，把共享栈上其他协程的内容换出，恢复自己的内容
+    void switchInSharedStack();
+    //把自己在共享栈上使用的部分[sp, 栈顶)拷贝到m_savedStack
+    void saveSharedStack(char* top);
 private:
 
     //协程id
@@ -98,23 +130,29 @@ private:
     uint32_t m_stacksize = 0;
     State m_state = INIT;
 
-    //上下文结构体定义
-    //这个结构体是平台相关的，因为不同平台的寄存器不一样
-    //下面列出的是所有平台都至少会包含的4个成员
-    //  当前上下文结束后，下一个激活的上下文对象的指针，只在当前上下文是由makecontext创建时有效
-    //      struct      ucontext_t *uc_link;
-    //  当前上下文的信号屏蔽掩码
-    //      sigset_t    uc_sigmask;
-    //  当前上下文使用的栈内存空间，只在当前上下文是由makecontext创建时有效
-    //      stack_t     uc_stack;
-    //  包含栈指针uc_stack.ss_sp 和栈大小uc_stack.ss_size
-    //  保存具体的程序执行上下文，如PC值，堆栈指针以及寄存器值等信息。
-    //      mcontext_t  uc_mcontext;
-    ucontext_t m_ctx;
+    //协程上下文，默认由汇编实现切换，见fiber_context.h
+    FiberContext m_ctx;
 
     void* m_stack = nullptr;
     //协程运行函数
-    std::function<void()> m_cb;
+    Callback m_cb;
+
+    //共享栈模式，m_stack为空，运行时使用线程的共享栈
+    bool m_sharedStack = false;
+    int m_stackThread = -1;
+    //调度优先级，默认Scheduler::NORMAL
+    int m_priority = 1;
+    //正在某个线程上执行或者换出，同一时刻只有一个线程可以swapIn
+    std::atomic<bool> m_running{false};
+    //协程局部存储，m_localSet中对应位为1的槽才有值
+    void* m_locals[LOCAL_SLOTS];
+    uint32_t m_localSet = 0;
+    //当前内容还留在其上的共享栈，被换出后为空
+    std::atomic<SharedStack*> m_sharedOwner{nullptr};
+    //被换出共享栈时保存的栈内容，大小按实际使用量分配
+    char* m_savedStack = nullptr;
+    size_t m_savedSize = 0;
+    size_t m_savedCapacity = 0;
 };
 
 }
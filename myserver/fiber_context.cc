@@ -0,0 +1,157 @@
+#include "fiber_context.h"
+#include <stdint.h>
+#include <string.h>
+
+//切换时栈上保存的内容(从低地址到高地址)
+//x86-64:  x87控制字, mxcsr, r15, r14, r13, r12, rbx, rbp, 返回地址
+//aarch64: d8-d15, x19-x28, x29(fp), x30(lr)
+//新建的上下文在栈顶伪造一份这样的数据，第一次切入时"返回"到cc_context_entry，
+//由它调用保存在rbx/x19中的入口函数。
+//cc_context_entry用CFI把返回地址标记为未定义，backtrace在协程栈底正常结束。
+#if !CC_FIBER_USE_UCONTEXT
+#if defined(__x86_64__)
+asm(R"(
+    .text
+    .globl  cc_swap_context
+    .type   cc_swap_context, @function
+    .align  16
+cc_swap_context:
+    pushq   %rbp
+    pushq   %rbx
+    pushq   %r12
+    pushq   %r13
+    pushq   %r14
+    pushq   %r15
+    subq    $16, %rsp
+    stmxcsr 8(%rsp)
+    fnstcw  (%rsp)
+    movq    %rsp, (%rdi)
+    movq    %rsi, %rsp
+    ldmxcsr 8(%rsp)
+    fldcw   (%rsp)
+    addq    $16, %rsp
+    popq    %r15
+    popq    %r14
+    popq    %r13
+    popq    %r12
+    popq    %rbx
+    popq    %rbp
+    ret
+    .size   cc_swap_context, .-cc_swap_context
+
+    .globl  cc_context_entry
+    .hidden cc_context_entry
+    .type   cc_context_entry, @function
+    .align  16
+cc_context_entry:
+    .cfi_startproc
+    .cfi_undefined rip
+    andq    $-16, %rsp
+    callq   *%rbx
+    ud2
+    .cfi_endproc
+    .size   cc_context_entry, .-cc_context_entry
+)");
+#elif defined(__aarch64__)
+asm(R"(
+    .text
+    .globl  cc_swap_context
+    .type   cc_swap_context, %function
+    .align  4
+cc_swap_context:
+    sub     sp, sp, #0xa0
+    stp     d8, d9, [sp, #0x00]
+    stp     d10, d11, [sp, #0x10]
+    stp     d12, d13, [sp, #0x20]
+    stp     d14, d15, [sp, #0x30]
+    stp     x19, x20, [sp, #0x40]
+    stp     x21, x22, [sp, #0x50]
+    stp     x23, x24, [sp, #0x60]
+    stp     x25, x26, [sp, #0x70]
+    stp     x27, x28, [sp, #0x80]
+    stp     x29, x30, [sp, #0x90]
+    mov     x9, sp
+    str     x9, [x0]
+    mov     sp, x1
+    ldp     d8, d9, [sp, #0x00]
+    ldp     d10, d11, [sp, #0x10]
+    ldp     d12, d13, [sp, #0x20]
+    ldp     d14, d15, [sp, #0x30]
+    ldp     x19, x20, [sp, #0x40]
+    ldp     x21, x22, [sp, #0x50]
+    ldp     x23, x24, [sp, #0x60]
+    ldp     x25, x26, [sp, #0x70]
+    ldp     x27, x28, [sp, #0x80]
+    ldp     x29, x30, [sp, #0x90]
+    add     sp, sp, #0xa0
+    ret
+    .size   cc_swap_context, .-cc_swap_context
+
+    .globl  cc_context_entry
+    .hidden cc_context_entry
+    .type   cc_context_entry, %function
+    .align  4
+cc_context_entry:
+    .cfi_startproc
+    .cfi_undefined x30
+    blr     x19
+    brk     #0
+    .cfi_endproc
+    .size   cc_context_entry, .-cc_context_entry
+)");
+#endif
+
+extern "C" void cc_context_entry();
+#endif
+
+namespace cc{
+
+#if CC_FIBER_USE_UCONTEXT
+int MakeContext(FiberContext* ctx, void* stack, size_t size, void (*fn)()){
+    //getcontext(ucontext_t *ucp):
+    //获取当前上下文, 并将其保存到ucp指针所指的结构中。
+    if(getcontext(&ctx->uc)){
+        return -1;
+    }
+    //uc_link指向下一个需要调度的协程
+    //对于普通协程，只需要切换回主协程
+    ctx->uc.uc_link = nullptr;
+    //当前上下文的栈指针
+    ctx->uc.uc_stack.ss_sp = stack;
+    //当前上下文的栈空间大小
+    ctx->uc.uc_stack.ss_size = size;
+
+    //void makecontext(ucontext_t *ucp, void (*func)(), int argc, ...);
+    //  修改由getcontext获取到的上下文指针ucp，将其与一个函数func进行绑定，支持指定func运行时的参数，argc: 函数入口参数的个数
+    //  在调用makecontext之前，必须手动给ucp分配一段内存空间，存储在ucp->uc_stack中，这段内存空间将作为func函数运行时的栈空间，
+    //  同时也可以指定ucp->uc_link，表示函数运行结束后恢复uc_link指向的上下文，
+    //  如果不赋值uc_link，那func函数结束时必须调用setcontext或swapcontext以重新指定一个有效的上下文，否则程序就跑飞了
+    //  makecontext执行完后，ucp就与函数func绑定了，调用setcontext或swapcontext激活ucp时，func就会被运行
+    makecontext(&ctx->uc, fn, 0);
+    return 0;
+}
+#else
+int MakeContext(FiberContext* ctx, void* stack, size_t size, void (*fn)()){
+    //栈从高地址向低地址增长，栈顶按16字节对齐
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+    //返回地址放在top - 16，ret之后rsp = top - 8，
+    //cc_context_entry对齐后call，入口函数看到的栈和普通函数调用一致
+    uint64_t* frame = (uint64_t*)(top - 80);
+    memset(frame, 0, 80);
+    frame[0] = 0x037F;                          //x87控制字默认值
+    frame[1] = 0x1F80;                          //mxcsr默认值
+    frame[6] = (uint64_t)fn;                    //rbx
+    frame[8] = (uint64_t)&cc_context_entry;     //返回地址
+#elif defined(__aarch64__)
+    uint64_t* frame = (uint64_t*)(top - 0xa0);
+    memset(frame, 0, 0xa0);
+    frame[8] = (uint64_t)fn;                    //x19
+    frame[19] = (uint64_t)&cc_context_entry;    //x30
+#endif
+    ctx->sp = frame;
+    return 0;
+}
+#endif
+
+}
@@ -0,0 +1,66 @@
+#ifndef __CC_FIBER_CONTEXT_H__
+#define __CC_FIBER_CONTEXT_H__
+
+#include <stddef.h>
+
+//协程上下文切换
+//x86-64和aarch64上默认使用手写汇编实现，只保存callee-saved寄存器，
+//不会像swapcontext那样每次切换都通过rt_sigprocmask系统调用保存/恢复信号屏蔽字。
+//编译时定义CC_FIBER_UCONTEXT，或者在其他平台上，退回使用getcontext/makecontext/swapcontext
+#if defined(CC_FIBER_UCONTEXT) || !(defined(__x86_64__) || defined(__aarch64__))
+#   define CC_FIBER_USE_UCONTEXT 1
+#   include <ucontext.h>
+#else
+#   define CC_FIBER_USE_UCONTEXT 0
+#endif
+
+#if !CC_FIBER_USE_UCONTEXT
+extern "C" {
+//保存当前的callee-saved寄存器到当前栈上，栈指针存入*from_sp，
+//然后切换到to_sp指向的栈，恢复其上保存的寄存器并返回到该上下文
+void cc_swap_context(void** from_sp, void* to_sp);
+}
+#endif
+
+namespace cc{
+
+//协程上下文
+struct FiberContext{
+#if CC_FIBER_USE_UCONTEXT
+    //上下文结构体定义
+    //这个结构体是平台相关的，因为不同平台的寄存器不一样
+    //下面列出的是所有平台都至少会包含的4个成员
+    //  当前上下文结束后，下一个激活的上下文对象的指针，只在当前上下文是由makecontext创建时有效
+    //      struct      ucontext_t *uc_link;
+    //  当前上下文的信号屏蔽掩码
+    //      sigset_t    uc_sigmask;
+    //  当前上下文使用的栈内存空间，只在当前上下文是由makecontext创建时有效
+    //      stack_t     uc_stack;
+    //  包含栈指针uc_stack.ss_sp 和栈大小uc_stack.ss_size
+    //  保存具体的程序执行上下文，如PC值，堆栈指针以及寄存器值等信息。
+    //      mcontext_t  uc_mcontext;
+    ucontext_t uc;
+#else
+    //切出时的栈指针，寄存器都保存在栈上
+    void* sp = nullptr;
+#endif
+};
+
+//在[stack, stack + size)上创建一个从fn开始执行的上下文，fn不能返回
+//成功返回0
+int MakeContext(FiberContext* ctx, void* stack, size_t size, void (*fn)());
+
+//保存当前上下文到from，切换到to
+//成功返回0
+inline int SwapContext(FiberContext* from, FiberContext* to){
+#if CC_FIBER_USE_UCONTEXT
+    return swapcontext(&from->uc, &to->uc);
+#else
+    cc_swap_context(&from->sp, to->sp);
+    return 0;
+#endif
+}
+
+}
+
+#endif
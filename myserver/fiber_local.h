@@ -0,0 +1,112 @@
+#ifndef __CC_FIBER_LOCAL_H__
+#define __CC_FIBER_LOCAL_H__
+
+#include <new>
+#include <utility>
+#include <type_traits>
+#include "fiber.h"
+#include "noncopyable.h"
+
+//协程局部存储
+//协程可能在不同的调度线程上恢复执行，thread_local存放的请求上下文(trace id、截止时间、
+//认证信息等)会串到别的协程上。FiberLocal<T>的值保存在协程对象中，跟着协程走:
+//  每个FiberLocal在构造时分配一个全局槽位，查找就是 当前协程->m_locals[槽位]，不查表不加锁；
+//  不超过一个指针大小并且可以平凡拷贝的类型(整数、指针、时间戳)直接放在槽中，不分配内存，
+//  其他类型第一次设置时在堆上构造一份。
+//协程reset(调度器复用回调协程)或析构时，所有局部存储的值都会被析构，不会泄漏给下一个任务。
+//槽位只分配不回收，总数不超过Fiber::LOCAL_SLOTS，FiberLocal应定义为全局或静态变量
+//没有运行在协程中时，值属于线程的主协程
+namespace cc{
+
+template<class T>
+class FiberLocal : Noncopyable{
+    //值是否直接放在槽中
+    static constexpr bool IsInline(){
+        return sizeof(T) <= sizeof(void*) && alignof(T) <= alignof(void*)
+               && std::is_trivially_copyable<T>::value;
+    }
+public:
+    FiberLocal()
+        :m_slot(Fiber::AllocLocalSlot(IsInline() ? nullptr : &Destroy))
+        ,m_bit(1u << m_slot){
+    }
+
+    //当前协程是否设置过值
+    bool has() const{
+        return Fiber::GetThisPtr()->m_localSet & m_bit;
+    }
+
+    //当前协程的值，没有设置过返回nullptr
+    T* get() const{
+        Fiber* f = Fiber::GetThisPtr();
+        if(!(f->m_localSet & m_bit)){
+            return nullptr;
+        }
+        return Ptr(f);
+    }
+
+    //当前协程的值，没有设置过时默认构造一个
+    T& operator*() const{
+        Fiber* f = Fiber::GetThisPtr();
+        if(!(f->m_localSet & m_bit)){
+            Construct(f, T(), std::integral_constant<bool, IsInline()>());
+        }
+        return *Ptr(f);
+    }
+
+    T* operator->() const { return &**this;}
+
+    template<class U>
+    void set(U&& v){
+        Fiber* f = Fiber::GetThisPtr();
+        if(f->m_localSet & m_bit){
+            *Ptr(f) = std::forward<U>(v);
+            return;
+        }
+        Construct(f, std::forward<U>(v), std::integral_constant<bool, IsInline()>());
+    }
+
+    //析构当前协程的值
+    void reset(){
+        Fiber* f = Fiber::GetThisPtr();
+        if(!(f->m_localSet & m_bit)){
+            return;
+        }
+        f->m_localSet &= ~m_bit;
+        if(!IsInline()){
+            Destroy(f->m_locals[m_slot]);
+        }
+    }
+private:
+    T* Ptr(Fiber* f) const{
+        return Ptr(f, std::integral_constant<bool, IsInline()>());
+    }
+    T* Ptr(Fiber* f, std::true_type) const{
+        return reinterpret_cast<T*>(&f->m_locals[m_slot]);
+    }
+    T* Ptr(Fiber* f, std::false_type) const{
+        return static_cast<T*>(f->m_locals[m_slot]);
+    }
+
+    template<class U>
+    void Construct(Fiber* f, U&& v, std::true_type) const{
+        new (&f->m_locals[m_slot]) T(std::forward<U>(v));
+        f->m_localSet |= m_bit;
+    }
+    template<class U>
+    void Construct(Fiber* f, U&& v, std::false_type) const{
+        f->m_locals[m_slot] = new T(std::forward<U>(v));
+        f->m_localSet |= m_bit;
+    }
+
+    static void Destroy(void* p){
+        delete static_cast<T*>(p);
+    }
+private:
+    size_t m_slot;
+    uint32_t m_bit;
+};
+
+}
+
+#endif
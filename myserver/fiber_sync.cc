@@ -0,0 +1,229 @@
+#include "fiber_sync.h"
+#include "scheduler.h"
+#include "macro.h"
+#include <vector>
+
+namespace cc{
+
+//挂起前自旋的次数，持有者一般很快释放，自旋可以省掉一次挂起和调度
+static const int s_spin_count = 64;
+
+static inline void CpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+FiberWaiter FiberWaiter::Current(){
+    FiberWaiter waiter;
+    waiter.scheduler = Scheduler::GetThis();
+    waiter.fiber = Fiber::GetThis();
+    CC_ASSERT2(waiter.scheduler && waiter.fiber.get() != Scheduler::GetMainFiber()
+               , "fiber sync primitives must wait inside a scheduled fiber");
+    return waiter;
+}
+
+void FiberWaiter::wake(){
+    scheduler->schedule(&fiber);
+}
+
+bool FiberMutex::tryLock(){
+    bool expected = false;
+    return m_locked.compare_exchange_strong(expected, true, std::memory_order_acquire);
+}
+
+void FiberMutex::lock(){
+    for(int i = 0; i < s_spin_count; ++i){
+        if(tryLock()){
+            return;
+        }
+        CpuRelax();
+    }
+    Spinlock::Lock lock(m_mutex);
+    //unlock也在m_mutex下判断有没有等待者，加入队列后一定会被唤醒
+    if(tryLock()){
+        return;
+    }
+    m_waiters.push_back(FiberWaiter::Current());
+    lock.unlock();
+    //被唤醒时锁已经交给了自己
+    Fiber::YieldToHold();
+}
+
+void FiberMutex::unlock(){
+    Spinlock::Lock lock(m_mutex);
+    if(m_waiters.empty()){
+        m_locked.store(false, std::memory_order_release);
+        return;
+    }
+    FiberWaiter waiter = std::move(m_waiters.front());
+    m_waiters.pop_front();
+    lock.unlock();
+    //m_locked保持为true，直接交给被唤醒的协程
+    waiter.wake();
+}
+
+void FiberCondition::wait(FiberMutex& mutex){
+    {
+        Spinlock::Lock lock(m_mutex);
+        //先加入队列再释放mutex，释放之后的notify不会丢失
+        m_waiters.push_back(FiberWaiter::Current());
+    }
+    mutex.unlock();
+    Fiber::YieldToHold();
+    mutex.lock();
+}
+
+void FiberCondition::notify(){
+    Spinlock::Lock lock(m_mutex);
+    if(m_waiters.empty()){
+        return;
+    }
+    FiberWaiter waiter = std::move(m_waiters.front());
+    m_waiters.pop_front();
+    lock.unlock();
+    waiter.wake();
+}
+
+void FiberCondition::notifyAll(){
+    std::deque<FiberWaiter> waiters;
+    {
+        Spinlock::Lock lock(m_mutex);
+        waiters.swap(m_waiters);
+    }
+    for(auto& i : waiters){
+        i.wake();
+    }
+}
+
+FiberSemaphore::FiberSemaphore(uint32_t count)
+    :m_count(count){
+}
+
+bool FiberSemaphore::tryWait(){
+    Spinlock::Lock lock(m_mutex);
+    if(m_count > 0){
+        --m_count;
+        return true;
+    }
+    return false;
+}
+
+void FiberSemaphore::wait(){
+    for(int i = 0; i < s_spin_count; ++i){
+        if(tryWait()){
+            return;
+        }
+        CpuRelax();
+    }
+    Spinlock::Lock lock(m_mutex);
+    if(m_count > 0){
+        --m_count;
+        return;
+    }
+    m_waiters.push_back(FiberWaiter::Current());
+    lock.unlock();
+    Fiber::YieldToHold();
+}
+
+void FiberSemaphore::notify(){
+    Spinlock::Lock lock(m_mutex);
+    if(m_waiters.empty()){
+        ++m_count;
+        return;
+    }
+    FiberWaiter waiter = std::move(m_waiters.front());
+    m_waiters.pop_front();
+    lock.unlock();
+    waiter.wake();
+}
+
+bool FiberRWMutex::tryRdlock(){
+    Spinlock::Lock lock(m_mutex);
+    //有人排队时不插队，避免写者饿死
+    if(m_writer || !m_waiters.empty()){
+        return false;
+    }
+    ++m_readers;
+    return true;
+}
+
+bool FiberRWMutex::tryWrlock(){
+    Spinlock::Lock lock(m_mutex);
+    if(m_writer || m_readers || !m_waiters.empty()){
+        return false;
+    }
+    m_writer = true;
+    return true;
+}
+
+void FiberRWMutex::rdlock(){
+    for(int i = 0; i < s_spin_count; ++i){
+        if(tryRdlock()){
+            return;
+        }
+        CpuRelax();
+    }
+    Spinlock::Lock lock(m_mutex);
+    if(!m_writer && m_waiters.empty()){
+        ++m_readers;
+        return;
+    }
+    m_waiters.push_back(FiberWaiter::Current());
+    lock.unlock();
+    Fiber::YieldToHold();
+}
+
+void FiberRWMutex::wrlock(){
+    for(int i = 0; i < s_spin_count; ++i){
+        if(tryWrlock()){
+            return;
+        }
+        CpuRelax();
+    }
+    Spinlock::Lock lock(m_mutex);
+    if(!m_writer && !m_readers && m_waiters.empty()){
+        m_writer = true;
+        return;
+    }
+    FiberWaiter waiter = FiberWaiter::Current();
+    waiter.writer = true;
+    m_waiters.push_back(std::move(waiter));
+    lock.unlock();
+    Fiber::YieldToHold();
+}
+
+void FiberRWMutex::unlock(){
+    std::vector<FiberWaiter> wakes;
+    {
+        Spinlock::Lock lock(m_mutex);
+        if(m_writer){
+            m_writer = false;
+        } else {
+            CC_ASSERT(m_readers > 0);
+            --m_readers;
+        }
+        if(m_writer || m_readers || m_waiters.empty()){
+            return;
+        }
+        //队头是写者就只交给它，否则交给队头连续的所有读者
+        if(m_waiters.front().writer){
+            m_writer = true;
+            wakes.push_back(std::move(m_waiters.front()));
+            m_waiters.pop_front();
+        } else {
+            while(!m_waiters.empty() && !m_waiters.front().writer){
+                ++m_readers;
+                wakes.push_back(std::move(m_waiters.front()));
+                m_waiters.pop_front();
+            }
+        }
+    }
+    for(auto& i : wakes){
+        i.wake();
+    }
+}
+
+}
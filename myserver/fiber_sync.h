@@ -0,0 +1,100 @@
+#ifndef __CC_FIBER_SYNC_H__
+#define __CC_FIBER_SYNC_H__
+
+#include <deque>
+#include <stdint.h>
+#include "fiber.h"
+#include "thread.h"
+#include "noncopyable.h"
+
+//协程级的同步原语
+//thread.h中的锁会阻塞整个线程，线程上的其他协程也无法运行；
+//这里的锁拿不到时先短暂自旋，仍然拿不到就把当前协程挂起(HOLD)，
+//释放时通过协程所在的调度器重新调度它，线程继续执行其他协程。
+//只能在调度器中运行的协程里等待；唤醒(unlock/notify)可以在任何线程调用。
+//内部状态由一把自旋锁保护，临界区只有几条指令
+namespace cc{
+
+class Scheduler;
+
+//等待中的协程，以及唤醒后由哪个调度器执行它
+struct FiberWaiter{
+    Scheduler* scheduler = nullptr;
+    Fiber::ptr fiber;
+    //FiberRWMutex使用: 是否在等待写锁
+    bool writer = false;
+
+    //当前协程作为等待者
+    static FiberWaiter Current();
+    //交给调度器重新执行
+    void wake();
+};
+
+//协程互斥锁
+//解锁时如果有等待者，锁直接交给队头的协程，不会被后来者抢走
+class FiberMutex : Noncopyable{
+public:
+    using Lock = ScopedLockImpl<FiberMutex>;
+
+    void lock();
+    bool tryLock();
+    void unlock();
+private:
+    Spinlock m_mutex;
+    std::atomic<bool> m_locked = {false};
+    std::deque<FiberWaiter> m_waiters;
+};
+
+//协程条件变量，配合FiberMutex使用
+class FiberCondition : Noncopyable{
+public:
+    //调用时必须持有mutex，返回时重新持有mutex
+    void wait(FiberMutex& mutex);
+    //唤醒一个等待者
+    void notify();
+    //唤醒所有等待者
+    void notifyAll();
+private:
+    Spinlock m_mutex;
+    std::deque<FiberWaiter> m_waiters;
+};
+
+//协程信号量
+class FiberSemaphore : Noncopyable{
+public:
+    FiberSemaphore(uint32_t count = 0);
+
+    void wait();
+    bool tryWait();
+    //有等待者时直接交给队头的协程，否则计数加一
+    void notify();
+private:
+    Spinlock m_mutex;
+    uint32_t m_count;
+    std::deque<FiberWaiter> m_waiters;
+};
+
+//协程读写锁
+//等待者按先后顺序排队，有写者在排队时新的读者也要排队，写者不会饿死
+class FiberRWMutex : Noncopyable{
+public:
+    using ReadLock = ReadScopedLockImpl<FiberRWMutex>;
+    using WriteLock = WriteScopedLockImpl<FiberRWMutex>;
+
+    void rdlock();
+    void wrlock();
+    bool tryRdlock();
+    bool tryWrlock();
+    void unlock();
+private:
+    Spinlock m_mutex;
+    //持有读锁的数量
+    uint32_t m_readers = 0;
+    //是否有写者持有
+    bool m_writer = false;
+    std::deque<FiberWaiter> m_waiters;
+};
+
+}
+
+#endif
@@ -0,0 +1,85 @@
+#include "histogram.h"
+#include <sstream>
+
+namespace cc{
+
+HistogramData::HistogramData(){
+    for(auto& i : buckets){
+        i = 0;
+    }
+}
+
+size_t HistogramData::Bucket(uint64_t v){
+    if(v == 0){
+        return 0;
+    }
+    size_t i = 64 - __builtin_clzll(v);
+    return i < BUCKETS ? i : BUCKETS - 1;
+}
+
+uint64_t HistogramData::UpperBound(size_t i){
+    if(i + 1 >= BUCKETS){
+        return ~0ull;
+    }
+    return 1ull << i;
+}
+
+uint64_t HistogramData::count() const{
+    uint64_t n = 0;
+    for(auto& i : buckets){
+        n += i;
+    }
+    return n;
+}
+
+uint64_t HistogramData::percentile(double p) const{
+    uint64_t n = count();
+    if(n == 0){
+        return 0;
+    }
+    //第rank个(从1开始)记录所在的桶
+    uint64_t rank = (uint64_t)(p * n);
+    if(rank < 1){
+        rank = 1;
+    } else if(rank > n){
+        rank = n;
+    }
+    uint64_t seen = 0;
+    for(size_t i = 0; i < BUCKETS; ++i){
+        seen += buckets[i];
+        if(seen >= rank){
+            return UpperBound(i);
+        }
+    }
+    return UpperBound(BUCKETS - 1);
+}
+
+void HistogramData::merge(const HistogramData& o){
+    for(size_t i = 0; i < BUCKETS; ++i){
+        buckets[i] += o.buckets[i];
+    }
+}
+
+std::string HistogramData::toString() const{
+    std::stringstream ss;
+    ss << "count=" << count()
+       << " p50<" << percentile(0.5)
+       << " p99<" << percentile(0.99)
+       << " p999<" << percentile(0.999)
+       << " max<" << percentile(1);
+    return ss.str();
+}
+
+Histogram::Histogram(){
+    for(auto& i : m_buckets){
+        i = 0;
+    }
+}
+
+void Histogram::snapshot(HistogramData& data) const{
+    for(size_t i = 0; i < HistogramData::BUCKETS; ++i){
+        data.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+    }
+}
+
+}
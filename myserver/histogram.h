@@ -0,0 +1,58 @@
+#ifndef __CC_HISTOGRAM_H__
+#define __CC_HISTOGRAM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+
+namespace cc{
+
+/**
+ * 按2的幂分桶的直方图，用于统计延迟(微秒)
+ * 第0个桶统计0，第i个桶统计[2^(i-1), 2^i)，最后一个桶统计更大的值
+ * 只精确到2倍，但记录一次只是一次原子读写，不加锁、不分配内存
+ */
+struct HistogramData{
+    static const size_t BUCKETS = 32;
+
+    HistogramData();
+
+    //v所在的桶
+    static size_t Bucket(uint64_t v);
+    //第i个桶的上界(不包含)
+    static uint64_t UpperBound(size_t i);
+
+    //记录的总次数
+    uint64_t count() const;
+    //第p(0~1)分位数，返回所在桶的上界，没有数据返回0
+    uint64_t percentile(double p) const;
+    //合并另一个直方图
+    void merge(const HistogramData& o);
+    //输出 count p50 p99 p999 max
+    std::string toString() const;
+
+    uint64_t buckets[BUCKETS];
+};
+
+/**
+ * 单个线程写、其他线程随时读的直方图
+ * 写者只有一个，add不用原子加(lock前缀)，读者用snapshot拷贝一份再计算分位数
+ */
+class Histogram{
+public:
+    Histogram();
+
+    void add(uint64_t v){
+        std::atomic<uint64_t>& b = m_buckets[HistogramData::Bucket(v)];
+        b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void snapshot(HistogramData& data) const;
+private:
+    std::atomic<uint64_t> m_buckets[HistogramData::BUCKETS];
+};
+
+}
+
+#endif
@@ -4,7 +4,10 @@
 #include "fiber.h"
 #include "iomanager.h"
 #include "fd_manager.h"
+#include "uring.h"
+#include "clock.h"
 #include "log.h"
+#include <string.h>
 
 cc::Logger::ptr g_logger = CC_LOG_NAME("system");
 namespace cc{
@@ -86,11 +89,12 @@ void set_hook_enable(bool flag){
 
 
 }
-//定时器超时条件
-//cancelled 表示是否取消
-struct timer_info {
-    int cancelled = 0;
-};
+//hook的调试输出，默认编译掉，定义CC_HOOK_TRACE_ENABLE时打开
+#ifdef CC_HOOK_TRACE_ENABLE
+#define CC_HOOK_TRACE(msg) CC_LOG_DEBUG(g_logger) << msg
+#else
+#define CC_HOOK_TRACE(msg)
+#endif
 
 /*
 * fd: 文件描述符
@@ -100,14 +104,14 @@ struct timer_info {
 * timeout_so: 超时时间类型
 * args: 可变参数
 */
-//do_io实现逻辑: 
+//do_io实现逻辑:
 //先排除不要执行异步的情况，例如用户没有设置hook，或者fd已经关闭或者不是socket类型，这时候直接执行原函数
-//如果需要异步，先按照非阻塞模式执行原始API，如果是资源暂时不可用，那么将添加一个超时定时器(有回调函数)，
-//并将事件加入IO管理器，之后让出执行权，转为HOLD。
-//1.检查是否是有超时时间的异步，如果设置了超时时间，添加一个条件定时器，到超时时间还未回来，唤醒，设置
-//当前状态为已超时，取消该事件(设置timer_info),返回
-//2.如果没有超时时间或者在超时时间内已经正常返回，将事件添加进iom中等待对应的唤醒事件发生，
-//发生后执行原始操作即可，此时对应事件已经就绪，不会阻塞
+//如果需要异步，先按照非阻塞模式执行原始API，如果是资源暂时不可用，
+//就通过IOManager::waitEvent等待事件，让出执行权，转为HOLD。
+//超时时间在第一次需要等待时换算成截止时间，由waitEvent直接处理，多次重试共用同一个截止时间。
+//等待状态保存在fd的记录中，整个过程不分配内存:
+//1.到截止时间还没有事件，waitEvent返回-1，errno为ETIMEDOUT
+//2.事件就绪后返回0，重新执行原始操作，此时对应事件已经就绪，一般不会再阻塞
 template<typename OriginFun, typename ... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
                      uint32_t event, int timeout_so, Args&&... args) {
@@ -115,7 +119,6 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
         return fun(fd, std::forward<Args>(args)...);
     }
 
-    //CC_LOG_DEBUG(g_logger) << " do_io <" << hook_fun_name << " > ";
     //拿到fd对应的上下文
     cc::FdCtx::ptr ctx = cc::FdMgr::GetInstance()->get(fd);
     //没有文件调用原接口即可
@@ -133,10 +136,8 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
         return fun(fd, std::forward<Args>(args)...);
     }
     //以上都是不适用hook的情况
-    //获得超时时间
-    uint64_t to = ctx->getTimeout(timeout_so);
-    //设置超时条件
-    std::shared_ptr<timer_info> tinfo(new timer_info);
+    //截止时间，第一次需要等待时才计算
+    uint64_t deadline = 0;
 
 retry:
     //先执行原始函数
@@ -146,7 +147,7 @@ retry:
     while(n == -1 && errno == EINTR) {
         n = fun(fd, std::forward<Args>(args)...);
     }
-    CC_LOG_DEBUG(g_logger) << " do_io <" << hook_fun_name << "> ";
+    CC_HOOK_TRACE(" do_io <" << hook_fun_name << "> n=" << n);
     //需要重试
     //EAGAIN-（一般用于非阻塞的系统调用）
     //错误码 EAGAIN（或 EWOULDBLOCK） 表示资源暂时不可用，操作在非阻塞模式下无法立即完成
@@ -155,65 +156,71 @@ retry:
     //因此就产生了Resource temporarily unavailable的错误（资源暂时不可用）
     //EAGAIN 的意思也很明显，就是再次尝试
 
-    //此时可以认为被阻塞了，可以设置一个定时器之后，切换其他协程执行
+    //此时可以认为被阻塞了，等待事件就绪或者超时，切换其他协程执行
     if(n == -1 && errno == EAGAIN) {
-        CC_LOG_DEBUG(g_logger) << " do_io <" << hook_fun_name << "> ";
-        cc::IOManager* iom = cc::IOManager::GetThis();
-        cc::Timer::ptr timer;
-        std::weak_ptr<timer_info> winfo(tinfo);
-
-        //原Fdctx已经设置了超时时间
-        if(to != (uint64_t)-1) {
-            //to时间到了，依然没有消息则触发cb
-            //如果提前唤醒，则winfo会被销毁，不会执行该回调
-            timer = iom->addConditionTimer(to, [winfo, fd, iom, event](){
-                //如果对象存在，lock()函数返回一个指向共享对象的shared_ptr，否则返回一个空shared_ptr。
-                auto t = winfo.lock();
-                //定时器失效，说明该函数已经执行完成，函数中定义的局部变量全部被释放了
-                if(!t || t->cancelled) {
-                    return;
-                }
-                //没错误的话设置为超时而失败
-                t->cancelled = ETIMEDOUT;
-                iom->cancelEvent(fd, (cc::IOManager::Event)(event));
-            }, winfo);
+        if(deadline == 0) {
+            uint64_t to = ctx->getTimeout(timeout_so);
+            deadline = to == (uint64_t)-1 ? ~0ull : cc::GetNowMS() + to;
         }
-        
-        //默认回调函数为空，将当前协程作为执行体
-        int rt = iom->addEvent(fd, (cc::IOManager::Event)(event));
-        //添加失败
-        if(rt) {
-            CC_LOG_ERROR(g_logger) << hook_fun_name << " addEvent("
-                << fd << ", " << event << ")";
-            if(timer) {
-                timer->cancel();
+        cc::IOManager* iom = cc::IOManager::GetThis();
+        //只有两种情况会从这回来：
+        // 1) 到了截止时间，errno = ETIMEDOUT
+        // 2) 数据来了，重新执行原始的函数进行处理
+        if(iom->waitEvent(fd, (cc::IOManager::Event)(event), deadline)) {
+            if(errno != ETIMEDOUT) {
+                CC_LOG_ERROR(g_logger) << hook_fun_name << " waitEvent("
+                    << fd << ", " << event << ")";
             }
             return -1;
-        } else {
-            //addEvent成功，YieldToHold()把执行时间让出来，继续执行其他任务
-            //只有两种情况会从这回来：
-            // 1) 超时了， 174行取消timer的时候 triggerEvent会唤醒回来
-            // 2) addEvent数据回来了会唤醒回来 
-            CC_LOG_DEBUG(g_logger) << " do_io <" << hook_fun_name << "> ";
-            cc::Fiber::YieldToHold();
-            CC_LOG_DEBUG(g_logger) << " do_io <" << hook_fun_name << "> ";
-            if(timer){
-                timer->cancel();
-            }
-            //被超时计时器唤醒
-            if(tinfo->cancelled){
-                //errno = ETIMEDOUT
-                errno = tinfo->cancelled;
-                return -1;
-            }
-            //数据来了
-            //被阻塞的事件满足了，重新执行原始的函数进行处理
-            goto retry;
         }
+        goto retry;
     }
     return n;
 }
 
+//io_uring后端下可以直接提交操作的IOManager，不适用时返回nullptr
+//共享栈协程让出后栈上的数据会被换出，内核不能异步写入栈上的缓冲区，仍然走epoll
+static cc::IOManager* uring_iomanager() {
+    if(!cc::t_hook_enable) {
+        return nullptr;
+    }
+    cc::IOManager* iom = cc::IOManager::GetThis();
+    if(!iom || !iom->isUring() || cc::Fiber::GetThis()->isSharedStack()) {
+        return nullptr;
+    }
+    return iom;
+}
+
+//填写一个io_uring请求，一次最多读写0x7ffff000字节，与read/write系统调用一致
+static io_uring_sqe uring_sqe(uint8_t opcode, const void* addr, size_t len) {
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.addr = (uint64_t)addr;
+    sqe.len = len > 0x7ffff000 ? 0x7ffff000 : len;
+    return sqe;
+}
+
+//把请求提交给io_uring，当前协程等待完成，n为操作的返回值
+//返回false表示该fd不适用(没有被管理、不是socket或者用户设置了非阻塞)，调用者继续走原来的流程
+static bool uring_io(cc::IOManager* iom, int fd, int timeout_so, io_uring_sqe& sqe, ssize_t& n) {
+    cc::FdCtx::ptr ctx = cc::FdMgr::GetInstance()->get(fd);
+    if(!ctx) {
+        return false;
+    }
+    if(ctx->isClose()) {
+        errno = EBADF;
+        n = -1;
+        return true;
+    }
+    if(!ctx->isSocket() || ctx->getUserNonBlock()) {
+        return false;
+    }
+    sqe.fd = fd;
+    n = iom->submitIO(sqe, ctx->getTimeout(timeout_so));
+    return true;
+}
+
 
 extern "C"{
 
@@ -221,7 +228,7 @@ extern "C"{
     HOOK_FUN(XX);
 #undef XX
 
-//添加一个定时器之后让出协程执行权
+//添加一个定时器之后让出协程执行权，定时器是内联的，到期时在idle循环中直接重新调度协程
 unsigned int sleep(unsigned int seconds){
     //没有启用hook，调用原始的接口
     if(!cc::t_hook_enable){
@@ -231,17 +238,18 @@ unsigned int sleep(unsigned int seconds){
     cc::Fiber::ptr fiber = cc::Fiber::GetThis();
     cc::IOManager* iom = cc::IOManager::GetThis();
 
-    //(void(sylar::Scheduler::*)(sylar::Fiber::ptr, int thread)) 是一个函数指针类型，
-    //它定义了一个指向 sylar::Scheduler 类中一个参数为 sylar::Fiber::ptr 和 int 类型的成员函数的指针类型
+    //(void(sylar::Scheduler::*)(sylar::Fiber::ptr, int thread, int priority)) 是一个函数指针类型，
+    //它定义了一个指向 sylar::Scheduler 类中一个参数为 sylar::Fiber::ptr 和两个 int 类型的成员函数的指针类型
     //参数iom是成员函数的调用对象，它不会作为成员函数的实际参数传递，而是指定哪个对象来调用该成员函数。
     //解释:
     //当绑定成员函数时，std::bind 的第一个参数是成员函数指针，第二个参数是调用该成员函数的对象或对象指针
-    //schedule 调度任务为fiber，不指定线程
-    //拿到cc::IOManager::schedule的地址，转为void(cc::Scheduler::*)(cc::Fiber::ptr, int thread)这个函数
+    //schedule 调度任务为fiber，不指定线程，沿用协程自己的优先级
+    //拿到cc::IOManager::schedule的地址，转为void(cc::Scheduler::*)(cc::Fiber::ptr, int, int)这个函数
     //指针类型
-    iom->addTimer(seconds * 1000, 
+    iom->addInlineTimer(seconds * 1000, 
                     std::bind((void(cc::Scheduler::*)
-                    (cc::Fiber::ptr, int thread))&cc::IOManager::schedule, iom, fiber, -1));
+                    (cc::Fiber::ptr, int thread, int priority))&cc::IOManager::schedule
+                    , iom, fiber, -1, (int)cc::Scheduler::INHERIT));
     cc::Fiber::YieldToHold();
     return 0;
 }
@@ -254,7 +262,7 @@ int usleep(useconds_t usec){
     cc::Fiber::ptr fiber = cc::Fiber::GetThis();
     cc::IOManager* iom = cc::IOManager::GetThis();
 
-    iom->addTimer(usec / 1000, [iom, fiber](){
+    iom->addInlineTimer(usec / 1000, [iom, fiber](){
         iom->schedule(fiber);
     });
     cc::Fiber::YieldToHold();
@@ -269,7 +277,7 @@ int nanosleep(const struct timespec *req, struct timespec *rem){
     cc::Fiber::ptr fiber = cc::Fiber::GetThis();
     cc::IOManager* iom = cc::IOManager::GetThis();
 
-    iom->addTimer(timeout_ms, [iom, fiber](){
+    iom->addInlineTimer(timeout_ms, [iom, fiber](){
         iom->schedule(fiber);
     });
     cc::Fiber::YieldToHold();
@@ -310,6 +318,13 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
         return connect_f(fd, addr, addrlen);
     }
 
+    if(cc::IOManager* iom = uring_iomanager()) {
+        io_uring_sqe sqe = uring_sqe(IORING_OP_CONNECT, addr, 0);
+        sqe.fd = fd;
+        sqe.off = addrlen;
+        return iom->submitIO(sqe, timeout_ms);
+    }
+
     int n = connect_f(fd, addr, addrlen);
     //成功连接
     if(n == 0){
@@ -319,39 +334,14 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
     }
 
     cc::IOManager* iom = cc::IOManager::GetThis();
-    cc::Timer::ptr timer;
-    std::shared_ptr<timer_info> tinfo(new timer_info);
-    std::weak_ptr<timer_info> winfo(tinfo);
-
-    if(timeout_ms != (uint64_t)-1){
-        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom](){
-            auto t = winfo.lock();
-            if(!t || t->cancelled){
-                return;
-            }
-            t->cancelled = ETIMEDOUT;
-            iom->cancelEvent(fd, cc::IOManager::WRITE);
-        }, winfo);
-    }
-
-    int rt = iom->addEvent(fd, cc::IOManager::WRITE);
-    if(rt == 0){
-        cc::Fiber::YieldToHold();
-        //执行到此处说明被唤醒
-        if(timer) {
-            timer->cancel();
-        }
-        //被定时器唤醒，已经超时，任务失败
-        if(tinfo->cancelled){
-            errno = tinfo->cancelled;
+    uint64_t deadline = timeout_ms == (uint64_t)-1 ? ~0ull : cc::GetNowMS() + timeout_ms;
+    //等待可写，到截止时间还没有连接上，任务失败
+    if(iom->waitEvent(fd, cc::IOManager::WRITE, deadline)) {
+        if(errno == ETIMEDOUT) {
             return -1;
         }
-    }else{
         //添加事件失败
-        if(timer){
-            timer->cancel();
-        }
-        CC_LOG_ERROR(g_logger) << "connect addEvent(" << fd << ", WRITE) error"; 
+        CC_LOG_ERROR(g_logger) << "connect waitEvent(" << fd << ", WRITE) error";
     }
 
     //被唤醒之后查询socket的状态
@@ -376,7 +366,17 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen){
 
 //sockaddr用来处理网络通信的地址,socklen_t表示套接字地址的长度，返回值为成功建立连接的文件描述符
 int accept(int s, struct sockaddr* addr, socklen_t *addrlen){
-    int fd = do_io(s, accept_f, "accept", cc::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    ssize_t n = 0;
+    cc::IOManager* iom = uring_iomanager();
+    io_uring_sqe sqe;
+    if(iom) {
+        sqe = uring_sqe(IORING_OP_ACCEPT, addr, 0);
+        sqe.addr2 = (uint64_t)addrlen;
+    }
+    if(!iom || !uring_io(iom, s, SO_RCVTIMEO, sqe, n)) {
+        n = do_io(s, accept_f, "accept", cc::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    }
+    int fd = n;
     if(fd >= 0){
         //加入文件描述符管理集合
         cc::FdMgr::GetInstance()->get(fd, true);
@@ -385,6 +385,15 @@ int accept(int s, struct sockaddr* addr, socklen_t *addrlen){
 }
 
 ssize_t read(int fd, void *buf, size_t count) {
+    if(cc::IOManager* iom = uring_iomanager()) {
+        io_uring_sqe sqe = uring_sqe(IORING_OP_READ, buf, count);
+        //socket不能定位，-1表示使用当前位置
+        sqe.off = (uint64_t)-1;
+        ssize_t n = 0;
+        if(uring_io(iom, fd, SO_RCVTIMEO, sqe, n)) {
+            return n;
+        }
+    }
     return do_io(fd, read_f, "read", cc::IOManager::READ, SO_RCVTIMEO, buf, count);
 }
 
@@ -393,6 +402,14 @@ ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
+    if(cc::IOManager* iom = uring_iomanager()) {
+        io_uring_sqe sqe = uring_sqe(IORING_OP_RECV, buf, len);
+        sqe.msg_flags = flags;
+        ssize_t n = 0;
+        if(uring_io(iom, sockfd, SO_RCVTIMEO, sqe, n)) {
+            return n;
+        }
+    }
     return do_io(sockfd, recv_f, "recv", cc::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
 }
 
@@ -405,6 +422,15 @@ ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
 }
 
 ssize_t write(int fd, const void *buf, size_t count) {
+    if(cc::IOManager* iom = uring_iomanager()) {
+        io_uring_sqe sqe = uring_sqe(IORING_OP_WRITE, buf, count);
+        //socket不能定位，-1表示使用当前位置
+        sqe.off = (uint64_t)-1;
+        ssize_t n = 0;
+        if(uring_io(iom, fd, SO_SNDTIMEO, sqe, n)) {
+            return n;
+        }
+    }
     return do_io(fd, write_f, "write", cc::IOManager::WRITE, SO_SNDTIMEO, buf, count);
 }
 
@@ -413,6 +439,14 @@ ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
 }
 
 ssize_t send(int s, const void *msg, size_t len, int flags) {
+    if(cc::IOManager* iom = uring_iomanager()) {
+        io_uring_sqe sqe = uring_sqe(IORING_OP_SEND, msg, len);
+        sqe.msg_flags = flags;
+        ssize_t n = 0;
+        if(uring_io(iom, s, SO_SNDTIMEO, sqe, n)) {
+            return n;
+        }
+    }
     return do_io(s, send_f, "send", cc::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
 }
 
@@ -427,6 +461,9 @@ ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
 
 int close(int fd){
     if(!cc::t_hook_enable){
+        //调度线程之外关闭fd，也要让等在它上面的io_uring操作结束，并且忘掉它的epoll注册
+        cc::IOManager::CancelUring(fd);
+        cc::FdMgr::GetInstance()->del(fd);
         return close_f(fd);
     }
 
@@ -435,6 +472,8 @@ int close(int fd){
         auto iom = cc::IOManager::GetThis();
         if(iom){
             iom->cancelAll(fd);
+        } else {
+            cc::IOManager::CancelUring(fd);
         }
         cc::FdMgr::GetInstance()->del(fd);
     }
@@ -36,6 +36,12 @@ void HttpServer::handleClient(Socket::ptr client) {
             break;
         }
 
+        //过载时已经排队很久的请求直接返回503，不再处理
+        if(checkShed()) {
+            sendUnavailable(session, req->getVersion());
+            break;
+        }
+
         HttpResponse::ptr rsp(new HttpResponse(req->getVersion(),
                                 req->isClose() || !m_isKeepalive));
         
@@ -58,5 +64,18 @@ void HttpServer::handleClient(Socket::ptr client) {
     session->close();
 }
 
+void HttpServer::rejectClient(Socket::ptr client) {
+    HttpSession::ptr session(new HttpSession(client));
+    sendUnavailable(session, 0x11);
+    session->close();
+}
+
+void HttpServer::sendUnavailable(HttpSession::ptr session, uint8_t version) {
+    HttpResponse::ptr rsp(new HttpResponse(version, true));
+    rsp->setStatus(HttpStatus::SERVICE_UNAVAILABLE);
+    rsp->setHeader("Retry-After", "1");
+    session->sendResponse(rsp);
+}
+
 }
 }
@@ -37,6 +37,16 @@ public:
 protected:
 
     virtual void handleClient(Socket::ptr client) override;
+
+    /**
+     * 过载时回复503后关闭连接
+     */
+    virtual void rejectClient(Socket::ptr client) override;
+private:
+    /**
+     * 发送503，session可能还没有收到请求
+     */
+    void sendUnavailable(HttpSession::ptr session, uint8_t version);
 private:
     // 是否支持长连接
     bool m_isKeepalive;
@@ -1,4 +1,8 @@
 #include "iomanager.h"
+#include "fd_manager.h"
+#include "config.h"
+#include "uring.h"
+#include "clock.h"
 #include "log.h"
 #include "macro.h"
 #include <unistd.h>
@@ -6,11 +10,96 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <mutex>
+#include <sys/eventfd.h>
 
 namespace cc{
 
 static cc::Logger::ptr g_logger = CC_LOG_NAME("system");
 
+static ConfigVar<std::string>::ptr g_iomanager_backend =
+    Config::Lookup<std::string>("iomanager.backend", "epoll", "io backend: epoll or io_uring");
+static ConfigVar<uint32_t>::ptr g_iomanager_uring_entries =
+    Config::Lookup<uint32_t>("iomanager.uring_entries", 1024, "io_uring submission queue size");
+static ConfigVar<bool>::ptr g_iomanager_persistent_events =
+    Config::Lookup<bool>("iomanager.persistent_events", false, "register fds once with EPOLLIN|EPOLLOUT|EPOLLET");
+static ConfigVar<uint32_t>::ptr g_iomanager_busy_poll_us =
+    Config::Lookup<uint32_t>("iomanager.busy_poll_us", 0, "max spin time in us before an idle thread blocks, 0 to disable");
+static ConfigVar<int>::ptr g_iomanager_tickle_signal =
+    Config::Lookup<int>("iomanager.tickle_signal", SIGURG, "signal to wake a specific idle thread, 0 to disable");
+
+static inline void CpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+//一次通过io_uring提交的操作，由等待的协程持有，完成后由它释放
+//state: 提交后为PENDING，协程准备让出时改为WAITING，收割到完成事件时改为DONE。
+//  收割时如果原来是WAITING，说明协程已经(或即将)让出，需要重新调度它；
+//  如果是PENDING，协程还没有让出，它会看到DONE，不再让出
+struct UringOp{
+    enum State{
+        PENDING,
+        WAITING,
+        DONE
+    };
+    std::atomic<int> state = {PENDING};
+    //还要收到的完成事件数，带超时的操作还有一个LINK_TIMEOUT的完成事件
+    std::atomic<int> refs = {1};
+    int res = 0;
+    bool timedout = false;
+    Fiber::ptr fiber;
+    //等待的协程所在的IOManager
+    IOManager* iom = nullptr;
+    __kernel_timespec ts;
+};
+
+//user_data最低位标记LINK_TIMEOUT的完成事件，为0的是不需要处理的取消请求
+static const uint64_t s_uring_timeout_tag = 1;
+
+//定向唤醒某个调度线程使用的信号(配置iomanager.tickle_signal)
+//调度线程进入idle后屏蔽该信号，只在epoll_pwait期间解除屏蔽，因此信号只会打断epoll_pwait；
+//线程不在等待时信号保持挂起，下一次epoll_pwait会立刻返回，不会丢失唤醒。
+//其他线程的信号屏蔽字不受影响，进程收到的该信号仍然由它们处理
+static void OnTickleSignal(int){
+}
+
+//第一个IOManager构造时安装信号处理函数，之后修改配置不再生效
+//应用已经为该信号设置了处理函数时不覆盖，不使用信号，返回0
+static int InstallTickleSignal(){
+    static std::once_flag s_once;
+    static int s_signal = 0;
+    std::call_once(s_once, [](){
+        int sig = g_iomanager_tickle_signal->getValue();
+        if(sig <= 0){
+            return;
+        }
+        struct sigaction old;
+        if(sigaction(sig, nullptr, &old)){
+            CC_LOG_ERROR(g_logger) << "invalid iomanager.tickle_signal " << sig;
+            return;
+        }
+        if((old.sa_flags & SA_SIGINFO)
+                || (old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN)){
+            CC_LOG_WARN(g_logger) << "signal " << sig << " already has a handler"
+                << ", set iomanager.tickle_signal to another signal";
+            return;
+        }
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &OnTickleSignal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(sig, &sa, nullptr);
+        s_signal = sig;
+    });
+    return s_signal;
+}
+
 IOManager::FdContext::EventContext& IOManager::FdContext::getcontext(Event event){
     switch(event){
         case IOManager::READ:
@@ -44,8 +133,10 @@ void IOManager::FdContext::triggerEvent(Event event){
 }
 
 //改造协程调度器，使其支持epoll
-IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
-        : Scheduler(threads, use_caller, name) {
+IOManager::IOManager(size_t threads, bool use_caller, const std::string& name
+                    ,const std::string& backend)
+        : Scheduler(threads, use_caller, name)
+        , m_deadlines(GetNowMS()) {
     //epoll_create()是用于创建一个新的epoll实例的系统调用，
     //返回一个文件描述符(epoll 文件描述符),
     //该文件描述符可以用于管理和监控其他文件描述符的事件。
@@ -53,13 +144,10 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
     m_epfd = epoll_create(5000);
     CC_ASSERT(m_epfd > 0);
 
-    //pipe的参数是数组
-    //  m_tickleFds[0] 用于读取
-    //  m_tickleFds[1] 用于写入，
-    //保存的即为对应的文件描述符
-    //pipe管道创建成功返回0,失败返回-1
-    int rt = pipe(m_tickleFds);
-    CC_ASSERT(!rt);
+    //用于tickle的eventfd，创建时即为非阻塞
+    //eventfd内部是一个64位计数器，每次write都会唤醒一次epoll，比pipe少一个fd，也不会写满
+    m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    CC_ASSERT(m_tickleFd >= 0);
 
     //源码
     //struct epoll_event
@@ -82,24 +170,10 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
     epoll_event event;
     memset(&event, 0, sizeof(epoll_event));
     //注册读事件并且支持边缘触发
+    //边缘触发的事件只会被一个epoll_wait取走，一次tickle只唤醒一个空闲线程
     event.events = EPOLLIN | EPOLLET;
-    //注册pipe读句柄的可读事件 
-    event.data.fd = m_tickleFds[0];
-
-    //fcntl 是一个用于操作文件描述符的函数
-    //1: 文件描述符，用于指定要操作的文件描述符。
-    //2: F_GETFD：获取文件描述符标志。
-    //   F_SETFD：设置文件描述符标志。常用的标志：
-    //   FD_CLOEXEC：在执行 exec 系列函数时关闭该文件描述符。
-    //   F_GETFL：获取文件状态标志。
-    //   F_SETFL：设置文件状态标志。常用的标志:
-    //      O_NONBLOCK：非阻塞模式。
-    //      O_APPEND：追加模式
-    //将管道的读文件描述符设置为非阻塞模式，配合边缘触发
-    //在读取不到数据或是写入缓冲区已满会马上return，而不会阻塞等待
-    //注: 边缘触发必须配合非阻塞
-    rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-    CC_ASSERT(!rt);
+    //注册eventfd的可读事件 
+    event.data.fd = m_tickleFd;
 
     //epoll_ctl: 用于向 epoll 实例中添加、修改或删除文件描述符
     //1: epoll实例的文件描述符
@@ -109,13 +183,33 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
     //3: 需要添加、修改或删除的目标文件描述符。
     //4: 指向 epoll_event 结构体的指针，该结构体包含了要监听的事件类型和相关的数据。
     //   对于 EPOLL_CTL_DEL 操作，该参数可以为 NULL。
-    //此时若管道可读，epoll_wait会返回
-    //将pipe的读端注册到epoll
-    rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
+    //此时若eventfd可读，epoll_wait会返回
+    //将eventfd注册到epoll
+    int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
     
     CC_ASSERT(!rt);
-    //初始化socket事件上下文vector
-    contextResize(32);
+
+    std::string type = backend.empty() ? g_iomanager_backend->getValue() : backend;
+    if(type == "io_uring"){
+        m_uring.reset(new IoUring(g_iomanager_uring_entries->getValue()));
+        if(m_uring->isValid()){
+            //完成队列中有事件时io_uring的fd可读，和eventfd一样由空闲线程等待
+            event.events = EPOLLIN | EPOLLET;
+            event.data.fd = m_uring->getFd();
+            rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_uring->getFd(), &event);
+            CC_ASSERT(!rt);
+        } else {
+            CC_LOG_WARN(g_logger) << "name=" << getName() << " io_uring not available, use epoll";
+            m_uring.reset();
+        }
+    } else if(type != "epoll"){
+        CC_LOG_ERROR(g_logger) << "unknown iomanager backend " << type << ", use epoll";
+    }
+    m_persistentEvents = g_iomanager_persistent_events->getValue();
+    static std::atomic<uint64_t> s_iomanager_id(0);
+    m_id = ++s_iomanager_id;
+    m_busyPollUs = g_iomanager_busy_poll_us->getValue();
+    m_tickleSignal = InstallTickleSignal();
 
     //scheduler的start方法，IOManager创建完成即开始调度
     start();
@@ -126,44 +220,26 @@ IOManager::~IOManager(){
     //close 函数是一个基本且重要的系统调用，用于关闭文件描述符，释放系统资源。
     CC_LOG_INFO(g_logger) << "[~IOManager] stop end";
     close(m_epfd); 
-    close(m_tickleFds[0]);
-    close(m_tickleFds[1]);
-    //删除管理的所有事件描述符
-    for(size_t i = 0; i < m_fdContexts.size(); ++i){
-        if(m_fdContexts[i]){
-            delete m_fdContexts[i];
-        }
-    }
-}
-
-void IOManager::contextResize(size_t size){
-    m_fdContexts.resize(size);
-    for(size_t i = 0; i < m_fdContexts.size(); ++i){
-        if(!m_fdContexts[i]){
-            m_fdContexts[i] = new FdContext;
-            m_fdContexts[i]->fd = i;
-        }
-    }
+    close(m_tickleFd);
+    m_uring.reset();
 }
 
 //添加，删除，都是先拿到fd，拿到对应的事件，在epoll实例中修改，之后修改fdctx
-int IOManager::addEvent(int fd, Event event, std::function<void()> cb){
+int IOManager::addEvent(int fd, Event event, Callback cb){
     
-    FdContext* fd_ctx = nullptr;
-    RWMutexType::ReadLock lock(m_mutex);
-    //fd是否超出范围
-    if((int)m_fdContexts.size() > fd){
-        fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-    } else {
-        lock.unlock();
-        RWMutexType::WriteLock lock2(m_mutex);
-        contextResize(fd * 1.5);
-        fd_ctx = m_fdContexts[fd];
+    //事件上下文在fd的记录中，直接按下标取
+    FdCtx::ptr ctx = FdMgr::GetInstance()->slot(fd, true);
+    if(!ctx){
+        return -1;
     }
+    FdContext* fd_ctx = &ctx->getEventContext();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    
+    return addEventLocked(fd_ctx, event, cb);
+}
+
+int IOManager::addEventLocked(FdContext* fd_ctx, Event event, Callback& cb){
+    int fd = fd_ctx->fd;
     //要添加的事件已经被添加了
     //一个句柄一般不会重复加同一个事件，可能是两个不同的线程在操控同一个句柄添加事件
     if(fd_ctx->events & event){
@@ -173,22 +249,56 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb){
         CC_ASSERT(!(fd_ctx->events & event));
     }
 
-    //已有事件，则使用修改, 没有事件, 则使用添加
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    epoll_event epevent;
-    //EPOLLET 边缘触发, 添加原有事件及新事件
-    epevent.events = EPOLLET | fd_ctx->events | event;
-    epevent.data.ptr = fd_ctx;
+    if(m_persistentEvents){
+        if(fd_ctx->registered != m_id){
+            //第一次在这个IOManager上等待时注册读写两个方向，之后一直保留到cancelAll
+            //之前注册到的是其他IOManager时也重新注册，fd可能曾经在这里注册过，那样就修改
+            epoll_event epevent;
+            epevent.events = EPOLLET | EPOLLIN | EPOLLOUT;
+            epevent.data.ptr = fd_ctx;
+            int op = EPOLL_CTL_ADD;
+            int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+            if(rt && errno == EEXIST){
+                op = EPOLL_CTL_MOD;
+                rt = epoll_ctl(m_epfd, op, fd, &epevent);
+            }
+            if(rt){
+                CC_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd <<", "
+                                       << op << "," << fd << ", " << epevent.events
+                                       << "):" << rt << " (" << errno << ") ("
+                                       << strerror(errno) << ")";
+                return -1;
+            }
+            fd_ctx->registered = m_id;
+            fd_ctx->ready = NONE;
+        } else if(fd_ctx->ready & event){
+            //上次没有等待者时来过一个边缘，消费掉它，调用者直接重试
+            //边缘可能已经被之前的读写用完，那样重试会再得到EAGAIN，再来这里时就会挂起
+            fd_ctx->ready = (Event)(fd_ctx->ready & ~event);
+            if(cb){
+                Scheduler::GetThis()->schedule(&cb);
+                return 0;
+            }
+            return 1;
+        }
+    } else {
+        //已有事件，则使用修改, 没有事件, 则使用添加
+        int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        epoll_event epevent;
+        //EPOLLET 边缘触发, 添加原有事件及新事件
+        epevent.events = EPOLLET | (uint32_t)fd_ctx->events | (uint32_t)event;
+        epevent.data.ptr = fd_ctx;
 
-    //注册事件
-    //0 -> success | -1 -> error
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt){
-        CC_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd <<", "
-                               << op << "," << fd << ", " << epevent.events
-                               << "):" << rt << " (" << errno << ") (" 
-                               << strerror(errno) << ")";
-        return -1;
+        //注册事件
+        //0 -> success | -1 -> error
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if(rt){
+            CC_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd <<", "
+                                   << op << "," << fd << ", " << epevent.events
+                                   << "):" << rt << " (" << errno << ") ("
+                                   << strerror(errno) << ")";
+            return -1;
+        }
     }
 
     ++m_pendingEventCount;
@@ -202,7 +312,7 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb){
     event_ctx.scheduler = Scheduler::GetThis();
     //有回调函数，则添加回调函数，没有则将当前协程作为执行体添加
     if(cb){
-        event_ctx.cb.swap(cb);
+        event_ctx.cb = std::move(cb);
     }else{
         event_ctx.fiber = Fiber::GetThis();
         CC_ASSERT(event_ctx.fiber->getState() == Fiber::EXEC);
@@ -211,12 +321,11 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb){
 }
 
 bool IOManager::delEvent(int fd, Event event){
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd){
+    FdCtx::ptr ctx = FdMgr::GetInstance()->slot(fd, false);
+    if(!ctx){
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
+    FdContext* fd_ctx = &ctx->getEventContext();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
     //若没有要删除的事件
@@ -228,10 +337,11 @@ bool IOManager::delEvent(int fd, Event event){
     Event new_events = (Event)(fd_ctx->events & ~event);
     int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
     epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
+    epevent.events = EPOLLET | (uint32_t)new_events;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    //常驻注册模式下只修改fd_ctx，epoll中的注册保持不变
+    int rt = m_persistentEvents ? 0 : epoll_ctl(m_epfd, op, fd, &epevent);
     if(rt){
         CC_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd <<", "
                                << op << "," << fd << ", " << epevent.events
@@ -250,14 +360,17 @@ bool IOManager::delEvent(int fd, Event event){
 }
 //和删除基本一致，区别在于最后会触发一下当前事件
 bool IOManager::cancelEvent(int fd, Event event){
-    RWMutexType::ReadLock lock(m_mutex);
-    if(m_fdContexts.size() <= fd){
+    FdCtx::ptr ctx = FdMgr::GetInstance()->slot(fd, false);
+    if(!ctx){
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
+    FdContext* fd_ctx = &ctx->getEventContext();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    return cancelEvent(fd_ctx, event);
+}
+
+bool IOManager::cancelEvent(FdContext* fd_ctx, Event event){
     if(!(fd_ctx->events & event)){
         return false;
     }
@@ -265,13 +378,14 @@ bool IOManager::cancelEvent(int fd, Event event){
     Event new_events = (Event)(fd_ctx->events & ~event);
     int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
     epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
+    epevent.events = EPOLLET | (uint32_t)new_events;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    //常驻注册模式下只修改fd_ctx，epoll中的注册保持不变
+    int rt = m_persistentEvents ? 0 : epoll_ctl(m_epfd, op, fd_ctx->fd, &epevent);
     if(rt){
         CC_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd <<", "
-                               << op << "," << fd << ", " << epevent.events
+                               << op << "," << fd_ctx->fd << ", " << epevent.events
                                << "):" << rt << " (" << errno << ") (" 
                                << strerror(errno) << ")";
         return false;
@@ -283,16 +397,37 @@ bool IOManager::cancelEvent(int fd, Event event){
     return true;
 }
 
+void IOManager::CancelUring(int fd){
+    FdCtx::ptr ctx = FdMgr::GetInstance()->slot(fd, false);
+    if(!ctx){
+        return;
+    }
+    FdContext* fd_ctx = &ctx->getEventContext();
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    if(!fd_ctx->uring){
+        return;
+    }
+    //操作以-ECANCELED完成，IoUring构造时已经确认内核支持按fd取消
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = fd;
+    sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe.user_data = 0;
+    fd_ctx->uring->m_uring->submit(&sqe, 1);
+}
+
 bool IOManager::cancelAll(int fd){
-    RWMutexType::ReadLock lock(m_mutex);
-    if(m_fdContexts.size() <= fd){
+    CancelUring(fd);
+
+    FdCtx::ptr ctx = FdMgr::GetInstance()->slot(fd, false);
+    if(!ctx){
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
+    FdContext* fd_ctx = &ctx->getEventContext();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if(!fd_ctx->events){
+    if(!fd_ctx->events && !fd_ctx->registered){
         return false;
     }
 
@@ -302,10 +437,14 @@ bool IOManager::cancelAll(int fd){
     epevent.data.ptr = fd_ctx;
 
     int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    //fd马上要关闭，内核也会把它从epoll中删除，不管删除是否成功都不再认为已经注册
+    fd_ctx->registered = 0;
+    fd_ctx->ready = NONE;
     //errno 是一个全局变量，用于存储最近一次系统调用或库函数调用发生错误时的错误代码。
     //在C和C++编程中，许多标准库函数在失败时不会返回详细的错误信息，
     //而是通过设置 errno 来指示错误类型
-    if(rt){
+    //常驻注册在其他IOManager上时这里没有注册，等待者仍然要唤醒
+    if(rt && !(errno == ENOENT && m_persistentEvents)){
         CC_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd <<", "
                                << op << "," << fd << ", " << epevent.events
                                << "):" << rt << " (" << errno << ") (" 
@@ -328,6 +467,270 @@ bool IOManager::cancelAll(int fd){
     return true;
 }
 
+int IOManager::waitEvent(int fd, Event event, uint64_t deadline_ms){
+    int rt = armEvent(fd, event, deadline_ms);
+    if(rt > 0){
+        //常驻注册模式下已经就绪
+        return 0;
+    }
+    if(rt < 0){
+        return -1;
+    }
+    Fiber::YieldToHold();
+    return finishEvent(fd, event, deadline_ms);
+}
+
+int IOManager::armEvent(int fd, Event event, uint64_t deadline_ms, Callback cb){
+    if(deadline_ms != ~0ull && deadline_ms <= GetNowMS()){
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    FdCtx::ptr ctx = FdMgr::GetInstance()->slot(fd, true);
+    if(!ctx){
+        errno = EBADF;
+        return -1;
+    }
+    FdContext* fd_ctx = &ctx->getEventContext();
+    FdContext::EventContext& event_ctx = fd_ctx->getcontext(event);
+    FdContext::EventContext::Deadline& dl = event_ctx.deadline;
+
+    //seq、超时标记、截止时间和事件在同一次加锁中设置:
+    //已经摘下上一次截止时间的到期处理拿到锁时一定看到新的seq，不会取消这一次等待；
+    //回调模式下锁释放之前回调不会执行，也就不会在其他线程重入armEvent
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    ++dl.seq;
+    event_ctx.timedout = false;
+    int rt = addEventLocked(fd_ctx, event, cb);
+    //常驻注册模式下已经就绪时事件没有挂上，不需要截止时间
+    if(rt || deadline_ms == ~0ull || !(fd_ctx->events & event)){
+        return rt;
+    }
+
+    dl.fd_ctx = fd_ctx;
+    dl.event = event;
+    dl.expire = deadline_ms;
+    bool at_front = false;
+    {
+        Spinlock::Lock lock2(m_deadlineMutex);
+        CC_ASSERT2(!dl.linked(), "deadline is already linked");
+        m_deadlines.add(&dl);
+        at_front = deadline_ms < m_nextDeadline;
+        if(at_front){
+            m_nextDeadline = deadline_ms;
+        }
+    }
+    lock.unlock();
+    //空闲线程的epoll_wait超时比它晚，唤醒一个重新计算
+    if(at_front){
+        tickle();
+    }
+    return 0;
+}
+
+int IOManager::finishEvent(int fd, Event event, uint64_t deadline_ms){
+    FdCtx::ptr ctx = FdMgr::GetInstance()->slot(fd, false);
+    if(!ctx){
+        errno = EBADF;
+        return -1;
+    }
+    FdContext::EventContext& event_ctx = ctx->getEventContext().getcontext(event);
+    //被事件唤醒时截止时间还在时间轮中，摘下来
+    if(deadline_ms != ~0ull){
+        FdContext::EventContext::Deadline& dl = event_ctx.deadline;
+        Spinlock::Lock lock(m_deadlineMutex);
+        if(dl.linked()){
+            m_deadlines.remove(&dl);
+        }
+    }
+    if(event_ctx.timedout){
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t IOManager::getNextDeadline(){
+    uint64_t next = ~0ull;
+    {
+        Spinlock::Lock lock(m_deadlineMutex);
+        next = m_deadlines.nextExpire();
+        m_nextDeadline = next;
+    }
+    if(next == ~0ull){
+        return ~0ull;
+    }
+    uint64_t now_ms = GetNowMS();
+    return now_ms >= next ? 0 : next - now_ms;
+}
+
+void IOManager::expireDeadlines(){
+    typedef FdContext::EventContext::Deadline Deadline;
+    //每个空闲线程复用自己的数组，批量处理到期的截止时间不分配内存
+    static thread_local std::vector<TimerWheelNode*> t_nodes;
+    static thread_local std::vector<std::pair<Deadline*, uint32_t> > t_expired;
+    std::vector<std::pair<Deadline*, uint32_t> >& expired = t_expired;
+    expired.clear();
+    {
+        Spinlock::Lock lock(m_deadlineMutex);
+        if(m_deadlines.empty()){
+            return;
+        }
+        t_nodes.clear();
+        m_deadlines.advance(GetNowMS(), t_nodes);
+        if(t_nodes.empty()){
+            return;
+        }
+        //摘下之后等待者可能马上开始下一次等待，记下这一次的seq
+        for(auto node : t_nodes){
+            Deadline* dl = static_cast<Deadline*>(node);
+            expired.push_back(std::make_pair(dl, dl->seq));
+        }
+    }
+    for(auto& i : expired){
+        Deadline* dl = i.first;
+        FdContext* fd_ctx = dl->fd_ctx;
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        //已经被事件唤醒，或者已经是下一次等待
+        if(dl->seq != i.second || !(fd_ctx->events & dl->event)){
+            continue;
+        }
+        fd_ctx->getcontext(dl->event).timedout = true;
+        cancelEvent(fd_ctx, dl->event);
+    }
+}
+
+ssize_t IOManager::submitIO(const io_uring_sqe& sqe, uint64_t timeout_ms){
+    CC_ASSERT(m_uring);
+    //同一个fd的操作都放在同一个io_uring上，close才能一次取消
+    IOManager* target = this;
+    FdContext* fd_ctx = nullptr;
+    if(FdCtx::ptr ctx = FdMgr::GetInstance()->slot(sqe.fd, false)){
+        fd_ctx = &ctx->getEventContext();
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        if(fd_ctx->uring){
+            target = fd_ctx->uring;
+        } else {
+            fd_ctx->uring = this;
+        }
+        ++fd_ctx->uringOps;
+    }
+    UringOp* op = new UringOp;
+    op->fiber = Fiber::GetThis();
+    op->iom = this;
+
+    io_uring_sqe sqes[2];
+    sqes[0] = sqe;
+    sqes[0].user_data = (uint64_t)op;
+    size_t count = 1;
+    if(timeout_ms != ~0ull){
+        //链接一个超时请求，到时间操作还没完成就取消它
+        op->refs = 2;
+        op->ts.tv_sec = timeout_ms / 1000;
+        op->ts.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
+        sqes[0].flags |= IOSQE_IO_LINK;
+        io_uring_sqe& link = sqes[1];
+        memset(&link, 0, sizeof(link));
+        link.opcode = IORING_OP_LINK_TIMEOUT;
+        link.fd = -1;
+        link.addr = (uint64_t)&op->ts;
+        link.len = 1;
+        link.user_data = (uint64_t)op | s_uring_timeout_tag;
+        count = 2;
+    }
+
+    //两个IOManager都不能在操作完成之前退出: 一个要收割完成事件，一个要恢复协程
+    ++m_pendingEventCount;
+    if(target != this){
+        ++target->m_pendingEventCount;
+    }
+    int rt = target->m_uring->submit(sqes, count);
+    if(rt < 0){
+        --m_pendingEventCount;
+        if(target != this){
+            --target->m_pendingEventCount;
+        }
+        releaseUring(fd_ctx);
+        delete op;
+        errno = -rt;
+        return -1;
+    }
+    //数据已经就绪的操作在io_uring_enter中就完成了，直接收割，不用等epoll唤醒
+    target->reapUring();
+
+    int expected = UringOp::PENDING;
+    if(op->state.compare_exchange_strong(expected, UringOp::WAITING, std::memory_order_acq_rel)){
+        Fiber::YieldToHold();
+    }
+    CC_ASSERT(op->state.load(std::memory_order_acquire) == UringOp::DONE);
+    releaseUring(fd_ctx);
+
+    ssize_t res = op->res;
+    bool timedout = op->timedout;
+    delete op;
+    if(res >= 0){
+        return res;
+    }
+    if(res == -ECANCELED){
+        //被超时取消，或者fd被close取消
+        errno = timedout ? ETIMEDOUT : EBADF;
+    } else {
+        errno = -res;
+    }
+    return -1;
+}
+
+void IOManager::releaseUring(FdContext* fd_ctx){
+    if(!fd_ctx){
+        return;
+    }
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    if(--fd_ctx->uringOps == 0){
+        fd_ctx->uring = nullptr;
+    }
+}
+
+void IOManager::reapUring(){
+    io_uring_cqe cqes[64];
+    while(true){
+        size_t n = m_uring->reap(cqes, 64);
+        for(size_t i = 0; i < n; ++i){
+            onUringComplete(cqes[i]);
+        }
+        if(n < 64){
+            break;
+        }
+    }
+}
+
+void IOManager::onUringComplete(const io_uring_cqe& cqe){
+    if(cqe.user_data == 0){
+        return;
+    }
+    UringOp* op = (UringOp*)(cqe.user_data & ~s_uring_timeout_tag);
+    if(cqe.user_data & s_uring_timeout_tag){
+        //-ETIME表示超时请求到期，被链接的操作随之以-ECANCELED完成
+        if(cqe.res == -ETIME){
+            op->timedout = true;
+        }
+    } else {
+        op->res = cqe.res;
+    }
+    if(op->refs.fetch_sub(1, std::memory_order_acq_rel) != 1){
+        return;
+    }
+    //改为DONE之后等待的协程可能立刻释放op，先取出协程
+    Fiber::ptr fiber = op->fiber;
+    IOManager* iom = op->iom;
+    if(op->state.exchange(UringOp::DONE, std::memory_order_acq_rel) == UringOp::WAITING){
+        iom->schedule(fiber);
+    }
+    //先调度再减少计数，避免调度器在两者之间认为已经没有任务而退出
+    if(iom != this){
+        --iom->m_pendingEventCount;
+    }
+    --m_pendingEventCount;
+}
+
 IOManager* IOManager::GetThis(){
     return dynamic_cast<IOManager*>(Scheduler::GetThis());
 }
@@ -337,9 +740,42 @@ void IOManager::tickle(){
     if(!hasIdleThreads()){
         return;
     }
-    //向pipe中写入一个"T",此时pipe会从epoll_wait中唤醒
-    int rt = write(m_tickleFds[1],"T",1);
-    CC_ASSERT(rt == 1);
+    //已经有一次唤醒还没被空闲线程取走，合并到那一次里
+    //被唤醒的线程取到任务后发现还有剩余任务会继续tickle，唤醒会逐个传递下去
+    if(m_tickled.exchange(true, std::memory_order_acq_rel)){
+        return;
+    }
+    //向eventfd中写入，唤醒一个阻塞在epoll_wait中的线程
+    uint64_t one = 1;
+    int rt = write(m_tickleFd, &one, sizeof(one));
+    CC_ASSERT(rt == sizeof(one));
+}
+
+//只有目标线程阻塞在epoll_pwait中时才需要唤醒，且只唤醒它
+//没有可用的信号时通过eventfd唤醒一个空闲线程，不是目标线程就由它接着传递(passInboxTickle)
+void IOManager::tickleWorker(Worker* worker){
+    if(!worker->idle){
+        return;
+    }
+    if(!m_tickleSignal){
+        tickle();
+        return;
+    }
+    pthread_kill(worker->handle, m_tickleSignal);
+}
+
+//eventfd的唤醒被不是目标线程的空闲线程取走了，再tickle一次
+//epoll_wait的等待者后进先醒，传出去的线程马上回去等待的话会和另一个线程互相唤醒，
+//一直轮不到目标线程，所以要等到目标线程离开idle再回去；每个线程最多传一次，
+//唤醒在一轮空闲线程之内到达目标线程
+void IOManager::passInboxTickle(Worker* self){
+    if(!hasIdleInboxTask(self)){
+        return;
+    }
+    tickle();
+    while(hasIdleInboxTask(self)){
+        sched_yield();
+    }
 }
 
 bool IOManager::stopping(){
@@ -368,21 +804,52 @@ void IOManager::idle(){ //P38
     std::shared_ptr<epoll_event> shared_events(events ,[](epoll_event* ptr){
         delete[] ptr;
     });
-    std::cout << "------idle------" << std::endl;
+    //当前调度线程，用于接收定向唤醒
+    Worker* worker = currentWorker();
+    //idle期间屏蔽唤醒信号，退出时恢复原来的屏蔽字
+    //epoll_pwait期间使用的信号屏蔽字: 在原来屏蔽字的基础上解除对唤醒信号的屏蔽
+    sigset_t old_mask;
+    sigset_t wait_mask;
+    sigemptyset(&old_mask);
+    sigemptyset(&wait_mask);
+    if(m_tickleSignal){
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, m_tickleSignal);
+        pthread_sigmask(SIG_BLOCK, &set, &old_mask);
+        wait_mask = old_mask;
+        sigdelset(&wait_mask, m_tickleSignal);
+    }
+    //到期定时器的回调，循环中复用同一块内存
+    std::vector<Callback> cbs;
+    std::vector<Callback> inline_cbs;
+    //最近空闲时长的滑动平均(微秒)，忙等时间按它自适应
+    uint64_t avg_gap_us = 0;
+    //每次忙等至少的时间(微秒)
+    static const uint64_t MIN_SPIN_US = 10;
     //int rt = 0;
     while(1){
         //下一个任务要执行的时间
         uint64_t next_timeout = 0;
+        //按最新的时间计算epoll_wait的超时
+        UpdateNow();
         CC_LOG_INFO(g_logger) << "timeout = " << next_timeout;
         if(stopping(next_timeout)) {
             CC_LOG_INFO(g_logger) << "name=" << getName() 
                                     << " idle stopping exit";
+            //其他空闲线程可能在最后一个任务结束前进入了epoll_wait，唤醒它们检查退出条件
+            tickle();
             break;
         }
         int rt = 0;
+        //waitEvent的截止时间更早时按它设置超时
+        uint64_t next_deadline = getNextDeadline();
+        if(next_deadline < next_timeout){
+            next_timeout = next_deadline;
+        }
 
         //陷入epoll_wait，等待事件发生
-        do{ //重置超时时间，最大为MAX_TIMEOUT
+        { //重置超时时间，最大为MAX_TIMEOUT
             static const int MAX_TIMEOUT = 3000;//ms
             //有指定的超时时间
             if(next_timeout != ~0ull){
@@ -390,7 +857,6 @@ void IOManager::idle(){ //P38
             }else{//没有指定超时时间，设置为3000ms
                 next_timeout = MAX_TIMEOUT;
             }
-            
 
             //epfd epoll_create() 返回的句柄
             //events 分配好的 epoll_event 结构体数组，epoll 将会把发生的事件复制到 events 数组中
@@ -403,25 +869,64 @@ void IOManager::idle(){ //P38
             //第2个参数 events 是一个数组，epoll_wait 会将发生的事件填充到这个数组中。
             //  next_timeout = -1时表示无限等待
 
-            //1.超时时间到了
-            //2.关注的socket有数据来了
-            //3.通过tickle往pipe里发数据，表明有任务来了
-            rt = epoll_wait(m_epfd, events, MAX_EVNETS, (int)next_timeout);
-            // rt表示返回值为正整数表示发生事件的文件描述符的数量。
-            // 这意味着有n个文件描述符已经准备好进行I/O操作，并且这些事件已经被写入events数组。
-            // 操作系统中断会返回EINTR，然后重新epoll_wait
-            if(rt < 0 && errno == EINTR){
-            } else {
-                // 有就绪事件发生
-                break;
+            //忙等阶段: 最近的空闲时长明显短于最长忙等时间时，先自旋等一会儿
+            uint32_t max_spin = m_busyPollUs;
+            uint64_t idle_start = GetMonotonicUS();
+            bool polled = false;
+            if(max_spin && next_timeout > 0 && avg_gap_us <= max_spin){
+                uint64_t budget = std::min<uint64_t>(max_spin, avg_gap_us * 2 + MIN_SPIN_US);
+                budget = std::min<uint64_t>(budget, next_timeout * 1000);
+                polled = busyPoll(events, MAX_EVNETS, budget, rt);
+            }
+
+            if(!polled){
+                //先置空闲标记再检查信箱，与enqueue中先放入信箱再检查空闲标记配对
+                if(worker){
+                    worker->idle = true;
+                    if(hasInboxTask(worker)){
+                        next_timeout = 0;
+                    }
+                }
+
+                //1.超时时间到了
+                //2.关注的socket有数据来了
+                //3.通过tickle往eventfd里写数据，表明有任务来了
+                //4.信箱中来了任务，被定向唤醒信号打断(EINTR)
+                rt = epoll_pwait(m_epfd, events, MAX_EVNETS, (int)next_timeout
+                                , m_tickleSignal ? &wait_mask : nullptr);
+                if(worker){
+                    worker->idle = false;
+                }
+                // rt表示返回值为正整数表示发生事件的文件描述符的数量。
+                // 这意味着有n个文件描述符已经准备好进行I/O操作，并且这些事件已经被写入events数组。
+                // 被信号中断返回EINTR，回到调度循环检查信箱
+                if(rt < 0 && errno == EINTR){
+                    rt = 0;
+                }
             }
-        }while(1);
+
+            //空闲时长(忙等或者阻塞到有任务/事件/超时)计入统计，
+            //它的滑动平均决定下一次忙等多久
+            uint64_t gap = GetMonotonicUS() - idle_start;
+            if(worker){
+                WorkerStats::Add(worker->stats.wait_us, gap);
+            }
+            if(max_spin){
+                avg_gap_us = avg_gap_us - avg_gap_us / 8 + gap / 8;
+            }
+        }
+        //epoll_wait返回后刷新一次缓存的时间，下面处理定时器和事件都使用它
+        UpdateNow();
 
         // 有就绪事件发生
         // 这里调用listExpiredCb返回的应该是那些超时的定时器
         // 因为有刚刚超时的，所以需要去执行
-        std::vector<std::function<void()> > cbs;
-        listExpireCb(cbs);
+        expireDeadlines();
+        listExpireCb(cbs, &inline_cbs);
+        //内联定时器的回调很短，直接在这里执行，不经过调度队列，也不需要协程
+        if(!inline_cbs.empty()){
+            runInline(inline_cbs);
+        }
         if(!cbs.empty()){
             // 把超时任务全部加入调度器
             schedule(cbs.begin(), cbs.end());
@@ -429,13 +934,19 @@ void IOManager::idle(){ //P38
         }
 
         // 处理就绪的fd
+        bool tickled = false;
         for(int i = 0; i < rt; ++i){
             epoll_event& event = events[i];
-            // 如果获得的这个信息是来自pipe
-            if(event.data.fd == m_tickleFds[0]){
-                // 读一个byte到dummy中
-                uint8_t dummy;
-                while(read(m_tickleFds[0], &dummy, 1) == 1);
+            // 如果获得的这个信息是来自eventfd
+            // 边缘触发下每次write都会产生新的事件，不需要read清空计数器，省掉一次系统调用
+            // 用exchange与tickleWorker中的tickle配对: 那次tickle被合并时这里一定能看到信箱中的任务
+            if(event.data.fd == m_tickleFd){
+                m_tickled.exchange(false, std::memory_order_acq_rel);
+                tickled = true;
+                continue;
+            }
+            if(m_uring && event.data.fd == m_uring->getFd()){
+                reapUring();
                 continue;
             }
 
@@ -445,8 +956,8 @@ void IOManager::idle(){ //P38
             // EPOLLERR 表示对应的文件描述符发生错误
             // EPOLLHUP 表示对应的文件描述符被挂起
             if(event.events & (EPOLLERR | EPOLLHUP)){ 
-                // 同时触发读写事件
-                event.events |= EPOLLIN | EPOLLOUT;
+                // 同时触发读写事件，只触发关注了的，否则会触发一个没有等待者的事件
+                event.events |= (EPOLLIN | EPOLLOUT) & (uint32_t)fd_ctx->events;
             }
             //获取感兴趣的事件(读/写)
             int real_events = NONE;
@@ -458,21 +969,30 @@ void IOManager::idle(){ //P38
             if(event.events & EPOLLOUT){
                 real_events |= WRITE;
             }
-            // 没有事件
-            if((fd_ctx->events & real_events) == NONE){
-                continue;
-            }
-            // 获取剩余事件,并重新注册
-            int left_events = (fd_ctx->events & ~real_events); 
-            int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-            event.events = EPOLLET | left_events;
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-            if(rt2){
-                CC_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd <<", "
-                                << op << "," << fd_ctx->fd << ", " << event.events
-                                << "):" << rt2 << " (" << errno << ") (" 
-                                << strerror(errno) << ")";
-                continue;
+            if(m_persistentEvents){
+                // 常驻注册不需要修改epoll，没有等待者的事件记下来，留给下一次addEvent
+                fd_ctx->ready = (Event)(fd_ctx->ready | (real_events & ~fd_ctx->events));
+                real_events &= fd_ctx->events;
+                if(real_events == NONE){
+                    continue;
+                }
+            } else {
+                // 没有事件
+                if((fd_ctx->events & real_events) == NONE){
+                    continue;
+                }
+                // 获取剩余事件,并重新注册
+                int left_events = (fd_ctx->events & ~real_events);
+                int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+                event.events = EPOLLET | (uint32_t)left_events;
+                int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
+                if(rt2){
+                    CC_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd <<", "
+                                    << op << "," << fd_ctx->fd << ", " << event.events
+                                    << "):" << rt2 << " (" << errno << ") ("
+                                    << strerror(errno) << ")";
+                    continue;
+                }
             }
 
             // 执行读 / 写事件
@@ -486,6 +1006,11 @@ void IOManager::idle(){ //P38
             }
         }
 
+        //没有定向唤醒信号时，信箱的唤醒也走eventfd，可能需要传给目标线程
+        if(tickled && !m_tickleSignal){
+            passInboxTickle(worker);
+        }
+
         //执行完epoll_wait返回的事件
         //获得当前协程
         Fiber::ptr cur = Fiber::GetThis();
@@ -494,6 +1019,44 @@ void IOManager::idle(){ //P38
         //返回主协程(调度器的MainFiber)，进行下一轮
         raw_ptr->swapOut();
     }
+    if(m_tickleSignal){
+        pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+    }
+}
+
+void IOManager::runInline(std::vector<Callback>& cbs){
+    for(auto& cb : cbs){
+        try{
+            cb();
+        } catch(std::exception& ex){
+            CC_LOG_ERROR(g_logger) << "inline timer except: " << ex.what();
+        } catch(...){
+            CC_LOG_ERROR(g_logger) << "inline timer except";
+        }
+    }
+    cbs.clear();
+}
+
+bool IOManager::busyPoll(epoll_event* events, int max_events, uint64_t budget_us, int& rt){
+    //已经在队列中的任务可能指定了其他线程，只看任务数有没有增加
+    //忙等期间本线程仍算空闲线程，放入全局/本地队列的任务会写eventfd，epoll_wait也能看到；
+    //只有放入信箱的任务不会唤醒(worker->idle为false)，靠任务数发现
+    size_t tasks = getTaskCount();
+    uint64_t deadline = GetMonotonicUS() + budget_us;
+    do{
+        rt = epoll_wait(m_epfd, events, max_events, 0);
+        if(rt > 0){
+            return true;
+        }
+        rt = 0;
+        if(getTaskCount() > tasks){
+            return true;
+        }
+        for(int i = 0; i < 64; ++i){
+            CpuRelax();
+        }
+    } while(GetMonotonicUS() < deadline);
+    return false;
 }
 
 void IOManager::onTimerInsertedAtFront() {
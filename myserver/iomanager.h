@@ -4,6 +4,10 @@
 #include "scheduler.h"
 #include "timer.h"
 
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct epoll_event;
+
 //实现协程调度
 //封装了epoll，支持为socket fd注册读写事件回调函数
 //IO协程调度器使用一对管道fd来tickle调度协程
@@ -11,8 +15,16 @@
 //除了协程调度，IO协程调度还增加了IO事件调度的功能，这个功能是针对描述符（一般是套接字描述符）的。
 //IO协程调度支持为描述符注册可读和可写事件的回调函数，当描述符可读或可写时，执行对应的回调函数。
 //可以直接把回调函数等效成协程，所以这个功能被称为IO协程调度
+//IO后端可以选择epoll(默认)或io_uring，由构造参数或配置iomanager.backend决定，
+//io_uring不可用时退回epoll。io_uring后端下hook的读写、accept、connect直接提交给内核，
+//完成事件在idle()中收割，然后恢复等待的协程；其他操作以及定时器、tickle仍然走epoll
+//配置iomanager.persistent_events打开后，fd在第一次addEvent时以EPOLLIN|EPOLLOUT|EPOLLET注册，
+//直到cancelAll(close)才删除，中间不再调用epoll_ctl。没有等待者时到达的边缘记在FdContext中，
+//下一次addEvent直接消费它，不用让出。此模式下fd必须通过hook的close关闭
 namespace cc{
 
+class IoUring;
+
 class IOManager : public Scheduler, public TimerManager{
 public:
 
@@ -24,8 +36,8 @@ public:
         READ  = 0X001, // = EPOLLIN
         WRITE = 0X004, // = EPOLLOUT
     };
-private:
     // 文件描述符的上下文类
+    // 存放在FdManager的每个fd记录(FdCtx)中，与阻塞模式、超时时间等放在一起
     // 实际是一个三元组，包含: 描述符-事件类型-回调函数
     struct FdContext{ 
         using MutexType = Mutex;
@@ -35,7 +47,16 @@ private:
         struct EventContext{
             Scheduler* scheduler = nullptr;       //执行事件回调的scheduler
             Fiber::ptr fiber;                     //事件回调协程
-            std::function<void()> cb;             //事件的回调函数
+            Callback cb;                          //事件的回调函数
+            //waitEvent的截止时间，侵入式地挂在IOManager的超时时间轮上，等待不需要分配内存
+            //seq在每次设置截止时间时加一，到期处理时用来判断是否还是同一次等待
+            struct Deadline : TimerWheelNode{
+                FdContext* fd_ctx = nullptr;
+                Event event = NONE;
+                uint32_t seq = 0;
+            };
+            Deadline deadline;
+            bool timedout = false;                //是否因为到达截止时间被唤醒
         };
 
         //根据事件类型获取对应事件上下文
@@ -49,6 +70,15 @@ private:
         EventContext write;     //写事件
         int fd = 0;             //事件关联的句柄
         Event events = NONE;    //fd所关注的事件类型
+        //常驻注册模式下使用: 注册到的IOManager的编号(0表示没有注册)，以及到达时没有等待者、被记下来的就绪事件
+        //记录编号而不是地址或epfd，IOManager销毁后地址、epfd被复用时不会误认为已经注册
+        //fd关闭后内核会把它从epoll中删除，FdManager::del和重新创建记录时清零
+        uint64_t registered = 0;
+        Event ready = NONE;
+        //该fd上还没完成的io_uring操作提交到的IOManager以及操作数
+        //同一个fd的操作都提交到同一个io_uring上，close时只需要在它上面取消
+        IOManager* uring = nullptr;
+        uint32_t uringOps = 0;
         MutexType mutex;        //事件的mutex
     };
     
@@ -58,8 +88,10 @@ public:
      * threads 线程数量
      * use_caller 是否将调度器所在线程包含进去
      * name 调度器的名称
+     * backend IO后端，"epoll"或"io_uring"，为空时使用配置iomanager.backend
      */
-    IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = "");
+    IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = ""
+              ,const std::string& backend = "");
     ~IOManager();
 
     /**
@@ -69,42 +101,115 @@ public:
      * event 事件类型
      * cb 事件回调函数，如果为空，则默认把当前协程作为回调执行体
      * 添加成功返回0,失败返回-1
+     * 常驻注册模式下事件已经就绪时: 有cb则直接调度cb并返回0，否则返回1，调用者不需要让出
      */
-    int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+    int addEvent(int fd, Event event, Callback cb = nullptr);
     bool delEvent(int fd, Event event);
     bool cancelEvent(int fd, Event event);
 
     bool cancelAll(int fd);
+    //取消fd上所有还没完成的io_uring操作，发给提交它们的IOManager，可以在任何线程调用
+    static void CancelUring(int fd);
+
+    /**
+     * 当前协程等待fd上的事件，直到事件就绪或者到达截止时间
+     * deadline_ms 截止时间(GetNowMS()的时间基准)，~0ull表示不超时
+     * 就绪返回0；超时返回-1，errno为ETIMEDOUT；添加事件失败返回-1
+     * 等待状态保存在fd的记录中，不分配内存
+     */
+    int waitEvent(int fd, Event event, uint64_t deadline_ms);
+
+    /**
+     * waitEvent的回调版本，供不在协程中等待的调用者(例如Task)使用
+     * armEvent注册事件和截止时间后立即返回，事件就绪或者到达截止时间时调度cb，
+     * cb中调用finishEvent摘下截止时间并取得结果(0就绪，-1超时，errno为ETIMEDOUT)
+     * armEvent注册成功返回0，失败返回-1；cb为空时等待当前协程，常驻注册模式下已经就绪返回1
+     */
+    int armEvent(int fd, Event event, uint64_t deadline_ms, Callback cb = nullptr);
+    int finishEvent(int fd, Event event, uint64_t deadline_ms);
+
+    //是否使用io_uring后端
+    bool isUring() const { return m_uring != nullptr;}
+
+    /**
+     * 空闲线程阻塞在epoll_wait之前先忙等的最长时间(微秒)，0表示不忙等，默认取配置iomanager.busy_poll_us
+     * 忙等期间轮询任务队列并调用epoll_wait(..., 0)，新任务或事件到来时不需要唤醒线程，
+     * 省掉一次睡眠/唤醒的延迟，代价是空闲时占用CPU。
+     * 实际忙等时间按最近的空闲时长自适应: 任务通常很快就来时忙等，通常要等很久时直接阻塞
+     */
+    void setBusyPoll(uint32_t max_us) { m_busyPollUs = max_us;}
+    uint32_t getBusyPoll() const { return m_busyPollUs;}
+    /**
+     * 通过io_uring提交一次操作，当前协程让出执行权，直到操作完成
+     * fd上已经有其他IOManager提交的操作还没完成时，提交到那个IOManager的io_uring上，完成后仍在本调度器上恢复
+     * sqe 填好的请求，user_data和flags由IOManager设置
+     * timeout_ms 超时时间(毫秒)，~0ull表示不超时
+     * 返回值与对应的系统调用一致，失败返回-1并设置errno，超时errno为ETIMEDOUT
+     */
+    ssize_t submitIO(const io_uring_sqe& sqe, uint64_t timeout_ms);
 
     static IOManager* GetThis();
 
 protected:
     //有新事件需要唤醒协程执行tickle()
     void tickle() override;
+    //定向唤醒阻塞在epoll_pwait中的指定线程
+    void tickleWorker(Worker* worker) override;
+    //没有定向唤醒信号时，把取走的eventfd唤醒传给信箱中有任务的空闲线程
+    void passInboxTickle(Worker* self);
     //是否需要终止
     bool stopping() override;
     //没有协程需要执行时，执行idle
     void idle() override;
     //根据超时时间判断是否中止
     bool stopping(uint64_t& timeout);
-    //重置context上下文大小
-    void contextResize(size_t size);
     //
     void onTimerInsertedAtFront() override;
+    //在已经加锁的fd_ctx上添加事件，返回值与addEvent相同
+    int addEventLocked(FdContext* fd_ctx, Event event, Callback& cb);
+    //取消已经加锁的fd_ctx上的事件，并触发一次
+    bool cancelEvent(FdContext* fd_ctx, Event event);
+    //最近的waitEvent截止时间距离现在的毫秒数，没有返回~0ull
+    uint64_t getNextDeadline();
+    //处理已经到达截止时间的waitEvent
+    void expireDeadlines();
+    //在空闲协程中直接执行内联定时器的回调，执行完清空
+    void runInline(std::vector<Callback>& cbs);
+    //收割io_uring完成队列中的事件
+    void reapUring();
+    //submitIO的操作完成，减少fd上的io_uring操作数
+    void releaseUring(FdContext* fd_ctx);
+    //阻塞之前忙等最多budget_us微秒，有新任务或者就绪事件时提前结束
+    //返回是否等到，rt为epoll_wait(..., 0)取到的事件数
+    bool busyPoll(epoll_event* events, int max_events, uint64_t budget_us, int& rt);
+    void onUringComplete(const io_uring_cqe& cqe);
 private:
     //epoll 文件句柄
     //文件句柄是操作系统用于标识和管理已打开文件或其他I/O资源的抽象概念。
     //在Unix/Linux系统中，文件句柄称为文件描述符，通常是一个非负整数。
     int m_epfd = 0;
     //用于tickle
-    //pipe 文件句柄
-    //fd[0]读取 fd[1]写入
-    int m_tickleFds[2];
+    //eventfd 文件句柄
+    int m_tickleFd = -1;
+    //已经写入eventfd但还没有被空闲线程取走，期间的tickle合并为一次
+    std::atomic<bool> m_tickled = {false};
     //当前等待执行的事件数量
     std::atomic<size_t> m_pendingEventCount = {0};
-    RWMutexType m_mutex;
-    //socket事件上下文的容器
-    std::vector<FdContext*> m_fdContexts;
+    //io_uring后端，使用epoll时为空
+    std::unique_ptr<IoUring> m_uring;
+    //fd常驻注册在epoll中，就绪事件记在FdContext里
+    bool m_persistentEvents = false;
+    //进程内唯一的编号，常驻注册时记在FdContext::registered中
+    uint64_t m_id = 0;
+    //空闲时忙等的最长时间(微秒)
+    std::atomic<uint32_t> m_busyPollUs = {0};
+    //定向唤醒空闲线程的信号，0表示不使用
+    int m_tickleSignal = 0;
+    //waitEvent截止时间的时间轮，节点是EventContext::Deadline
+    Spinlock m_deadlineMutex;
+    TimerWheel m_deadlines;
+    //空闲线程按这个截止时间设置超时，更早的截止时间加入时需要唤醒
+    std::atomic<uint64_t> m_nextDeadline = {~0ull};
 };
 
 }
@@ -382,7 +382,7 @@ FileLogAppender::FileLogAppender(const std::string &filename)
 void FileLogAppender::log(std::shared_ptr<Logger> logger,LogLevel::Level level, LogEvent::ptr event){
     
     if(level >= m_level){
-        uint64_t now = time(0);
+        uint64_t now = event->getTime();
         if(now != m_lastTime){ //防止误删除日志文件后，系统无感知，因此不断重复打开文件，防止日志记录丢失
             reopen();
             m_lastTime = now;
@@ -4,6 +4,7 @@
 #include <string>
 #include <iostream>
 #include <cstdint>
+#include <stdarg.h>
 #include <memory>
 #include <list>
 #include <fstream>
@@ -14,13 +15,14 @@
 #include "singleton.h"
 #include "util.h"
 #include "thread.h"
+#include "clock.h"
 
 //日志生成调用顺序 LogEvent -> Logger -> LogAppender -> LogFormatter -> FormatItem::format
 
 #define CC_LOG(logger, level) \
     if(logger->getLevel() <= level) \
         cc::LogEventWrap(cc::LogEvent::ptr(new cc::LogEvent(logger, level, \
-        __FILE__, __LINE__, 0, cc::GetThreadId(), cc::GetFiberId(),time(0),cc::Thread::GetName()))).getSS()
+        __FILE__, __LINE__, 0, cc::GetThreadId(), cc::GetFiberId(),cc::GetNowSeconds(),cc::Thread::GetName()))).getSS()
 //wrapper析构时，输出event中固定的上述日志内容，并使用get.SS()接受自定义的日志内容，并输出
 
 #define CC_LOG_DEBUG(logger) CC_LOG(logger, cc::LogLevel::DEBUG)
@@ -34,7 +36,7 @@
     if(logger->getLevel() <= level) \
         cc::LogEventWrap(cc::LogEvent::ptr(new cc::LogEvent(logger, level,\
         __FILE__, __LINE__, 0, cc::GetThreadId(), \
-        cc::GetFiberId(),time(0),cc::Thread::GetName()))).getEvent()->format(fmt, __VA_ARGS__)
+        cc::GetFiberId(),cc::GetNowSeconds(),cc::Thread::GetName()))).getEvent()->format(fmt, __VA_ARGS__)
 //_VA_ARGS__表示的变量按照fmt定义的格式(类似于printf的输出)输入到m_ss里,根据自定义的输出日志格式，有%m格式时
 //记录message，也就是m_ss中的内容
 
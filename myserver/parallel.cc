@@ -0,0 +1,34 @@
+#include "parallel.h"
+#include "macro.h"
+
+namespace cc{
+
+void WaitGroup::done(){
+    std::deque<FiberWaiter> waiters;
+    {
+        //计数也在锁内修改: wait看到归零时done已经不再访问这个对象，
+        //等待者返回后可以马上销毁WaitGroup
+        Spinlock::Lock lock(m_mutex);
+        int64_t v = m_count.fetch_sub(1, std::memory_order_acq_rel) - 1;
+        CC_ASSERT(v >= 0);
+        if(v != 0){
+            return;
+        }
+        waiters.swap(m_waiters);
+    }
+    for(auto& i : waiters){
+        i.wake();
+    }
+}
+
+void WaitGroup::wait(){
+    Spinlock::Lock lock(m_mutex);
+    if(m_count.load(std::memory_order_acquire) == 0){
+        return;
+    }
+    m_waiters.push_back(FiberWaiter::Current());
+    lock.unlock();
+    Fiber::YieldToHold();
+}
+
+}
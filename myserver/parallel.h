@@ -0,0 +1,167 @@
+#ifndef __CC_PARALLEL_H__
+#define __CC_PARALLEL_H__
+
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <exception>
+#include <stdint.h>
+#include "fiber_sync.h"
+#include "macro.h"
+#include "scheduler.h"
+#include "noncopyable.h"
+
+//在调度器上并发执行一组任务并等待它们全部完成
+//等待只挂起当前协程，调度线程继续执行子任务和其他协程，
+//总耗时取决于最慢的子任务，而不是所有子任务耗时之和
+namespace cc{
+
+//类似go的sync.WaitGroup
+//add登记任务数，每个任务完成时done，wait挂起直到计数归零
+//子任务通过指针访问WaitGroup，共享栈协程(Fiber的shared_stack)的栈会被其他协程覆盖，
+//在共享栈协程中使用时WaitGroup不能放在栈上
+class WaitGroup : Noncopyable{
+public:
+    WaitGroup(int64_t count = 0)
+        :m_count(count) {}
+
+    void add(int64_t n = 1) { m_count.fetch_add(n, std::memory_order_relaxed);}
+    //计数归零时唤醒所有等待者，可以在任何线程调用
+    void done();
+    //只能在调度器中运行的协程里调用
+    void wait();
+
+    //登记并调度一个任务，任务结束时自动done
+    //sc为nullptr时使用当前调度器
+    //直接捕获可调用对象本身，不超过Callback的内联大小时调度不分配内存
+    template<class F>
+    void go(F&& f, Scheduler* sc = nullptr){
+        if(!sc){
+            sc = Scheduler::GetThis();
+        }
+        add(1);
+        sc->schedule(GoTask<typename std::decay<F>::type>(this, std::forward<F>(f)));
+    }
+private:
+    //析构时done，任务抛出异常也不会让等待者永远挂起
+    struct DoneGuard{
+        WaitGroup* wg;
+        ~DoneGuard() { wg->done();}
+    };
+    //go调度的任务: 执行完后done
+    template<class Fn>
+    struct GoTask{
+        WaitGroup* wg;
+        Fn fn;
+        template<class F>
+        GoTask(WaitGroup* w, F&& f)
+            :wg(w), fn(std::forward<F>(f)) {}
+        void operator()(){
+            DoneGuard guard{wg};
+            fn();
+        }
+    };
+private:
+    std::atomic<int64_t> m_count;
+    Spinlock m_mutex;
+    std::deque<FiberWaiter> m_waiters;
+};
+
+//把[begin, end)切分成若干块，每块一个调度任务，块内顺序调用f(i)
+//grain 每块的元素个数，0表示按调度线程数自动切分(每个线程约4块，便于负载均衡)
+//最后一块由调用者自己执行，执行完后等待其他块完成；只能在调度器中运行的协程里调用
+//f抛出的异常在所有块结束后重新抛给调用者，有多个时只保留第一个
+//子任务引用调用者栈上的f和等待状态，不能在共享栈协程中调用
+template<class F>
+void parallel_for(size_t begin, size_t end, F&& f, size_t grain = 0, Scheduler* sc = nullptr){
+    if(begin >= end){
+        return;
+    }
+    CC_ASSERT2(!Fiber::GetThisPtr()->isSharedStack(), "parallel_for on shared stack fiber");
+    if(!sc){
+        sc = Scheduler::GetThis();
+    }
+    size_t n = end - begin;
+    if(grain == 0){
+        size_t parts = std::max<size_t>(sc->getWorkerCount(), 1) * 4;
+        grain = std::max<size_t>((n + parts - 1) / parts, 1);
+    }
+    //子任务共享的状态，第一个异常记在error中
+    struct State{
+        WaitGroup wg;
+        Spinlock mutex;
+        std::exception_ptr error;
+
+        void fail(){
+            Spinlock::Lock lock(mutex);
+            if(!error){
+                error = std::current_exception();
+            }
+        }
+    };
+    State state;
+    size_t lo = begin;
+    for(; end - lo > grain; lo += grain){
+        size_t hi = lo + grain;
+        state.wg.go([&f, &state, lo, hi](){
+            try{
+                for(size_t i = lo; i < hi; ++i){
+                    f(i);
+                }
+            } catch (...){
+                state.fail();
+            }
+        }, sc);
+    }
+    //调用者的块抛出异常时也要等子任务结束，它们还在引用f和state
+    try{
+        for(size_t i = lo; i < end; ++i){
+            f(i);
+        }
+    } catch (...){
+        state.fail();
+    }
+    state.wg.wait();
+    if(state.error){
+        std::rethrow_exception(state.error);
+    }
+}
+
+//并行映射后归约: 每块从init开始用reduce(acc, map(i))累积出部分结果，
+//所有块完成后在调用者协程中按块的顺序把部分结果依次归约到init上
+//reduce需要满足结合律，init需要是reduce的单位元；异常和共享栈的限制同parallel_for
+template<class R, class Map, class Reduce>
+R map_reduce(size_t begin, size_t end, R init, Map&& map, Reduce&& reduce
+             ,size_t grain = 0, Scheduler* sc = nullptr){
+    if(begin >= end){
+        return init;
+    }
+    if(!sc){
+        sc = Scheduler::GetThis();
+    }
+    size_t n = end - begin;
+    if(grain == 0){
+        size_t parts = std::max<size_t>(sc->getWorkerCount(), 1) * 4;
+        grain = std::max<size_t>((n + parts - 1) / parts, 1);
+    }
+    std::vector<R> partial((n + grain - 1) / grain, init);
+    parallel_for(0, partial.size(), [&](size_t chunk){
+        size_t lo = begin + chunk * grain;
+        size_t hi = std::min(lo + grain, end);
+        R& acc = partial[chunk];
+        for(size_t i = lo; i < hi; ++i){
+            acc = reduce(std::move(acc), map(i));
+        }
+    }, 1, sc);
+    R result = std::move(init);
+    for(auto& i : partial){
+        result = reduce(std::move(result), std::move(i));
+    }
+    return result;
+}
+
+}
+
+#endif
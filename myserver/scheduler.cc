@@ -18,11 +18,44 @@ static cc::Logger::ptr g_logger = CC_LOG_NAME("system");
 static thread_local Scheduler* t_scheduler = nullptr;
 //线程调度协程
 static thread_local Fiber* t_scheduler_fiber = nullptr;
+//当前线程作为调度线程所属的调度器，以及它的本地队列下标
+static thread_local Scheduler* t_worker_scheduler = nullptr;
+static thread_local size_t t_worker_index = 0;
+//当前线程正在执行的任务的排队时间
+static thread_local uint64_t t_task_sojourn = 0;
+
+static ConfigVar<std::string>::ptr g_cpu_affinity =
+    Config::Lookup<std::string>("scheduler.cpu_affinity", "", "cpu list to pin scheduler threads, e.g. 0-7,16-23");
+//使用配置的CPU列表的调度线程总数
+static std::atomic<size_t> s_config_cpu_next(0);
+
+static ConfigVar<uint64_t>::ptr g_codel_target =
+    Config::Lookup<uint64_t>("scheduler.codel.target", 5, "scheduler queue delay target ms");
+static ConfigVar<uint64_t>::ptr g_codel_interval =
+    Config::Lookup<uint64_t>("scheduler.codel.interval", 100, "scheduler queue delay interval ms");
+
+static ConfigVar<bool>::ptr g_task_timing =
+    Config::Lookup<bool>("scheduler.task_timing", true, "record per task run time histogram");
 
 
 Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
-    : m_name(name){
+    : m_codel(g_codel_target->getValue(), g_codel_interval->getValue())
+    , m_name(name)
+    , m_taskTiming(g_task_timing->getValue()){
     CC_ASSERT(threads > 0);
+    for(auto& i : m_globalCount){
+        i = 0;
+    }
+    m_cpus = ParseCpuList(g_cpu_affinity->getValue());
+    if(!m_cpus.empty()){
+        m_cpuBase = s_config_cpu_next.fetch_add(threads - (use_caller ? 1 : 0));
+    }
+
+    //每个调度线程(包括caller线程)一个本地队列
+    m_workers.resize(threads);
+    for(auto& i : m_workers){
+        i.reset(new Worker);
+    }
 
     //使用调度器所在线程，可以少创建一个线程
     if(use_caller) {
@@ -81,6 +114,7 @@ void Scheduler::start(){
         m_threadIds.push_back(m_threads[i]->getId());
     }
     lock.unlock();
+    bindThreads();
     // if(m_rootFiber){ //使用的当前线程的主协程
     //     //m_rootFiber->swapIn();
     //     m_rootFiber->call();
@@ -170,6 +204,16 @@ void Scheduler::run(){
         t_scheduler_fiber = Fiber::GetThis().get();
     }
 
+    //绑定本线程的本地队列
+    t_worker_scheduler = this;
+    t_worker_index = m_nextWorker++ % m_workers.size();
+    Worker* worker = m_workers[t_worker_index].get();
+    worker->handle = pthread_self();
+    worker->thread = cc::GetThreadId();
+    WorkerStats& stats = worker->stats;
+    //调度线程缓存当前时间，每取到一个任务刷新一次
+    UpdateNow();
+
     //没有协程有任务做时空闲协程执行
     Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
     //待调度协程，用于接收下面ft中可能需要调度的协程
@@ -179,37 +223,26 @@ void Scheduler::run(){
     while(true){
         ft.reset();
         bool tickle_me = false;
-        bool is_active = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            //m_fibers即为任务队列
-            auto it = m_fibers.begin();
-            //找到一个需要执行的协程就可以退出
-            while (it != m_fibers.end()) {
-                //如果已经指定了线程但是当前线程并不是被指定的,tickle即可，跳过
-                if(it->thread != -1 && it->thread != cc::GetThreadId()){ 
-                    it++;
-                    tickle_me = true;
-                    continue;
-                }
-
-                //有任务可调度(协程 / 函数)
-                CC_ASSERT(it->fiber || it->cb);
-                //待调度的是协程，且这个协程在执行，跳过
-                if(it->fiber && it->fiber->getState() == Fiber::EXEC){
-                    ++it;
-                    continue;
-                }
-
-                //拿到这个任务(没在执行，且当前线程就是它绑定的线程或者没有指定线程)
-                ft = *it;
-                m_fibers.erase(it);
-                ++m_activeThreadCount;
-                is_active = true;
-                break;
-            }
-            //有需要调度的协程
-            tickle_me |= it != m_fibers.end();
+        //取任务的顺序: 信箱 -> 按优先级依次取本地队列、全局注入队列 -> 窃取其他线程的本地队列
+        //外部线程提交的高优先级任务不会排在本线程的低优先级任务之后
+        const int* order = PickOrder(worker);
+        bool is_active = popInbox(worker, ft);
+        for(int i = 0; !is_active && i < PRIORITY_COUNT; ++i){
+            is_active = popLocal(worker, order[i], ft)
+                        || popGlobal(order[i], ft, tickle_me);
+        }
+        is_active = is_active || steal(order, ft);
+        //还有剩余任务，通知空闲线程来窃取
+        tickle_me |= is_active && m_taskCount > 0;
+        if(is_active){
+            UpdateNow();
+            //排队时间: 当前任务的用于快速失败，队列中最老任务的用于过载检测
+            uint64_t now = GetNowMS();
+            uint64_t now_us = m_taskTiming ? GetMonotonicUS() : now * 1000;
+            uint64_t sojourn_us = now_us > ft.stamp ? now_us - ft.stamp : 0;
+            t_task_sojourn = sojourn_us / 1000;
+            m_codel.update(now_us > ft.oldest ? (now_us - ft.oldest) / 1000 : 0, now);
+            stats.queue_us.add(sojourn_us);
         }
 
         if(tickle_me){
@@ -220,39 +253,51 @@ void Scheduler::run(){
         if(ft.fiber && (ft.fiber->getState() != Fiber::TERM
                         && ft.fiber->getState() != Fiber::EXCEPT)){
             //切换到这个协程
-            ft.fiber->swapIn();
-            //执行完/或者暂时被HOLD
-            --m_activeThreadCount;
+            uint64_t start = m_taskTiming ? GetMonotonicUS() : 0;
+            Fiber::State state = ft.fiber->swapIn();
+            if(m_taskTiming){
+                stats.run_us.add(GetMonotonicUS() - start);
+            }
+            WorkerStats::Add(stats.tasks, 1);
+            WorkerStats::Add(stats.switches, 1);
             //如果未执行完，根据状态进行选择，继续加入调度队列或者HOLD
-            if(ft.fiber->getState() == Fiber::READY){
+            //HOLD的协程可能已经被唤醒并在其他线程上运行，只看swapIn返回的状态
+            //先重新入队再减少活跃线程数，避免stopping()误判为没有任务
+            if(state == Fiber::READY){
                 schedule(ft.fiber);
-            } else if (ft.fiber->getState() != Fiber::TERM 
-                        && ft.fiber->getState() != Fiber::EXCEPT){
-                ft.fiber->m_state = Fiber::HOLD;
             }
+            //执行完/或者暂时被HOLD
+            --m_activeThreadCount;
             //执行结束
             ft.reset();
         } else if(ft.cb){ //需要调度的是回调函数，包装为协程进行调度
             if(cb_fiber){
-                cb_fiber->reset(ft.cb);
+                cb_fiber->reset(std::move(ft.cb));
             } else {
-                cb_fiber.reset(new Fiber(ft.cb));
+                cb_fiber.reset(new Fiber(std::move(ft.cb), 0, false, m_sharedStack));
             }
+            //回调中挂起后再被唤醒，仍按这个优先级调度
+            cb_fiber->setPriority(ft.priority);
             ft.reset();
-            cb_fiber->swapIn();
-            --m_activeThreadCount;
+            uint64_t start = m_taskTiming ? GetMonotonicUS() : 0;
+            Fiber::State state = cb_fiber->swapIn();
+            if(m_taskTiming){
+                stats.run_us.add(GetMonotonicUS() - start);
+            }
+            WorkerStats::Add(stats.tasks, 1);
+            WorkerStats::Add(stats.switches, 1);
             //与协程类似
-            if(cb_fiber->getState() == Fiber::READY){
+            if(state == Fiber::READY){
                 schedule(cb_fiber);
                 cb_fiber.reset();
-            } else if (cb_fiber->getState() == Fiber::TERM //执行结束(正常中止或者异常)
-                        || cb_fiber->getState() == Fiber::EXCEPT){
+            } else if (state == Fiber::TERM //执行结束(正常中止或者异常)
+                        || state == Fiber::EXCEPT){
                 cb_fiber->reset(nullptr);
-            } else {//if (cb_fiber->getState() != Fiber::TERM ){
-                cb_fiber->m_state = Fiber::HOLD;
+            } else {
+                //HOLD，由唤醒它的一方持有
                 cb_fiber.reset();
             }
-            cb_fiber.reset();
+            --m_activeThreadCount;
         } else {
             //没有任务时，不断执行轮询，使用idle_fiber占用CPU，
             if(is_active){
@@ -262,19 +307,19 @@ void Scheduler::run(){
             // 如果idle_fiber的状态为TERM则完全结束调度
             if(idle_fiber->getState() == Fiber::TERM){
                 CC_LOG_INFO(g_logger) << "idle fiber term";
+                //线程(use_caller时是调用者线程)不再是调度线程，不再使用缓存的时间
+                ClearNow();
                 //continue;
                 break;
             }
             //CC_LOG_INFO(g_logger) << "idle thread ID = " << cc::GetThreadId();
             // 否则，运行idle协程
             ++m_idleThreadCount;
-            std::cout << "---------------" << std::endl;
+            uint64_t idle_start = GetMonotonicUS();
             idle_fiber->swapIn();
+            WorkerStats::Add(stats.idle_us, GetMonotonicUS() - idle_start);
+            WorkerStats::Add(stats.switches, 1);
             --m_idleThreadCount;
-            if(idle_fiber->getState() != Fiber::TERM
-                && idle_fiber->getState() != Fiber::EXCEPT){
-                idle_fiber->m_state = Fiber::HOLD;
-            }
         }
     }
 }
@@ -283,10 +328,361 @@ void Scheduler::tickle(){
     CC_LOG_INFO(g_logger) << "tickle";
 }
 
+void Scheduler::tickleWorker(Worker*){
+    tickle();
+}
+
+void* Scheduler::Worker::operator new(size_t size){
+    void* mem = nullptr;
+    if(posix_memalign(&mem, alignof(Worker), size)){
+        throw std::bad_alloc();
+    }
+    return mem;
+}
+
+void Scheduler::Worker::operator delete(void* p){
+    free(p);
+}
+
+Scheduler::Worker* Scheduler::currentWorker(){
+    if(t_worker_scheduler != this){
+        return nullptr;
+    }
+    return m_workers[t_worker_index].get();
+}
+
+bool Scheduler::hasInboxTask(Worker* worker){
+    Spinlock::Lock lock(worker->inboxMutex);
+    return !worker->inbox.empty();
+}
+
+bool Scheduler::hasIdleInboxTask(Worker* self){
+    for(auto& i : m_workers){
+        Worker* worker = i.get();
+        if(worker != self && worker->idle && hasInboxTask(worker)){
+            return true;
+        }
+    }
+    return false;
+}
+
 // 当自动停止 && 正在停止 && 任务队列为空 && 活跃的线程数量为0
+// 取任务时先增加活跃线程数再减少任务数，这里按相反的顺序读取
 bool Scheduler::stopping(){
+    return m_autostop && m_stopping && m_taskCount == 0 && m_activeThreadCount == 0;
+}
+
+//调度线程提交的不指定线程的任务放入本地队列，不需要竞争全局锁
+//指定线程的任务放入目标线程的信箱，只唤醒目标线程
+//其他情况放入全局注入队列
+bool Scheduler::enqueue(FiberAndThread& ft){
+    if(!ft.fiber && !ft.cb){
+        return false;
+    }
+    CC_ASSERT(ft.priority >= INHERIT && ft.priority < PRIORITY_COUNT);
+    //统计执行时间时用精确时钟，排队时间直方图才有微秒精度
+    ft.stamp = m_taskTiming ? GetMonotonicUS() : GetMonotonicMS() * 1000;
+    if(ft.priority == INHERIT){
+        ft.priority = ft.fiber ? ft.fiber->getPriority() : NORMAL;
+    } else if(ft.fiber){
+        //指定的优先级记到协程上，之后被唤醒时沿用
+        ft.fiber->setPriority(ft.priority);
+    }
+    //共享栈协程运行过之后只能回到原来的线程继续执行
+    if(ft.fiber && ft.fiber->isSharedStack() && ft.fiber->getStackThread() != -1){
+        ft.thread = ft.fiber->getStackThread();
+    }
+    if(ft.thread != -1){
+        Worker* target = findWorker(ft.thread);
+        if(target){
+            {
+                Spinlock::Lock lock(target->inboxMutex);
+                target->inbox.push_back(std::move(ft));
+                ++m_taskCount;
+            }
+            //先放入信箱再检查目标线程是否空闲，与idle中先置空闲标记再检查信箱配对
+            tickleWorker(target);
+            return false;
+        }
+    }
+    if(ft.thread == -1 && t_worker_scheduler == this){
+        Worker* worker = m_workers[t_worker_index].get();
+        Spinlock::Lock lock(worker->mutex);
+        worker->tasks[ft.priority].push_back(std::move(ft));
+        ++m_taskCount;
+        //本地任务只能由空闲线程窃取，有空闲线程才需要通知
+        return hasIdleThreads();
+    }
+
     MutexType::Lock lock(m_mutex);
-    return m_autostop && m_stopping && m_fibers.empty() && m_activeThreadCount == 0;
+    bool need_tickle = m_fibers[HIGH].empty() && m_fibers[NORMAL].empty() && m_fibers[LOW].empty();
+    ++m_globalCount[ft.priority];
+    m_fibers[ft.priority].push_back(std::move(ft));
+    ++m_taskCount;
+    return need_tickle;
+}
+
+//在队列中找到一个可以执行的任务
+//待调度的是协程，且这个协程仍在执行(还没来得及切出)，则跳过
+//lifo为true时从队尾开始找
+bool Scheduler::TakeRunnable(TaskQueue& tasks, bool lifo
+                             ,FiberAndThread& ft){
+    for(size_t i = 0; i < tasks.size(); ++i){
+        size_t idx = lifo ? tasks.size() - 1 - i : i;
+        auto& t = tasks[idx];
+        if(t.fiber && t.fiber->getState() == Fiber::EXEC){
+            continue;
+        }
+        Take(tasks, idx, ft);
+        return true;
+    }
+    return false;
+}
+
+void Scheduler::Take(TaskQueue& tasks, size_t i, FiberAndThread& ft){
+    tasks.take(i, ft);
+    //队头是队列中最早入队的任务
+    ft.oldest = ft.stamp;
+    if(!tasks.empty() && tasks[0].stamp < ft.oldest){
+        ft.oldest = tasks[0].stamp;
+    }
+}
+
+uint64_t Scheduler::GetTaskSojourn(){
+    return t_task_sojourn;
+}
+
+void Scheduler::setCpuAffinity(const std::vector<int>& cpus){
+    m_cpus = cpus;
+    m_cpuBase = 0;
+    //已经启动的调度线程重新绑定
+    if(!m_stopping){
+        bindThreads();
+    }
+}
+
+//之后本线程缺页的内存(协程栈、缓冲区)都在该CPU所在的NUMA节点上
+void Scheduler::bindThreads(){
+    if(m_cpus.empty()){
+        return;
+    }
+    for(size_t i = 0; i < m_threads.size(); ++i){
+        int cpu = m_cpus[(m_cpuBase + i) % m_cpus.size()];
+        schedule([this, cpu](){
+            if(!BindThisThread(cpu)){
+                return;
+            }
+            Worker* worker = currentWorker();
+            worker->node = GetBoundNode();
+            worker->cpu = cpu;
+            CC_LOG_INFO(g_logger) << m_name << " thread " << cc::GetThreadId()
+                << " bind cpu=" << cpu << " node=" << worker->node;
+        }, m_threads[i]->getId());
+    }
+}
+
+int Scheduler::getThreadOnCpu(int cpu){
+    for(auto& i : m_workers){
+        if(i->cpu == cpu){
+            return i->thread;
+        }
+    }
+    return -1;
+}
+
+//调度线程数量很少，直接遍历
+Scheduler::Worker* Scheduler::findWorker(int thread){
+    for(auto& i : m_workers){
+        if(i->thread == thread){
+            return i.get();
+        }
+    }
+    return nullptr;
+}
+
+bool Scheduler::popInbox(Worker* worker, FiberAndThread& ft){
+    Spinlock::Lock lock(worker->inboxMutex);
+    if(worker->inbox.empty() || !TakeRunnable(worker->inbox, false, ft)){
+        return false;
+    }
+    ++m_activeThreadCount;
+    --m_taskCount;
+    return true;
+}
+
+//平时按 HIGH -> NORMAL -> LOW 的顺序取；每4次有1次先取NORMAL，每16次有1次先取LOW，
+//高优先级任务一直很多时，低优先级的任务也能得到一定比例的执行机会
+const int* Scheduler::PickOrder(Worker* worker){
+    static const int s_orders[3][PRIORITY_COUNT] = {
+        {HIGH, NORMAL, LOW},
+        {NORMAL, HIGH, LOW},
+        {LOW, HIGH, NORMAL}
+    };
+    uint32_t n = ++worker->picks;
+    if((n & 15) == 0){
+        return s_orders[2];
+    }
+    if((n & 3) == 0){
+        return s_orders[1];
+    }
+    return s_orders[0];
+}
+
+bool Scheduler::popLocal(Worker* worker, int priority, FiberAndThread& ft){
+    Spinlock::Lock lock(worker->mutex);
+    TaskQueue& tasks = worker->tasks[priority];
+    if(tasks.empty() || !TakeRunnable(tasks, true, ft)){
+        return false;
+    }
+    ++m_activeThreadCount;
+    --m_taskCount;
+    return true;
+}
+
+bool Scheduler::popGlobal(int priority, FiberAndThread& ft, bool& tickle_me){
+    //该优先级没有任务时不用竞争全局锁
+    if(m_globalCount[priority] == 0){
+        return false;
+    }
+    MutexType::Lock lock(m_mutex);
+    //m_fibers即为全局注入队列
+    TaskQueue& tasks = m_fibers[priority];
+    //找到一个需要执行的协程就可以退出
+    for(size_t i = 0; i < tasks.size(); ++i){
+        FiberAndThread& t = tasks[i];
+        //指定的线程还未启动时任务会留在这里
+        //如果已经指定了线程但是当前线程并不是被指定的,tickle即可，跳过
+        if(t.thread != -1 && t.thread != cc::GetThreadId()){ 
+            tickle_me = true;
+            continue;
+        }
+
+        //有任务可调度(协程 / 函数)
+        CC_ASSERT(t.fiber || t.cb);
+        //待调度的是协程，且这个协程在执行，跳过
+        if(t.fiber && t.fiber->getState() == Fiber::EXEC){
+            continue;
+        }
+
+        //拿到这个任务(没在执行，且当前线程就是它绑定的线程或者没有指定线程)
+        Take(tasks, i, ft);
+        --m_globalCount[priority];
+        ++m_activeThreadCount;
+        --m_taskCount;
+        //还有需要调度的协程
+        tickle_me |= !m_fibers[HIGH].empty() || !m_fibers[NORMAL].empty()
+                     || !m_fibers[LOW].empty();
+        return true;
+    }
+    return false;
+}
+
+//从下一个线程开始依次尝试，每次窃取一个任务
+//先窃取同一NUMA节点上的线程，都没有任务时才跨节点，任务引用的栈和缓冲区尽量留在本节点访问
+bool Scheduler::steal(const int* order, FiberAndThread& ft){
+    if(m_taskCount == 0){
+        return false;
+    }
+    size_t n = m_workers.size();
+    int node = m_workers[t_worker_index]->node;
+    for(int pass = 0; pass < 2; ++pass){
+        for(size_t i = 1; i < n; ++i){
+            Worker* victim = m_workers[(t_worker_index + i) % n].get();
+            if((victim->node == node) != (pass == 0)){
+                continue;
+            }
+            Spinlock::Lock lock(victim->mutex);
+            for(int p = 0; p < PRIORITY_COUNT; ++p){
+                TaskQueue& tasks = victim->tasks[order[p]];
+                if(!tasks.empty() && TakeRunnable(tasks, false, ft)){
+                    ++m_activeThreadCount;
+                    --m_taskCount;
+                    WorkerStats::Add(m_workers[t_worker_index]->stats.steals, 1);
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+void Scheduler::getStats(Stats& stats){
+    stats.name = m_name;
+    stats.global_queued = 0;
+    for(auto& i : m_globalCount){
+        stats.global_queued += i;
+    }
+    stats.active_threads = m_activeThreadCount;
+    stats.idle_threads = m_idleThreadCount;
+    stats.fibers = Fiber::TotalFibers();
+    stats.overloaded = isOverloaded();
+    stats.threads.resize(m_workers.size());
+    for(size_t i = 0; i < m_workers.size(); ++i){
+        Worker* worker = m_workers[i].get();
+        ThreadStats& ts = stats.threads[i];
+        ts.thread = worker->thread;
+        ts.cpu = worker->cpu;
+        ts.queued = 0;
+        {
+            Spinlock::Lock lock(worker->mutex);
+            for(auto& q : worker->tasks){
+                ts.queued += q.size();
+            }
+        }
+        {
+            Spinlock::Lock lock(worker->inboxMutex);
+            ts.queued += worker->inbox.size();
+        }
+        WorkerStats& ws = worker->stats;
+        ts.tasks = ws.tasks.load(std::memory_order_relaxed);
+        ts.switches = ws.switches.load(std::memory_order_relaxed);
+        ts.steals = ws.steals.load(std::memory_order_relaxed);
+        ts.idle_us = ws.idle_us.load(std::memory_order_relaxed);
+        ts.wait_us = ws.wait_us.load(std::memory_order_relaxed);
+        ws.run_us.snapshot(ts.run_us);
+        ws.queue_us.snapshot(ts.queue_us);
+    }
+}
+
+HistogramData Scheduler::Stats::runTotal() const{
+    HistogramData data;
+    for(auto& i : threads){
+        data.merge(i.run_us);
+    }
+    return data;
+}
+
+HistogramData Scheduler::Stats::queueTotal() const{
+    HistogramData data;
+    for(auto& i : threads){
+        data.merge(i.queue_us);
+    }
+    return data;
+}
+
+std::string Scheduler::Stats::toString() const{
+    std::stringstream ss;
+    ss << "[scheduler name=" << name
+       << " global_queued=" << global_queued
+       << " active=" << active_threads
+       << " idle=" << idle_threads
+       << " fibers=" << fibers
+       << " overloaded=" << overloaded
+       << "]" << std::endl;
+    for(auto& i : threads){
+        ss << "    [thread=" << i.thread
+           << " cpu=" << i.cpu
+           << " queued=" << i.queued
+           << " tasks=" << i.tasks
+           << " switches=" << i.switches
+           << " steals=" << i.steals
+           << " idle_us=" << i.idle_us
+           << " wait_us=" << i.wait_us
+           << "]" << std::endl;
+    }
+    ss << "    run_us: " << runTotal().toString() << std::endl;
+    ss << "    queue_us: " << queueTotal().toString() << std::endl;
+    return ss.str();
 }
 
 // 协程无任务可调度时执行idle协程,暂时占用CPU，不停的判断stopping是否满足
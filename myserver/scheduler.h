@@ -5,8 +5,14 @@
 #include "fiber.h"
 #include <mutex>
 #include "thread.h"
+#include "callback.h"
+#include "codel.h"
+#include "histogram.h"
+#include "affinity.h"
 #include <functional>
 #include <list>
+#include <deque>
+#include <atomic>
 #include <vector>
 #include <iostream>
 
@@ -29,6 +35,20 @@ public:
     //friend class cc::Fiber;
     using ptr = std::shared_ptr<Scheduler>;
     using MutexType = Mutex;
+
+    //调度优先级，每个优先级一个队列
+    //取任务时优先取高优先级的，为了不饿死低优先级，每4次有1次先取NORMAL，每16次有1次先取LOW
+    //协程被唤醒重新调度时沿用它的优先级(Fiber::getPriority)
+    enum Priority{
+        //延迟敏感的请求处理
+        HIGH = 0,
+        NORMAL = 1,
+        //后台任务: 日志刷新、缓存刷新、健康检查等
+        LOW = 2,
+        PRIORITY_COUNT = 3,
+        //调度协程时沿用协程自己的优先级，调度回调时为NORMAL
+        INHERIT = -1
+    };
     // 线程数量
     // use_caller 是否使用调度器所在的线程进行协程调用，这样可以少创建一个线程，效率更高
     // 调度器所在的线程(称为caller线程)main函数所在的线程
@@ -38,6 +58,75 @@ public:
 
     const std::string& getName() const {return m_name;}
 
+    //回调任务是否使用共享栈协程执行，见Fiber的shared_stack参数
+    //适合大量空闲连接的场景；需要在start之前设置
+    void setSharedStack(bool v) { m_sharedStack = v;}
+    bool isSharedStack() const { return m_sharedStack;}
+
+    //调度线程数(包括caller线程)
+    size_t getWorkerCount() const { return m_workers.size();}
+
+    //调度线程绑定的CPU，第i个调度线程绑定到cpus[i % cpus.size()]，caller线程不绑定
+    //默认取配置scheduler.cpu_affinity；已经启动的调度器(IOManager构造时就会启动)会立即重新绑定
+    void setCpuAffinity(const std::vector<int>& cpus);
+    const std::vector<int>& getCpuAffinity() const { return m_cpus;}
+    //绑定在cpu上的调度线程id，没有返回-1
+    int getThreadOnCpu(int cpu);
+
+    //排队时间过载检测
+    CoDel& getCoDel() { return m_codel;}
+    bool isOverloaded() const { return m_codel.isOverloaded();}
+    //当前任务应该快速失败: 调度器过载并且当前任务排队超过了target
+    bool shouldShed() const { return m_codel.shouldDrop(GetTaskSojourn());}
+    //当前线程正在执行的任务在队列中等待的时间(毫秒)
+    static uint64_t GetTaskSojourn();
+
+    //一个调度线程的运行统计，计数从线程启动开始累计
+    struct ThreadStats{
+        int thread = -1;
+        int cpu = -1;
+        //本地队列和信箱中的任务数
+        size_t queued = 0;
+        //执行的任务数(协程每次恢复算一次)
+        uint64_t tasks = 0;
+        //切换到任务协程和空闲协程的次数
+        uint64_t switches = 0;
+        //从其他线程窃取的任务数
+        uint64_t steals = 0;
+        //在空闲协程中的时间，以及其中阻塞在epoll_wait(包括忙等)的时间(微秒)
+        uint64_t idle_us = 0;
+        uint64_t wait_us = 0;
+        //任务每次执行的时间(微秒)，关闭task_timing时为空
+        HistogramData run_us;
+        //任务的排队时间(微秒)，关闭task_timing时精度为毫秒
+        HistogramData queue_us;
+    };
+
+    //调度器的运行统计快照
+    struct Stats{
+        std::string name;
+        //全局注入队列中的任务数
+        size_t global_queued = 0;
+        size_t active_threads = 0;
+        size_t idle_threads = 0;
+        //进程中的协程总数
+        uint64_t fibers = 0;
+        bool overloaded = false;
+        std::vector<ThreadStats> threads;
+
+        //所有线程的直方图合并
+        HistogramData runTotal() const;
+        HistogramData queueTotal() const;
+        std::string toString() const;
+    };
+
+    //取运行统计快照，可以在任意线程调用，各计数只保证各自单调，不是同一时刻的一致快照
+    void getStats(Stats& stats);
+
+    //是否统计任务执行时间、用精确时钟记录排队时间，每个任务多读四次精确时钟，默认取配置scheduler.task_timing
+    void setTaskTiming(bool v) { m_taskTiming = v;}
+    bool isTaskTiming() const { return m_taskTiming;}
+
     static Scheduler* GetThis();
     static Fiber* GetMainFiber();
 
@@ -47,16 +136,18 @@ public:
 
     //添加调度任务 fc
     //thread: 协程执行的线程id,-1则不指定线程
+    //priority: 调度优先级，调度协程时会记到协程上
     template<class FiberOrCb>
-    void schedule(FiberOrCb fc, int thread = -1){ 
+    void schedule(FiberOrCb fc, int thread = -1, int priority = INHERIT){ 
         bool need_tickle = false;
         {
-            MutexType::Lock lock(m_mutex);
-            //将一个待调度任务放到调度器的带调度协程队列中
-            need_tickle = scheduleNoLock(fc, thread);
+            FiberAndThread ft(std::move(fc), thread);
+            ft.priority = priority;
+            //将一个待调度任务放到调度器的待调度队列中
+            need_tickle = enqueue(ft);
         }
 
-        //调度队列为空才需要通知，否则不需要通知
+        //有空闲线程可能需要来取(窃取)这个任务时才通知
         if(need_tickle){
             tickle();
         }
@@ -66,13 +157,11 @@ public:
     template<class InputIterator>
     void schedule(InputIterator begin, InputIterator end){
         bool need_tickle = false;
+        while (begin != end)
         {
-            MutexType::Lock lock(m_mutex);
-            while (begin != end)
-            {
-                need_tickle = scheduleNoLock(&*begin, -1) || need_tickle;
-                ++begin;
-            }
+            FiberAndThread ft(&*begin, -1);
+            need_tickle = enqueue(ft) || need_tickle;
+            ++begin;
         }
         if(need_tickle) {
             tickle();
@@ -88,25 +177,19 @@ protected:
     void setThis();
 
     bool hasIdleThreads() {return m_idleThreadCount > 0;}
-private:
-    //如果当前任务队列为空，则需要通知: need_tickle = true
-    template<class FiberOrCb>
-    bool scheduleNoLock(FiberOrCb fc, int thread){
-        bool need_tickle = m_fibers.empty();
-        FiberAndThread ft(fc, thread);
-        if(ft.fiber || ft.cb){
-            //放入调度队列
-            m_fibers.push_back(ft);
-        }
-        return need_tickle;
-    }
-
+    //所有队列中的任务数(包括指定了其他线程的任务)
+    size_t getTaskCount() const { return m_taskCount;}
 private:
     //任务结构体
     struct FiberAndThread{
         Fiber::ptr fiber;
-        std::function<void()> cb;
+        Callback cb;
         int thread; //线程号
+        int priority = INHERIT;
+        //入队时间(单调时间，微秒)
+        uint64_t stamp = 0;
+        //取出时同一队列中最老任务的入队时间
+        uint64_t oldest = 0;
 
         FiberAndThread(Fiber::ptr f, int thr)
             :fiber(f), thread(thr){
@@ -121,14 +204,19 @@ private:
             fiber.swap(*f);
         }
 
-        FiberAndThread(std::function<void()> f, int thr)
-            :cb(f), thread(thr){
+        FiberAndThread(Callback f, int thr)
+            :cb(std::move(f)), thread(thr){
+
+        }
+
+        FiberAndThread(Callback* f, int thr)
+            :cb(std::move(*f)), thread(thr){
 
         }
 
         FiberAndThread(std::function<void()>* f, int thr)
-            :thread(thr){
-            cb.swap(*f);
+            :cb(std::move(*f)), thread(thr){
+            *f = nullptr;
         }
 
         FiberAndThread()
@@ -140,15 +228,157 @@ private:
             fiber = nullptr;
             thread = -1;
             cb = nullptr;
+            priority = INHERIT;
+            stamp = 0;
+            oldest = 0;
         }
     };
 
+    //任务队列: 按2的幂扩容的环形缓冲区，容量只增不减
+    //std::deque在队头队尾反复进出时会不断分配/释放内存块，std::list每个任务一个节点，
+    //这里稳态下入队出队都不分配内存
+    class TaskQueue{
+    public:
+        bool empty() const { return m_size == 0;}
+        size_t size() const { return m_size;}
+        //第i个任务(0为队头)
+        FiberAndThread& operator[](size_t i) { return m_buf[(m_head + i) & (m_buf.size() - 1)];}
+
+        void push_back(FiberAndThread&& ft){
+            if(m_size == m_buf.size()){
+                grow();
+            }
+            (*this)[m_size] = std::move(ft);
+            ++m_size;
+        }
+
+        //取出第i个任务，移动较少的一侧补位
+        void take(size_t i, FiberAndThread& ft){
+            ft = std::move((*this)[i]);
+            if(i < m_size / 2){
+                for(size_t j = i; j > 0; --j){
+                    (*this)[j] = std::move((*this)[j - 1]);
+                }
+                m_head = (m_head + 1) & (m_buf.size() - 1);
+            } else {
+                for(size_t j = i; j + 1 < m_size; ++j){
+                    (*this)[j] = std::move((*this)[j + 1]);
+                }
+            }
+            --m_size;
+        }
+    private:
+        void grow(){
+            std::vector<FiberAndThread> buf(m_buf.empty() ? 16 : m_buf.size() * 2);
+            for(size_t i = 0; i < m_size; ++i){
+                buf[i] = std::move((*this)[i]);
+            }
+            m_buf.swap(buf);
+            m_head = 0;
+        }
+    private:
+        std::vector<FiberAndThread> m_buf;
+        size_t m_head = 0;
+        size_t m_size = 0;
+    };
+
+protected:
+    //调度线程的运行统计，只有本线程写，getStats时其他线程读
+    //只有一个写者，计数用读+写代替原子加，不需要lock前缀
+    struct alignas(64) WorkerStats{
+        std::atomic<uint64_t> tasks {0};
+        std::atomic<uint64_t> switches {0};
+        std::atomic<uint64_t> steals {0};
+        std::atomic<uint64_t> idle_us {0};
+        std::atomic<uint64_t> wait_us {0};
+        Histogram run_us;
+        Histogram queue_us;
+
+        static void Add(std::atomic<uint64_t>& v, uint64_t n){
+            v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+    };
+
+    //调度线程的本地任务队列
+    //所有者从队尾存取(LIFO，缓存更热)，空闲的其他线程从队头窃取(FIFO)
+    //每个队列一把自旋锁，正常情况下只有所有者线程访问，几乎没有竞争
+    //按缓存行对齐，避免相邻队列之间的伪共享
+    struct alignas(64) Worker{
+        Spinlock mutex;
+        //每个优先级一个队列
+        TaskQueue tasks[PRIORITY_COUNT];
+        //取任务的次数，只有本线程访问，用来轮换优先级的顺序
+        uint32_t picks = 0;
+        //信箱: 指定在本线程执行的任务，只有本线程会取，其他线程不会扫描也不能窃取
+        Spinlock inboxMutex;
+        TaskQueue inbox;
+        //调度线程id，线程启动后设置
+        std::atomic<int> thread {-1};
+        //绑定的CPU和所在的NUMA节点，未绑定为-1
+        std::atomic<int> cpu {-1};
+        std::atomic<int> node {-1};
+        //线程句柄，用于定向唤醒
+        pthread_t handle;
+        //是否阻塞在idle中等待唤醒
+        std::atomic<bool> idle {false};
+        //运行统计，单独占缓存行，不和其他线程窃取时访问的锁、队列挤在一起
+        WorkerStats stats;
+
+        //C++17之前的new不保证超过16字节的对齐，用posix_memalign分配
+        static void* operator new(size_t size);
+        static void operator delete(void* p);
+    };
+
+    //通知指定的调度线程有任务放进了它的信箱，默认退化为tickle()
+    virtual void tickleWorker(Worker* worker);
+    //当前线程在本调度器中的本地队列，不是本调度器的调度线程返回nullptr
+    Worker* currentWorker();
+    //信箱中是否有任务
+    bool hasInboxTask(Worker* worker);
+    //除self以外，是否有空闲线程的信箱中有任务
+    bool hasIdleInboxTask(Worker* self);
+    //按m_cpus绑定各调度线程，绑定操作作为指定线程的任务在各线程上执行
+    void bindThreads();
+
+private:
+    //将任务放入队列，返回是否需要tickle
+    //调度线程自己提交的任务进入本线程的本地队列，
+    //指定了线程的任务进入目标线程的信箱(由enqueue直接定向唤醒)，
+    //外部线程提交的任务以及目标线程还未启动的任务进入全局注入队列
+    bool enqueue(FiberAndThread& ft);
+    //根据线程id找到对应的调度线程
+    Worker* findWorker(int thread);
+    //从本线程的信箱中取任务
+    bool popInbox(Worker* worker, FiberAndThread& ft);
+    //本次取任务时各优先级的顺序
+    static const int* PickOrder(Worker* worker);
+    //从本线程的本地队列队尾取一个priority优先级的任务
+    bool popLocal(Worker* worker, int priority, FiberAndThread& ft);
+    //从全局注入队列中取一个priority优先级的任务
+    bool popGlobal(int priority, FiberAndThread& ft, bool& tickle_me);
+    //从其他线程的本地队列队头窃取任务
+    bool steal(const int* order, FiberAndThread& ft);
+    //在队列中找一个可以执行的任务并取出，lifo为true时从队尾开始找
+    static bool TakeRunnable(TaskQueue& tasks, bool lifo, FiberAndThread& ft);
+    //从队列中取出第i个任务，并记下队列中最老任务的入队时间
+    static void Take(TaskQueue& tasks, size_t i, FiberAndThread& ft);
+
 private:
     MutexType m_mutex;
-    //线程池，线程依次从m_fibers中取出任务并执行
+    //线程池，线程依次从任务队列中取出任务并执行
     std::vector<Thread::ptr> m_threads;
-    //待执行的协程队列
-    std::list<FiberAndThread> m_fibers;
+    //全局注入队列: 非调度线程提交的任务以及目标线程还未启动的指定线程任务
+    TaskQueue m_fibers[PRIORITY_COUNT];
+    //全局注入队列中各优先级的任务数，在m_mutex下修改，取任务前不加锁先看一眼
+    std::atomic<size_t> m_globalCount[PRIORITY_COUNT];
+    //每个调度线程(包括caller线程)一个本地队列
+    std::vector<std::unique_ptr<Worker> > m_workers;
+    //下一个启动的调度线程使用的本地队列下标
+    std::atomic<size_t> m_nextWorker {0};
+    //所有队列中的任务总数
+    std::atomic<size_t> m_taskCount {0};
+    //排队时间过载检测
+    CoDel m_codel;
     //use_caller为true时有效,调度器所在线程的调度协程
     Fiber::ptr m_rootFiber;
     std::string m_name;
@@ -168,6 +398,14 @@ protected:
     bool m_autostop = false;
     //主线程id
     int m_rootThread = 0; 
+    //回调任务使用共享栈协程
+    bool m_sharedStack = false;
+    //统计任务执行时间
+    bool m_taskTiming = true;
+    //调度线程绑定的CPU列表
+    std::vector<int> m_cpus;
+    //CPU列表来自配置时，多个调度器的线程在列表上依次往后排，不都从第一个CPU开始
+    size_t m_cpuBase = 0;
 };
 
 }
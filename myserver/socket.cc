@@ -157,7 +157,7 @@ Socket::ptr Socket::accept(){
     return nullptr;
 }
 
-bool Socket::bind(const Address::ptr addr){
+bool Socket::bind(const Address::ptr addr, bool reuse_port){
     //无效的话先创建一个新的socket
     if(CC_UNLIKELY(!isValid())){
         newSock();
@@ -165,6 +165,12 @@ bool Socket::bind(const Address::ptr addr){
             return false;
         }
     }
+    if(reuse_port){
+        int val = 1;
+        if(!setOption(SOL_SOCKET, SO_REUSEPORT, val)){
+            return false;
+        }
+    }
     //协议簇不一样
     if(CC_UNLIKELY(addr->getFamily() != m_family)) {
         CC_LOG_ERROR(g_logger) << "bind sock.family("
@@ -447,6 +453,16 @@ int Socket::getError(){
     return error;
 }
 
+int Socket::getIncomingCpu(){
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    if(getOption(SOL_SOCKET, SO_INCOMING_CPU, cpu)) {
+        return cpu;
+    }
+#endif
+    return -1;
+}
+
 std::ostream& Socket::dump(std::ostream& os) const{
     os << "[Socket sock=" << m_sock
        << " is_connected=" << m_isConnected
@@ -107,7 +107,8 @@ public:
 
     Socket::ptr accept();
     
-    bool bind(const Address::ptr addr);
+    //reuse_port 绑定前设置SO_REUSEPORT，多个socket可以监听同一地址，由内核在它们之间分配新连接
+    bool bind(const Address::ptr addr, bool reuse_port = false);
     bool connect(const Address::ptr addr, uint64_t timeout_ms = -1);
     bool listen(int backlog = SOMAXCONN);
     bool close();
@@ -136,6 +137,8 @@ public:
     bool isValid() const;
     //返回Socket错误
     int getError();
+    //处理该连接收包软中断的CPU(SO_INCOMING_CPU)，获取失败返回-1
+    int getIncomingCpu();
 
     //输出socket信息到流中
     virtual std::ostream& dump(std::ostream& os) const;
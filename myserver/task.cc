@@ -0,0 +1,195 @@
+#include "task.h"
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+
+#include "log.h"
+#include "macro.h"
+#include "clock.h"
+
+namespace cc{
+
+static Logger::ptr g_logger = CC_LOG_NAME("system");
+
+static inline void CpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+void detail::DetachedTask::promise_type::unhandled_exception(){
+    try{
+        throw;
+    }catch(std::exception& ex){
+        CC_LOG_ERROR(g_logger) << "Task Except: " << ex.what();
+    }catch(...){
+        CC_LOG_ERROR(g_logger) << "Task Except";
+    }
+}
+
+void AsyncSleep::await_suspend(std::coroutine_handle<> h){
+    IOManager* iom = IOManager::GetThis();
+    CC_ASSERT2(iom, "AsyncSleep requires an IOManager");
+    //和hook的usleep一样用内联定时器，到期时在idle中直接把恢复放进调度队列
+    //协程体不能内联执行: 它会占住idle协程，其中被hook的阻塞调用还会让出idle协程
+    iom->addInlineTimer(ms, [iom, h](){
+        iom->schedule([h](){ h.resume();});
+    });
+}
+
+bool IoAwaiterBase::await_ready(){
+    m_iom = IOManager::GetThis();
+    FdCtx::ptr ctx = FdMgr::GetInstance()->get(m_fd);
+    //不在IOManager中或者fd不由FdManager管理，直接执行
+    if(!m_iom || !ctx){
+        m_result = doIO();
+        m_errno = errno;
+        return true;
+    }
+    if(ctx->isClose()){
+        m_result = -1;
+        m_errno = EBADF;
+        return true;
+    }
+    if(tryIO()){
+        return true;
+    }
+    if(m_timeout != ~0ull){
+        m_deadline = GetNowMS() + m_timeout;
+    }
+    return false;
+}
+
+bool IoAwaiterBase::await_suspend(std::coroutine_handle<> h){
+    m_handle = h;
+    return wait();
+}
+
+bool IoAwaiterBase::tryIO(){
+    ssize_t n = doIO();
+    while(n == -1 && errno == EINTR){
+        n = doIO();
+    }
+    if(n == -1 && errno == EAGAIN){
+        return false;
+    }
+    m_result = n;
+    m_errno = errno;
+    return true;
+}
+
+bool IoAwaiterBase::wait(){
+    while(true){
+        int rt = m_iom->armEvent(m_fd, m_event, m_deadline, [this](){ onEvent();});
+        if(rt == 0){
+            //注册成功后回调可能已经在其他线程执行，不能再访问成员
+            return true;
+        }
+        if(rt < 0){
+            m_result = -1;
+            m_errno = errno;
+            return false;
+        }
+        if(tryIO()){
+            return false;
+        }
+    }
+}
+
+void IoAwaiterBase::onEvent(){
+    if(m_iom->finishEvent(m_fd, m_event, m_deadline)){
+        m_result = -1;
+        m_errno = errno;
+        m_handle.resume();
+        return;
+    }
+    if(tryIO() || !wait()){
+        m_handle.resume();
+    }
+}
+
+bool ChannelAwaiterBase::await_ready(){
+    if(tryOnce()){
+        return true;
+    }
+    if(m_timeout != ~0ull){
+        m_deadline = GetNowMS() + m_timeout;
+    }
+    return false;
+}
+
+bool ChannelAwaiterBase::await_suspend(std::coroutine_handle<> h){
+    m_handle = h;
+    return park();
+}
+
+bool ChannelAwaiterBase::park(){
+    while(true){
+        uint64_t now = m_deadline == ~0ull ? 0 : GetNowMS();
+        if(m_deadline != ~0ull && m_deadline <= now){
+            onTimeout();
+            return false;
+        }
+        ChannelWaitState::ptr st(new ChannelWaitState);
+        st->scheduler = Scheduler::GetThis();
+        st->cb = [this](){ onWake();};
+        if(!m_chan->addWaiter(m_dir, st)){
+            //挂上之后发现已经就绪
+            if(tryOnce()){
+                return false;
+            }
+            continue;
+        }
+        m_state = st;
+        if(m_deadline != ~0ull){
+            IOManager* iom = IOManager::GetThis();
+            CC_ASSERT2(iom, "channel timeout requires an IOManager");
+            std::weak_ptr<ChannelWaitState> weak_st(st);
+            m_timer = iom->addInlineTimer(m_deadline - now, [weak_st](){
+                ChannelWaitState::ptr s = weak_st.lock();
+                if(s){
+                    s->wake(nullptr, true);
+                }
+            });
+        }
+        int expected = ChannelWaitState::PENDING;
+        if(st->state.compare_exchange_strong(expected, ChannelWaitState::WAITING
+                    , std::memory_order_acq_rel)){
+            //之后唤醒可能已经在其他线程执行，不能再访问成员
+            return true;
+        }
+        //挂起之前已经被唤醒，唤醒者正在写结果
+        while(st->state.load(std::memory_order_acquire) != ChannelWaitState::DONE){
+            CpuRelax();
+        }
+        if(handleWake()){
+            return false;
+        }
+    }
+}
+
+bool ChannelAwaiterBase::handleWake(){
+    if(m_timer){
+        m_timer->cancel();
+        m_timer.reset();
+    }
+    ChannelWaitState::ptr st;
+    st.swap(m_state);
+    if(st->timedout){
+        m_chan->delWaiter(m_dir, st);
+        onTimeout();
+        return true;
+    }
+    return tryOnce();
+}
+
+void ChannelAwaiterBase::onWake(){
+    if(handleWake() || !park()){
+        m_handle.resume();
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,408 @@
+#ifndef __CC_TASK_H__
+#define __CC_TASK_H__
+
+//基于C++20无栈协程的异步任务，需要使用-std=c++20编译，低于C++20时这个头文件为空
+//Fiber是有栈协程，每个至少占用一个完整的栈；Task的状态只是一个堆上的协程帧，
+//一般只有几百字节，适合大量在途的短异步调用链。
+//Task与Fiber运行在同一个调度器上: CoSpawn把Task作为普通回调任务调度，
+//等待IO、定时器、通道时挂起的只是协程帧，执行它的调度协程继续执行其他任务，
+//被唤醒时再作为回调任务调度回来。
+//IO等待复用IOManager::armEvent的事件注册和截止时间，等待期间不分配内存
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <sys/socket.h>
+#include "iomanager.h"
+#include "fd_manager.h"
+#include "hook.h"
+#include "channel.h"
+#include "noncopyable.h"
+
+namespace cc{
+
+template<class T = void>
+class Task;
+
+namespace detail{
+
+struct TaskPromiseBase{
+    //co_await这个Task的协程，完成后转回它
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    //惰性启动，被co_await或者CoSpawn时才开始执行
+    std::suspend_always initial_suspend() noexcept { return {};}
+
+    struct FinalAwaiter{
+        bool await_ready() noexcept { return false;}
+        template<class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept{
+            std::coroutine_handle<> c = h.promise().continuation;
+            return c ? c : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {};}
+
+    void unhandled_exception() { exception = std::current_exception();}
+    void rethrow(){
+        if(exception){
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+template<class T>
+struct TaskPromise : TaskPromiseBase{
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    template<class U>
+    void return_value(U&& v) { value.emplace(std::forward<U>(v));}
+    T result(){
+        rethrow();
+        return std::move(*value);
+    }
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase{
+    Task<void> get_return_object();
+    void return_void() {}
+    void result() { rethrow();}
+};
+
+//CoSpawn使用的顶层协程，完成后自己销毁
+struct DetachedTask{
+    struct promise_type{
+        DetachedTask get_return_object(){
+            return DetachedTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {};}
+        std::suspend_never final_suspend() noexcept { return {};}
+        void return_void() {}
+        void unhandled_exception();
+    };
+    std::coroutine_handle<promise_type> handle;
+};
+
+}
+
+/**
+ * 异步任务
+ * 协程函数返回Task<T>，函数体内使用co_await/co_return
+ * 由另一个Task co_await执行并取得结果，或者用CoSpawn放到调度器上独立执行
+ * 只能被co_await一次，异常会在co_await处重新抛出
+ */
+template<class T>
+class Task : Noncopyable{
+public:
+    using promise_type = detail::TaskPromise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    Task() {}
+    explicit Task(handle_type h)
+        :m_handle(h) {}
+    Task(Task&& other) noexcept
+        :m_handle(std::exchange(other.m_handle, nullptr)) {}
+    Task& operator=(Task&& other) noexcept{
+        if(this != &other){
+            if(m_handle){
+                m_handle.destroy();
+            }
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+    ~Task(){
+        if(m_handle){
+            m_handle.destroy();
+        }
+    }
+
+    bool valid() const { return (bool)m_handle;}
+
+    struct Awaiter{
+        handle_type handle;
+        bool await_ready() { return !handle || handle.done();}
+        //对称转移: 直接切到子任务，不经过调度器
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> h){
+            handle.promise().continuation = h;
+            return handle;
+        }
+        T await_resume() { return handle.promise().result();}
+    };
+    Awaiter operator co_await() && { return Awaiter{m_handle};}
+    Awaiter operator co_await() & { return Awaiter{m_handle};}
+private:
+    handle_type m_handle;
+};
+
+namespace detail{
+
+template<class T>
+inline Task<T> TaskPromise<T>::get_return_object(){
+    return Task<T>(std::coroutine_handle<TaskPromise<T> >::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object(){
+    return Task<void>(std::coroutine_handle<TaskPromise<void> >::from_promise(*this));
+}
+
+inline DetachedTask RunDetached(Task<void> task){
+    co_await std::move(task);
+}
+
+}
+
+//把task放到调度器上独立执行，sc为空时使用当前调度器
+//未捕获的异常记录日志后丢弃
+inline void CoSpawn(Task<void> task, Scheduler* sc = nullptr){
+    if(!sc){
+        sc = Scheduler::GetThis();
+    }
+    std::coroutine_handle<> h = detail::RunDetached(std::move(task)).handle;
+    sc->schedule([h](){ h.resume();});
+}
+
+//co_await ScheduleOn(sc): 切换到调度器sc上继续执行，sc为空时让出后在当前调度器上继续
+struct ScheduleOn{
+    Scheduler* scheduler;
+    explicit ScheduleOn(Scheduler* sc = nullptr)
+        :scheduler(sc ? sc : Scheduler::GetThis()) {}
+    bool await_ready() { return false;}
+    void await_suspend(std::coroutine_handle<> h){
+        scheduler->schedule([h](){ h.resume();});
+    }
+    void await_resume() {}
+};
+
+//co_await AsyncSleep(ms): 通过当前IOManager的定时器挂起ms毫秒
+struct AsyncSleep{
+    uint64_t ms;
+    explicit AsyncSleep(uint64_t v)
+        :ms(v) {}
+    bool await_ready() { return false;}
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() {}
+};
+
+/**
+ * fd上的一次非阻塞IO
+ * 先直接执行，资源暂时不可用时通过armEvent等待事件，事件就绪后在回调中重试，
+ * 完成(成功、出错或者超时)后才恢复协程，期间不分配内存
+ * 结果与对应的系统调用一致，失败返回-1并设置errno，超时errno为ETIMEDOUT
+ */
+class IoAwaiterBase : Noncopyable{
+public:
+    bool await_ready();
+    bool await_suspend(std::coroutine_handle<> h);
+    ssize_t await_resume(){
+        errno = m_errno;
+        return m_result;
+    }
+protected:
+    //timeout_ms 超时时间(毫秒)，~0ull表示不超时
+    IoAwaiterBase(int fd, IOManager::Event event, uint64_t timeout_ms)
+        :m_fd(fd), m_event(event), m_timeout(timeout_ms) {}
+    virtual ~IoAwaiterBase() {}
+    //执行一次非阻塞操作
+    virtual ssize_t doIO() = 0;
+private:
+    //执行一次并记录结果，需要等待返回false
+    bool tryIO();
+    //注册等待，注册成功返回true；失败或者已经完成返回false，调用者直接恢复协程
+    bool wait();
+    //事件回调
+    void onEvent();
+private:
+    int m_fd;
+    IOManager::Event m_event;
+    uint64_t m_timeout;
+    uint64_t m_deadline = ~0ull;
+    IOManager* m_iom = nullptr;
+    std::coroutine_handle<> m_handle;
+    ssize_t m_result = -1;
+    int m_errno = 0;
+};
+
+template<class Op>
+class IoAwaiter : public IoAwaiterBase{
+public:
+    IoAwaiter(int fd, IOManager::Event event, uint64_t timeout_ms, Op op)
+        :IoAwaiterBase(fd, event, timeout_ms)
+        ,m_op(std::move(op)) {}
+protected:
+    ssize_t doIO() override { return m_op();}
+private:
+    Op m_op;
+};
+
+template<class Op>
+inline IoAwaiter<Op> MakeIoAwaiter(int fd, IOManager::Event event, uint64_t timeout_ms, Op op){
+    return IoAwaiter<Op>(fd, event, timeout_ms, std::move(op));
+}
+
+//以下fd需要是非阻塞的socket(通过hook的socket/accept创建，或者由FdManager管理)
+inline auto AsyncRead(int fd, void* buf, size_t len, uint64_t timeout_ms = ~0ull){
+    return MakeIoAwaiter(fd, IOManager::READ, timeout_ms, [=](){ return read_f(fd, buf, len);});
+}
+
+inline auto AsyncWrite(int fd, const void* buf, size_t len, uint64_t timeout_ms = ~0ull){
+    return MakeIoAwaiter(fd, IOManager::WRITE, timeout_ms, [=](){ return write_f(fd, buf, len);});
+}
+
+inline auto AsyncRecv(int fd, void* buf, size_t len, int flags = 0, uint64_t timeout_ms = ~0ull){
+    return MakeIoAwaiter(fd, IOManager::READ, timeout_ms
+                         ,[=](){ return recv_f(fd, buf, len, flags);});
+}
+
+inline auto AsyncSend(int fd, const void* buf, size_t len, int flags = 0, uint64_t timeout_ms = ~0ull){
+    return MakeIoAwaiter(fd, IOManager::WRITE, timeout_ms
+                         ,[=](){ return send_f(fd, buf, len, flags);});
+}
+
+//返回新连接的fd，新fd同样由FdManager管理(非阻塞)
+inline auto AsyncAccept(int fd, sockaddr* addr = nullptr, socklen_t* addrlen = nullptr
+                        ,uint64_t timeout_ms = ~0ull){
+    return MakeIoAwaiter(fd, IOManager::READ, timeout_ms, [=]() -> ssize_t{
+        int rt = accept_f(fd, addr, addrlen);
+        if(rt >= 0){
+            FdMgr::GetInstance()->get(rt, true);
+        }
+        return rt;
+    });
+}
+
+//连接成功返回0
+inline auto AsyncConnect(int fd, const sockaddr* addr, socklen_t addrlen
+                         ,uint64_t timeout_ms = ~0ull){
+    //第一次发起连接，之后可写时取连接结果
+    return MakeIoAwaiter(fd, IOManager::WRITE, timeout_ms
+                         ,[=, started = false]() mutable -> ssize_t{
+        if(!started){
+            int rt = connect_f(fd, addr, addrlen);
+            if(rt == -1 && errno == EINPROGRESS){
+                started = true;
+                errno = EAGAIN;
+            }
+            return rt;
+        }
+        int error = 0;
+        socklen_t len = sizeof(int);
+        if(getsockopt_f(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1){
+            return -1;
+        }
+        if(error){
+            errno = error;
+            return -1;
+        }
+        return 0;
+    });
+}
+
+/**
+ * 通道上的一次收发
+ * 不能立即完成时挂到通道的等待队列上，被对端唤醒后在回调中重试，完成后才恢复协程
+ */
+class ChannelAwaiterBase : Noncopyable{
+public:
+    bool await_ready();
+    bool await_suspend(std::coroutine_handle<> h);
+protected:
+    ChannelAwaiterBase(ChannelBase* chan, bool send, uint64_t timeout_ms)
+        :m_chan(chan), m_dir(send ? ChannelBase::SEND : ChannelBase::RECV)
+        ,m_timeout(timeout_ms) {}
+    virtual ~ChannelAwaiterBase() {}
+    //尝试一次收发，完成(成功或者通道已经关闭)返回true
+    virtual bool tryOnce() = 0;
+    //超时后的最后一次尝试
+    virtual void onTimeout() = 0;
+private:
+    //挂到通道上，挂起返回true；已经完成返回false，调用者直接恢复协程
+    bool park();
+    //被通道或者定时器唤醒
+    void onWake();
+    //处理一次唤醒的结果，完成返回true
+    bool handleWake();
+private:
+    ChannelBase* m_chan;
+    ChannelBase::Direction m_dir;
+    uint64_t m_timeout;
+    uint64_t m_deadline = ~0ull;
+    ChannelWaitState::ptr m_state;
+    Timer::ptr m_timer;
+    std::coroutine_handle<> m_handle;
+};
+
+template<class T>
+class ChannelRecvAwaiter : public ChannelAwaiterBase{
+public:
+    ChannelRecvAwaiter(Channel<T>& chan, T& v, uint64_t timeout_ms)
+        :ChannelAwaiterBase(&chan, false, timeout_ms)
+        ,m_chan(chan), m_value(v) {}
+    //收到数据返回true；通道关闭且数据已经取完，或者超时返回false
+    bool await_resume() { return m_ok;}
+protected:
+    bool tryOnce() override{
+        if(m_chan.tryRecv(m_value)){
+            m_ok = true;
+            return true;
+        }
+        if(m_chan.isClosed()){
+            //关闭前放入的数据
+            m_ok = m_chan.tryRecv(m_value);
+            return true;
+        }
+        return false;
+    }
+    void onTimeout() override { m_ok = m_chan.tryRecv(m_value);}
+private:
+    Channel<T>& m_chan;
+    T& m_value;
+    bool m_ok = false;
+};
+
+template<class T>
+class ChannelSendAwaiter : public ChannelAwaiterBase{
+public:
+    ChannelSendAwaiter(Channel<T>& chan, T&& v)
+        :ChannelAwaiterBase(&chan, true, ~0ull)
+        ,m_chan(chan), m_value(std::move(v)) {}
+    //通道已经关闭返回false
+    bool await_resume() { return m_ok;}
+protected:
+    bool tryOnce() override{
+        if(m_chan.trySend(std::move(m_value))){
+            m_ok = true;
+            return true;
+        }
+        return m_chan.isClosed();
+    }
+    void onTimeout() override {}
+private:
+    Channel<T>& m_chan;
+    T m_value;
+    bool m_ok = false;
+};
+
+//co_await AsyncRecv(chan, v, timeout_ms): 与Channel::recv相同，挂起的是Task
+template<class T>
+inline ChannelRecvAwaiter<T> AsyncRecv(Channel<T>& chan, T& v, uint64_t timeout_ms = ~0ull){
+    return ChannelRecvAwaiter<T>(chan, v, timeout_ms);
+}
+
+//co_await AsyncSend(chan, v): 与Channel::send相同，挂起的是Task
+template<class T>
+inline ChannelSendAwaiter<T> AsyncSend(Channel<T>& chan, T v){
+    return ChannelSendAwaiter<T>(chan, std::move(v));
+}
+
+}
+
+#endif
+
+#endif
@@ -9,6 +9,14 @@ static cc::ConfigVar<uint64_t>::ptr g_tcp_server_read_timeout =
                 cc::Config::Lookup("tcp_server.read_timeout", (uint64_t)(60 * 1000 * 2), 
                 "tcp server read timeout");//2 mins
 
+static cc::ConfigVar<bool>::ptr g_tcp_server_load_shedding =
+                cc::Config::Lookup("tcp_server.load_shedding", false,
+                "reject new connections and requests when the worker is overloaded");
+
+static cc::ConfigVar<bool>::ptr g_tcp_server_steer_incoming_cpu =
+                cc::Config::Lookup("tcp_server.steer_incoming_cpu", false,
+                "hand new connections to the scheduler thread pinned on their SO_INCOMING_CPU");
+
 static cc::Logger::ptr g_logger = CC_LOG_NAME("system");
 
 TcpServer::TcpServer(cc::IOManager* worker,
@@ -19,7 +27,9 @@ TcpServer::TcpServer(cc::IOManager* worker,
     ,m_acceptWorker(accept_worker)
     ,m_recvTimeout(g_tcp_server_read_timeout->getValue())
     ,m_name("cc/1.0.0")
-    ,m_isStop(true) {
+    ,m_isStop(true)
+    ,m_loadShedding(g_tcp_server_load_shedding->getValue())
+    ,m_steerIncomingCpu(g_tcp_server_steer_incoming_cpu->getValue()) {
 }
 
 //全部socket关闭
@@ -47,28 +57,39 @@ bool TcpServer::bind(const std::vector<Address::ptr>& addrs
     //暂时省略了ssl
     // m_ssl = ssl;
     for(auto& addr : addrs) {    
-        Socket::ptr sock = Socket::CreateTCP(addr);
-        if(!sock->bind(addr)) { //绑定失败，记录失败的地址
-            CC_LOG_ERROR(g_logger) << "bind fail errno="
-                << errno << " errstr=" << strerror(errno)
-                << " addr=[" << addr->toString() << "]";
-            fails.push_back(addr);
-            continue;
-        }
-        if(!sock->listen()) {  //监听失败，记录失败的地址
-            CC_LOG_ERROR(g_logger) << "listen fail errno="
-                << errno << " errstr=" << strerror(errno)
-                << " addr=[" << addr->toString() << "]";
-            fails.push_back(addr);
-            continue;
+        //多reactor模式下每个reactor一个监听socket，否则只有一个
+        size_t count = m_reactors.empty() ? 1 : m_reactors.size();
+        //端口为0时第一个socket由内核分配端口，其余的绑定到它实际的地址上，保证都在同一个端口
+        Address::ptr bind_addr = addr;
+        for(size_t i = 0; i < count; ++i) {
+            Socket::ptr sock = Socket::CreateTCP(bind_addr);
+            if(!sock->bind(bind_addr, !m_reactors.empty())) { //绑定失败，记录失败的地址
+                CC_LOG_ERROR(g_logger) << "bind fail errno="
+                    << errno << " errstr=" << strerror(errno)
+                    << " addr=[" << addr->toString() << "]";
+                fails.push_back(addr);
+                break;
+            }
+            if(!sock->listen()) {  //监听失败，记录失败的地址
+                CC_LOG_ERROR(g_logger) << "listen fail errno="
+                    << errno << " errstr=" << strerror(errno)
+                    << " addr=[" << addr->toString() << "]";
+                fails.push_back(addr);
+                break;
+            }
+            //绑定成功且进入监听状态
+            if(i == 0 && count > 1) {
+                bind_addr = sock->getLocalAddress();
+            }
+            m_socks.push_back(sock);
+            m_sockReactors.push_back(m_reactors.empty() ? m_acceptWorker : m_reactors[i]);
         }
-        //绑定成功且进入监听状态
-        m_socks.push_back(sock);
     }
 
     //如果绑定失败的地址容器不为空，bind调用函数返回false，清空所有Socket
     if(!fails.empty()) {
         m_socks.clear();
+        m_sockReactors.clear();
         return false;
     }
 
@@ -90,8 +111,14 @@ void TcpServer::startAccept(Socket::ptr sock) {
             //成功接收一个连接，设置对应的超时时间
             client->setRecvTimeout(m_recvTimeout);
             //将handleClient加入到工作线程队列m_worker中
-            m_worker->schedule(std::bind(&TcpServer::handleClient,
-                        shared_from_this(), client));
+            //多reactor模式下留在接收它的reactor上，连接不在线程之间迁移
+            IOManager* worker = m_reactors.empty() ? m_worker : IOManager::GetThis();
+            int thread = -1;
+            if(m_steerIncomingCpu) {
+                steerClient(client, worker, thread);
+            }
+            worker->schedule(std::bind(&TcpServer::onClient,
+                        shared_from_this(), client), thread);
         } else {
             CC_LOG_ERROR(g_logger) << "accept errno=" << errno
                 << " errstr=" << strerror(errno);
@@ -105,9 +132,9 @@ bool TcpServer::start() {
         return true;
     }
     m_isStop = false;
-    for(auto& sock : m_socks) {
-        m_acceptWorker->schedule(std::bind(&TcpServer::startAccept,
-                            shared_from_this(), sock));
+    for(size_t i = 0; i < m_socks.size(); ++i) {
+        m_sockReactors[i]->schedule(std::bind(&TcpServer::startAccept,
+                            shared_from_this(), m_socks[i]));
     }
     return true;
 }
@@ -117,15 +144,74 @@ void TcpServer::stop() {
     // 使用shared_from_this()获取当前TcpServer对象的共享指针，并将其存储在局部变量self中。
     // 这是为了确保在异步任务执行期间TcpServer对象不会被销毁
     auto self = shared_from_this();
+    if(!m_reactors.empty()) {
+        //每个监听socket注册在各自reactor的epoll中，需要在那个reactor上取消
+        for(size_t i = 0; i < m_socks.size(); ++i) {
+            Socket::ptr sock = m_socks[i];
+            m_sockReactors[i]->schedule([sock, self]() {
+                sock->cancelall();
+                sock->close();
+            });
+        }
+        m_socks.clear();
+        m_sockReactors.clear();
+        return;
+    }
     m_acceptWorker->schedule([this, self]() {
         for(auto& sock : m_socks){
             sock->cancelall();
             sock->close();
         }
         m_socks.clear();
+        m_sockReactors.clear();
     });
 }
 
+void TcpServer::onClient(Socket::ptr client) {
+    //在队列里等太久的连接，客户端多半已经超时，快速失败把处理能力留给新连接
+    if(checkShed()) {
+        rejectClient(client);
+        return;
+    }
+    handleClient(client);
+}
+
+void TcpServer::steerClient(Socket::ptr client, IOManager*& worker, int& thread) {
+    int cpu = client->getIncomingCpu();
+    if(cpu < 0) {
+        return;
+    }
+    //多reactor模式下交给绑定在该CPU上的reactor，连接还没有注册到任何epoll中，可以迁移
+    if(!m_reactors.empty()) {
+        for(auto& i : m_reactors) {
+            if(i->getThreadOnCpu(cpu) != -1) {
+                worker = i;
+                return;
+            }
+        }
+        return;
+    }
+    //否则指定在该CPU上的调度线程执行
+    thread = worker->getThreadOnCpu(cpu);
+}
+
+bool TcpServer::checkShed() {
+    if(!m_loadShedding) {
+        return false;
+    }
+    Scheduler* sc = Scheduler::GetThis();
+    if(!sc || !sc->shouldShed()) {
+        return false;
+    }
+    ++m_shedCount;
+    return true;
+}
+
+void TcpServer::rejectClient(Socket::ptr client) {
+    CC_LOG_DEBUG(g_logger) << "overloaded, reject client: " << *client;
+    client->close();
+}
+
 void TcpServer::handleClient(Socket::ptr client) {
     CC_LOG_INFO(g_logger) << "handleClient: " << *client;
 }
@@ -148,6 +234,10 @@ std::string TcpServer::toString(const std::string& prefix) {
        //<< " name=" << m_name << " ssl=" << m_ssl
        << " worker=" << (m_worker ? m_worker->getName() : "")
        << " accept=" << (m_acceptWorker ? m_acceptWorker->getName() : "")
+       << " reactors=" << m_reactors.size()
+       << " load_shedding=" << m_loadShedding
+       << " shed=" << m_shedCount
+       << " steer_incoming_cpu=" << m_steerIncomingCpu
        << " recv_timeout=" << m_recvTimeout << "]" << std::endl;
     std::string pfx = prefix.empty() ? "    " : prefix;
     for(auto& i : m_socks) {
@@ -11,6 +11,8 @@
 //实现功能:将IP地址绑定到socket，及一些错误处理
 //支持同时绑定多个地址进行监听，只需要在绑定时传入地址数组即可。
 //TcpServer还可以分别指定接收客户端和处理客户端的协程调度器。
+//多reactor模式(setReactors)下，每个reactor是一个单线程的IOManager，拥有自己的epoll和fd上下文，
+//每个reactor各自监听一个SO_REUSEPORT的socket，连接始终在接收它的reactor线程上处理，线程之间不共享连接
 namespace cc{
 
 //当调用 shared_from_this() 时，它会返回一个指向当前对象的 std::shared_ptr，
@@ -51,6 +53,15 @@ public:
                         ,std::vector<Address::ptr>& fails
                         ,bool ssl = false);
 
+    /**
+     * 使用多reactor模式，需要在bind之前设置
+     * reactors 单线程的IOManager(threads=1)，每个对应一个核心
+     * bind时为每个地址在每个reactor上创建一个SO_REUSEPORT的监听socket，
+     * 忽略构造时传入的worker和accept_worker
+     */
+    void setReactors(const std::vector<IOManager*>& reactors) { m_reactors = reactors;}
+    const std::vector<IOManager*>& getReactors() const { return m_reactors;}
+
     /**
      * 启动服务
      * 需要bind成功后执行
@@ -90,8 +101,37 @@ public:
     virtual std::string toString(const std::string& prefix = "");
 
     std::vector<Socket::ptr> getSocks() const { return m_socks;}
+
+    /**
+     * 过载保护: 调度器过载(见CoDel)时，排队超过target的新连接(以及HttpServer的新请求)
+     * 直接拒绝，不再排队等待处理
+     */
+    void setLoadShedding(bool v) { m_loadShedding = v;}
+    bool isLoadShedding() const { return m_loadShedding;}
+
+    /**
+     * 过载保护拒绝的连接/请求数
+     */
+    uint64_t getShedCount() const { return m_shedCount;}
+
+    /**
+     * 按SO_INCOMING_CPU把新连接交给绑定在该CPU上的调度线程(见Scheduler::setCpuAffinity)处理，
+     * 连接的收包软中断、协议栈数据和处理它的线程在同一个核(NUMA节点)上
+     */
+    void setSteerIncomingCpu(bool v) { m_steerIncomingCpu = v;}
+    bool isSteerIncomingCpu() const { return m_steerIncomingCpu;}
 protected:
 
+    /**
+     * 开启过载保护并且当前任务需要快速失败时返回true，并计数
+     */
+    bool checkShed();
+
+    /**
+     * 过载时拒绝新连接，默认直接关闭
+     */
+    virtual void rejectClient(Socket::ptr client);
+
     /**
      * 处理新连接的Socket
      */
@@ -101,6 +141,16 @@ protected:
      * 开始接受连接
      */
     virtual void startAccept(Socket::ptr sock);
+private:
+    /**
+     * 新连接任务的入口，过载时拒绝，否则交给handleClient
+     */
+    void onClient(Socket::ptr client);
+
+    /**
+     * 按SO_INCOMING_CPU选择处理新连接的调度器和线程，没有匹配时不修改
+     */
+    void steerClient(Socket::ptr client, IOManager*& worker, int& thread);
 protected:
     // 监听的Socket数组
     std::vector<Socket::ptr> m_socks;
@@ -109,6 +159,10 @@ protected:
     IOManager* m_ioWorker;
     // 服务器Socket接收连接的调度器
     IOManager* m_acceptWorker;
+    // 多reactor模式下的reactor，为空时不使用
+    std::vector<IOManager*> m_reactors;
+    // 多reactor模式下每个监听Socket所属的reactor，与m_socks一一对应
+    std::vector<IOManager*> m_sockReactors;
     // 接收超时时间(毫秒)
     uint64_t m_recvTimeout;
     // 服务器名称
@@ -119,6 +173,12 @@ protected:
     bool m_isStop;
     
     bool m_ssl = false;
+    // 是否开启过载保护
+    bool m_loadShedding;
+    // 过载保护拒绝的连接/请求数
+    std::atomic<uint64_t> m_shedCount {0};
+    // 是否按SO_INCOMING_CPU分配新连接
+    bool m_steerIncomingCpu;
 
     //TcpServerConf::ptr m_conf;
 };
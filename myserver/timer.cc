@@ -1,8 +1,26 @@
 #include "timer.h"
 #include "util.h"
+#include "config.h"
+#include "clock.h"
 
 namespace cc{
 
+static ConfigVar<bool>::ptr g_timer_wheel = 
+    Config::Lookup<bool>("timer.wheel", true, "use hierarchical timing wheel for timers");
+
+//创建TimerManager时使用，已经创建的TimerManager不受修改影响
+static bool s_timer_wheel = true;
+
+struct _TimerIniter{
+    _TimerIniter(){
+        s_timer_wheel = g_timer_wheel->getValue();
+        g_timer_wheel->addListener([](const bool& old_value, const bool& new_value){
+            s_timer_wheel = new_value;
+        });
+    }
+};
+static _TimerIniter s_timer_initer;
+
 bool Timer::Comparator::operator()(const Timer::ptr &lhs, const Timer::ptr &rhs) const{
     if(!lhs && !rhs){
         return false;
@@ -23,18 +41,20 @@ bool Timer::Comparator::operator()(const Timer::ptr &lhs, const Timer::ptr &rhs)
     return lhs.get() < rhs.get();
 }
 
-Timer::Timer(uint64_t ms, std::function<void()> cb,
+Timer::Timer(uint64_t ms, Callback cb,
             bool recurring, TimerManager* manager)
             :m_recurring(recurring)
             ,m_ms(ms)
-            ,m_cb(cb)
             ,m_manager(manager){
-    m_next = cc::GetCurrentMS() + m_ms;           
-
-}
-
-Timer::Timer(uint64_t next)
-        :m_next(next){
+    m_next = cc::GetNowMS() + m_ms;           
+    if(m_recurring && cb){
+        //每次到期交出去一个持有共享回调的任务，回调本身不拷贝
+        m_recurringCb = std::make_shared<Callback>(std::move(cb));
+        std::shared_ptr<Callback> shared = m_recurringCb;
+        m_cb = [shared](){ (*shared)();};
+    } else {
+        m_cb = std::move(cb);
+    }
 
 }
 
@@ -43,9 +63,9 @@ bool Timer::cancel(){
     //有回调函数
     if(m_cb){
         m_cb = nullptr;
+        m_recurringCb.reset();
         //找到并删除对应的定时器
-        auto it = m_manager->m_timers.find(shared_from_this());
-        m_manager->m_timers.erase(it);
+        m_manager->removeTimer(this);
         return true;
     }
     return false;
@@ -58,14 +78,15 @@ bool Timer::refresh(){
     if(!m_cb){
         return false;
     }
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()){
+    if(!m_manager->hasTimer(this)){
         return false;
     }
-    m_manager->m_timers.erase(it);
+    //移出时间轮会释放m_self，先持有一份
+    Timer::ptr self = shared_from_this();
+    m_manager->removeTimer(this);
     //重新设置定时器时间
-    m_next = cc::GetCurrentMS() + m_ms;
-    m_manager->m_timers.insert(shared_from_this());
+    m_next = cc::GetNowMS() + m_ms;
+    m_manager->insertTimer(self);
     return true;
 }
 
@@ -80,37 +101,82 @@ bool Timer::reset(uint64_t ms, bool from_now){
     if(!m_cb){
         return false;
     }
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()){
+    if(!m_manager->hasTimer(this)){
         return false;
     }
+    Timer::ptr self = shared_from_this();
+    //先移除，修改m_next后按新的时间重新放入
+    m_manager->removeTimer(this);
     uint64_t start = 0;
     if(from_now){
-        start = cc::GetCurrentMS();
+        start = cc::GetNowMS();
     } else {
         //最初设置这个定时器的时间
         start = m_next - m_ms;
     }
     m_ms = ms;
     m_next = start + m_ms;
-    m_manager->addTimer(shared_from_this(), lock);
+    m_manager->addTimer(self, lock);
     return true;
 }
 
 
-TimerManager::TimerManager(){
-    m_previousTime = cc::GetCurrentMS();
+TimerManager::TimerManager()
+    :m_useWheel(s_timer_wheel)
+    ,m_wheel(cc::GetNowMS()){
 }
 
 TimerManager::~TimerManager(){
+    //时间轮中的定时器持有自身，需要手动释放
+    std::vector<TimerWheelNode*> nodes;
+    m_wheel.clear(nodes);
+    for(auto node : nodes){
+        static_cast<Timer*>(node)->m_self.reset();
+    }
+}
+
+void TimerManager::insertTimer(const Timer::ptr& val){
+    if(m_useWheel){
+        val->expire = val->m_next;
+        val->m_self = val;
+        m_wheel.add(val.get());
+    } else {
+        m_timers.insert(val);
+    }
+}
 
+void TimerManager::removeTimer(Timer* timer){
+    if(m_useWheel){
+        m_wheel.remove(timer);
+        timer->m_self.reset();
+    } else {
+        auto it = m_timers.find(timer->shared_from_this());
+        m_timers.erase(it);
+    }
+}
+
+bool TimerManager::hasTimer(Timer* timer){
+    if(m_useWheel){
+        return timer->linked();
+    }
+    return m_timers.find(timer->shared_from_this()) != m_timers.end();
 }
 
 void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock& lock){
-    auto it = m_timers.insert(val).first;
+    insertTimer(val);
     //如果插入的定时器是最快要执行的，(即在最前端的)
+    //时间轮不维护最小值，和空闲线程正在等待的时间比较
+    bool at_front = false;
+    if(m_useWheel){
+        at_front = val->m_next < m_nextDeadline;
+        if(at_front){
+            m_nextDeadline = val->m_next;
+        }
+    } else {
+        at_front = m_timers.begin()->get() == val.get();
+    }
     //并且没有设置触发onTimerInsertedAtFront
-    bool at_front = (it == m_timers.begin()) && !m_tickled;
+    at_front = at_front && !m_tickled;
     if(at_front){
         // 设置触发onTimerInsertedAtFront
         // 如果频繁发生插入到起始位置的情况，无需每次都进行处理
@@ -122,17 +188,26 @@ void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock& lock){
     }
 }
 
-Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb,
+Timer::ptr TimerManager::addTimer(uint64_t ms, Callback cb,
                     bool recurring){
     //构造一个定时器
-    Timer::ptr timer(new Timer(ms,cb,recurring,this));
+    Timer::ptr timer(new Timer(ms, std::move(cb), recurring, this));
+    RWMutexType::WriteLock lock(m_mutex);
+    addTimer(timer, lock);
+    return timer;
+}
+
+Timer::ptr TimerManager::addInlineTimer(uint64_t ms, Callback cb,
+                    bool recurring){
+    Timer::ptr timer(new Timer(ms, std::move(cb), recurring, this));
+    timer->m_inline = true;
     RWMutexType::WriteLock lock(m_mutex);
     addTimer(timer, lock);
     return timer;
 }
 
 //专门执行条件定时器任务的函数，判断条件是否为空，非空时证明有效，执行
-static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb){
+static void OnTimer(const std::weak_ptr<void>& weak_cond, Callback& cb){
     //std::weak_ptr 的 lock() 成员函数用于获取一个指向其所管理对象的
     //std::shared_ptr。如果 std::weak_ptr 管理的对象已经被销毁，
     //lock() 将返回一个空的 std::shared_ptr。否则，它将返回一个指向该对象的有效 std::shared_ptr。
@@ -142,104 +217,101 @@ static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb){
     }
 }
 
+//条件定时器的回调，weak_ptr加上回调本身超过了Callback的内联大小，回调放在共享的堆对象中
+struct ConditionTimerCb{
+    std::weak_ptr<void> weak_cond;
+    std::shared_ptr<Callback> cb;
+    void operator()() { OnTimer(weak_cond, *cb);}
+};
+
 //创建条件定时器，也就是在创建定时器时绑定一个变量，
 //在定时器触发时判断一下该变量是否仍然有效，如果变量无效，那就取消触发。
-Timer::ptr TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb,
+Timer::ptr TimerManager::addConditionTimer(uint64_t ms, Callback cb,
                                             std::weak_ptr<void> weak_cond,
                                             bool recurring){
     //在定时器触发时会调用 OnTimer 函数，并在OnTimer函数中判断条件对象是否存在
     //如果存在则调用回调函数cb。
-    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb),recurring);
+    ConditionTimerCb cond_cb = {weak_cond, std::make_shared<Callback>(std::move(cb))};
+    return addTimer(ms, std::move(cond_cb), recurring);
 }
 
 uint64_t TimerManager::getNextTimer(){
     RWMutexType::ReadLock lock(m_mutex);
     m_tickled = false;
-    if(m_timers.empty()){
+    uint64_t next = ~0ull;
+    if(m_useWheel){
+        next = m_wheel.nextExpire();
+        m_nextDeadline = next;
+    } else if(!m_timers.empty()){
+        next = (*m_timers.begin())->m_next;
+    }
+    if(next == ~0ull){
         return ~0ull;
     }
-    const Timer::ptr &next = *m_timers.begin();
-    uint64_t now_ms = cc::GetCurrentMS();
+    uint64_t now_ms = cc::GetNowMS();
     //定时器未正常执行，返回0立刻执行
-    if(now_ms >= next->m_next){ 
+    if(now_ms >= next){ 
         return 0;
     }else{  
         //还需的等待时间                    
-        return next->m_next - now_ms;
+        return next - now_ms;
     }
 }
 
 //返回所有超时的定时器的回调函数
-void TimerManager::listExpireCb(std::vector<std::function<void()> >& cbs){
-    uint64_t now_ms = cc::GetCurrentMS(); //当前时间
-    std::vector<Timer::ptr> expired;      //已经超时的计时器
+void TimerManager::listExpireCb(std::vector<Callback>& cbs, std::vector<Callback>* inline_cbs){
+    uint64_t now_ms = cc::GetNowMS(); //当前时间
 
     {
         RWMutexType::ReadLock lock(m_mutex);
-        if(m_timers.empty()){
+        if(m_useWheel ? m_wheel.empty() : m_timers.empty()){
             return;
         }
     }
     RWMutexType::WriteLock lock(m_mutex);
 
-    //检测超时原因：是否是由于时间被修改了
-    bool rollover = detectClockRollover(now_ms);
-    //如果时间未被修改，且当前定时器第一个定时器都未超时，则返回
-    if(!rollover && ((*m_timers.begin())->m_next > now_ms)){
-        return;
-    }
-  
-
-    Timer::ptr now_timer(new Timer(now_ms));
-    //lower_bound函数用于在有序集合中查找不小于指定值的第一个元素
-    //upper_bound返回的是第一个大于指定值的元素
-
-    //如果系统时间被修改了，则全部加入超时
-    //否则拿到最后一个当前已超时的定时器的迭代器
-    auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);
-    //将当前时间的也包含进来。lb查找的是第一个大于等于的值，后面可能还有
-    while(it != m_timers.end() && (*it)->m_next == now_ms){
-        ++it;
-    }
-    //全部插入超时定时器集合
-    expired.insert(expired.begin(), m_timers.begin(), it);
-    //删掉原始的超时定时器
-    m_timers.erase(m_timers.begin(), it);
-
-    //reserve函数用于请求将容器的容量增加到至少足够存储n个元素。
-    //它不会改变容器的大小（即元素的数量），但可以防止在添加新元素时频繁重新分配内存，
-    //从而提高性能。
-    cbs.reserve(expired.size());
+    //已经超时的计时器放入m_expired
+    //定时器使用单调时钟，不需要检测系统时间是否被修改
+    if(m_useWheel){
+        //时间轮推进到当前时间
+        m_wheel.advance(now_ms, m_expiredNodes);
+        for(auto node : m_expiredNodes){
+            m_expired.push_back(std::move(static_cast<Timer*>(node)->m_self));
+        }
+        m_expiredNodes.clear();
+    } else {
+        //拿到最后一个当前已超时的定时器的迭代器，到期时间等于当前时间的也包含进来
+        auto it = m_timers.begin();
+        while(it != m_timers.end() && (*it)->m_next <= now_ms){
+            ++it;
+        }
+        //全部插入超时定时器集合
+        m_expired.insert(m_expired.end(), m_timers.begin(), it);
+        //删掉原始的超时定时器
+        m_timers.erase(m_timers.begin(), it);
+    }
+
     //超时定时器的回调函数放入待处理队列
-    for(auto& timer : expired){
-       
-        cbs.push_back(timer->m_cb);
-        //如果是循环定时器，修改执行时间并重新加入
-        //否则，直接将其的回调函数取消即可
+    for(auto& timer : m_expired){
+        std::vector<Callback>& out = (timer->m_inline && inline_cbs) ? *inline_cbs : cbs;
+        //如果是循环定时器，交出共享回调，修改执行时间并重新加入
+        //否则，直接把回调函数移出去
         if(timer->m_recurring){ 
+            std::shared_ptr<Callback> shared = timer->m_recurringCb;
+            out.push_back([shared](){ (*shared)();});
             timer->m_next = now_ms + timer->m_ms;
-            m_timers.insert(timer);
+            insertTimer(timer);
         }else{
+            out.push_back(std::move(timer->m_cb));
             timer->m_cb = nullptr;
         }
     }
+    m_expired.clear();
 }
 
 
-//检测系统时间是否被修改
-bool TimerManager::detectClockRollover(uint64_t now_ms){
-    bool rollover = false;
-    // 如果当前时间比上次执行时间还小, 并且小于一个小时以前的时间，系统时间被修改了
-    if(now_ms < m_previousTime 
-        && now_ms < (m_previousTime - 60 * 60* 1000)){//比一个小时前还小
-        rollover = true;
-    }
-    m_previousTime = now_ms;
-    return rollover;
-}
-
 bool TimerManager::hasTimer(){
     RWMutexType::ReadLock lock(m_mutex);
-    return !m_timers.empty();
+    return m_useWheel ? !m_wheel.empty() : !m_timers.empty();
 }
 }
\ No newline at end of file
@@ -5,7 +5,10 @@
 #include <set>
 #include <vector>
 #include <functional>
+#include <atomic>
 #include "thread.h"
+#include "timer_wheel.h"
+#include "callback.h"
 
 namespace cc{
 
@@ -17,7 +20,8 @@ class TimerManager;
 //定时器的设计采用时间堆的方式，将所有定时器按照最小堆的方式排列，
 //能够简单的获得当前超时时间最小的定时器，计算出超时需要等待的时间，然后等待超时。
 //超时时间到后，获取当前的绝对时间，并且把时间堆中已经超时的所有定时器都收到一个容器中，执行他们的回调函数。
-class Timer : public std::enable_shared_from_this<Timer>{
+//配置timer.wheel开启时改用分层时间轮(见timer_wheel.h)，插入和取消都是O(1)
+class Timer : public std::enable_shared_from_this<Timer>, private TimerWheelNode{
     friend class TimerManager;
 public:
     using ptr = std::shared_ptr<Timer>;
@@ -34,17 +38,20 @@ private:
     //ms: 时间(还有多久执行该定时器的任务)
     //cb: 回调函数
     //recurring: 是否循环
-    Timer(uint64_t ms, std::function<void()> cb,
+    Timer(uint64_t ms, Callback cb,
             bool recurring, TimerManager* manager);
-    //时间戳
-    Timer(uint64_t next);
     
 private:
     bool m_recurring = false;       //是否循环定时器
+    bool m_inline = false;          //到期时在处理定时器的线程上直接执行
     uint64_t m_ms = 0;              //执行周期(理解为该定时器还有多久执行)
     uint64_t m_next = 0;            //具体执行时间
-    std::function<void()> m_cb;     //定时器需要执行的任务
+    Callback m_cb;                  //定时器需要执行的任务
+    //循环定时器的任务，每次到期执行的是共享的同一个回调(执行中可能被cancel)
+    std::shared_ptr<Callback> m_recurringCb;
     TimerManager* m_manager = nullptr;
+    //在时间轮中时持有自身，时间轮里只保存裸指针
+    Timer::ptr m_self;
 private:
     //定时器比较的仿函数
     struct Comparator{
@@ -67,19 +74,27 @@ public:
      * weak_cond 条件
      * recurring 是否循环定时器
      */
-    Timer::ptr addTimer(uint64_t ms, std::function<void()> cb,
+    Timer::ptr addTimer(uint64_t ms, Callback cb,
                         bool recurring = false);
     
     //weak_cond表示
-    Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb,
+    Timer::ptr addConditionTimer(uint64_t ms, Callback cb,
                                  std::weak_ptr<void> weak_cond,
                                  bool recurring = false);
+
+    /**
+     * 添加内联定时器: 到期时回调直接在收集到期定时器的线程上执行(IOManager的idle循环)，
+     * 不放入调度队列，也不需要协程来运行。
+     * 只适合很短、不阻塞、不让出的回调，例如重新调度一个协程、唤醒一个等待者
+     */
+    Timer::ptr addInlineTimer(uint64_t ms, Callback cb, bool recurring = false);
     
     //获取当前定时器中时间待执行时间最近的
     uint64_t getNextTimer();        
 
-    //获取需要执行的定时器的回调函数列表
-    void listExpireCb(std::vector<std::function<void()> >& cbs);
+    //获取需要执行的定时器的回调函数列表，追加到cbs中
+    //inline_cbs不为空时，内联定时器的回调放到inline_cbs中，由调用者直接执行
+    void listExpireCb(std::vector<Callback>& cbs, std::vector<Callback>* inline_cbs = nullptr);
 
     bool hasTimer();
 protected:
@@ -90,16 +105,27 @@ protected:
     void addTimer(Timer::ptr val, RWMutexType::WriteLock& lock);
     
 private:
-    //检测服务器时间是否修改
-    bool detectClockRollover(uint64_t now_ms);
+    //放入定时器容器，不检查是否需要通知
+    void insertTimer(const Timer::ptr& val);
+    //从管理器中移除，定时器必须在管理器中
+    void removeTimer(Timer* timer);
+    //定时器是否在管理器中
+    bool hasTimer(Timer* timer);
 private:
     RWMutexType m_mutex;
+    //是否使用时间轮，创建时由配置决定
+    bool m_useWheel = false;
     //管理的定时器列表
     std::set<Timer::ptr, Timer::Comparator> m_timers;
+    //时间轮
+    TimerWheel m_wheel;
+    //时间轮模式下，空闲线程按这个时间设置的超时，更早的定时器插入时需要唤醒
+    std::atomic<uint64_t> m_nextDeadline = {~0ull};
     //是否触发onTimerInsertedAtFront
     bool m_tickled = false;
-    //上次执行时间
-    uint64_t m_previousTime = 0;
+    //listExpireCb中使用的临时数组，在写锁下复用，不用每次分配
+    std::vector<TimerWheelNode*> m_expiredNodes;
+    std::vector<Timer::ptr> m_expired;
 };
 
 }
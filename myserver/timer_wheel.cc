@@ -0,0 +1,168 @@
+#include "timer_wheel.h"
+
+namespace cc{
+
+TimerWheel::TimerWheel(uint64_t now_ms)
+    :m_current(now_ms){
+}
+
+void TimerWheel::add(TimerWheelNode* node){
+    place(node);
+    ++m_size;
+}
+
+void TimerWheel::remove(TimerWheelNode* node){
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+    --m_size;
+}
+
+void TimerWheel::place(TimerWheelNode* node){
+    //已经过期的放到当前时刻的槽，下一次推进时到期
+    uint64_t expire = node->expire < m_current ? m_current : node->expire;
+    uint64_t delta = expire - m_current;
+    Slot* slot = nullptr;
+    if(delta < ROOT_SIZE){
+        slot = &m_root[expire & (ROOT_SIZE - 1)];
+    } else {
+        int level = 1;
+        while(level < LEVELS - 1
+                && delta >= (1ull << (ROOT_BITS + level * LEVEL_BITS))){
+            ++level;
+        }
+        //超出时间轮范围的先放在最高层最远的槽里
+        if(delta >= (1ull << (ROOT_BITS + (LEVELS - 1) * LEVEL_BITS))){
+            expire = m_current + (1ull << (ROOT_BITS + (LEVELS - 1) * LEVEL_BITS)) - 1;
+        }
+        int shift = ROOT_BITS + (level - 1) * LEVEL_BITS;
+        slot = &m_levels[level - 1][(expire >> shift) & (LEVEL_SIZE - 1)];
+    }
+    //插入到链表尾部
+    TimerWheelNode* head = &slot->head;
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void TimerWheel::cascade(int level, size_t index){
+    Slot& slot = m_levels[level - 1][index];
+    TimerWheelNode* head = &slot.head;
+    TimerWheelNode* node = head->next;
+    head->prev = head->next = head;
+    while(node != head){
+        TimerWheelNode* next = node->next;
+        place(node);
+        node = next;
+    }
+}
+
+void TimerWheel::Drain(Slot& slot, std::vector<TimerWheelNode*>& nodes){
+    TimerWheelNode* head = &slot.head;
+    TimerWheelNode* node = head->next;
+    head->prev = head->next = head;
+    while(node != head){
+        TimerWheelNode* next = node->next;
+        node->prev = node->next = nullptr;
+        nodes.push_back(node);
+        node = next;
+    }
+}
+
+void TimerWheel::advance(uint64_t now_ms, std::vector<TimerWheelNode*>& expired){
+    //没有节点时直接跳到当前时间
+    if(m_size == 0){
+        if(now_ms >= m_current){
+            m_current = now_ms + 1;
+        }
+        return;
+    }
+    //时间由不同线程缓存的单调时间提供，可能比已经推进到的时刻略早，直接忽略
+    if(now_ms < m_current){
+        return;
+    }
+    //很久没有推进，不再逐毫秒推进，全部摘下按新的时间重新放置
+    if(now_ms - m_current > MAX_STEP){
+        std::vector<TimerWheelNode*> nodes;
+        nodes.reserve(m_size);
+        clear(nodes);
+        m_current = now_ms + 1;
+        for(auto node : nodes){
+            if(node->expire <= now_ms){
+                expired.push_back(node);
+            } else {
+                add(node);
+            }
+        }
+        return;
+    }
+
+    while(m_current <= now_ms && m_size > 0){
+        size_t index = m_current & (ROOT_SIZE - 1);
+        //低层转完一圈，把上一层对应的槽降下来，逐层向上
+        if(index == 0){
+            for(int level = 1; level < LEVELS; ++level){
+                int shift = ROOT_BITS + (level - 1) * LEVEL_BITS;
+                size_t idx = (m_current >> shift) & (LEVEL_SIZE - 1);
+                cascade(level, idx);
+                if(idx != 0){
+                    break;
+                }
+            }
+        }
+        size_t before = expired.size();
+        Drain(m_root[index], expired);
+        m_size -= expired.size() - before;
+        ++m_current;
+    }
+    if(m_current <= now_ms){
+        m_current = now_ms + 1;
+    }
+}
+
+void TimerWheel::clear(std::vector<TimerWheelNode*>& nodes){
+    for(size_t i = 0; i < ROOT_SIZE; ++i){
+        Drain(m_root[i], nodes);
+    }
+    for(int level = 0; level < LEVELS - 1; ++level){
+        for(size_t i = 0; i < LEVEL_SIZE; ++i){
+            Drain(m_levels[level][i], nodes);
+        }
+    }
+    m_size = 0;
+}
+
+uint64_t TimerWheel::nextExpire() const{
+    if(m_size == 0){
+        return ~0ull;
+    }
+    uint64_t next = ~0ull;
+    //第0层的槽和到期时间一一对应
+    for(size_t i = 0; i < ROOT_SIZE; ++i){
+        uint64_t t = m_current + i;
+        if(!m_root[t & (ROOT_SIZE - 1)].empty()){
+            next = t;
+            break;
+        }
+    }
+    //更高层的槽在它降层的时刻之前不会到期，但降层可能早于第0层找到的时间
+    for(int level = 1; level < LEVELS; ++level){
+        int shift = ROOT_BITS + (level - 1) * LEVEL_BITS;
+        //m_current之后(含m_current，它还没有处理)的第一次降层
+        uint64_t first = ((m_current + (1ull << shift) - 1) >> shift) << shift;
+        for(size_t i = 0; i < LEVEL_SIZE; ++i){
+            uint64_t t = first + (i << shift);
+            if(t >= next){
+                break;
+            }
+            if(!m_levels[level - 1][(t >> shift) & (LEVEL_SIZE - 1)].empty()){
+                next = t;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+}
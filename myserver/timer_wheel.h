@@ -0,0 +1,82 @@
+#ifndef __CC_TIMER_WHEEL_H__
+#define __CC_TIMER_WHEEL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "noncopyable.h"
+
+namespace cc{
+
+//时间轮上的节点，侵入式地嵌在定时器对象中，插入/删除不需要额外分配内存
+struct TimerWheelNode{
+    TimerWheelNode* prev = nullptr;
+    TimerWheelNode* next = nullptr;
+    //到期的绝对时间(毫秒)
+    uint64_t expire = 0;
+
+    //是否在时间轮中
+    bool linked() const { return prev != nullptr;}
+};
+
+//分层时间轮，精度1ms
+//第0层256个槽，每槽1ms；第1~4层各64个槽，每层的一个槽覆盖下一层一整圈，
+//共覆盖2^32ms(约49天)，更远的定时器先放在最高层，降层时再重新计算位置。
+//插入和删除都是O(1)；推进时间时，低层转完一圈把上一层对应槽里的节点重新分配到低层。
+//不加锁，由使用者(TimerManager)保证互斥
+class TimerWheel : Noncopyable{
+public:
+    //now_ms: 起始时间
+    TimerWheel(uint64_t now_ms);
+
+    //node->expire需要提前设置好，已经过期(不晚于上次推进的时刻)的节点在下一毫秒到期
+    void add(TimerWheelNode* node);
+    //从时间轮中移除，节点必须在时间轮中
+    void remove(TimerWheelNode* node);
+
+    //推进到now_ms，到期的节点从时间轮中摘下，放入expired(大致按到期时间排序)
+    void advance(uint64_t now_ms, std::vector<TimerWheelNode*>& expired);
+    //摘下所有节点
+    void clear(std::vector<TimerWheelNode*>& nodes);
+
+    //最早可能到期的时间，不早于真实的最早到期时间；没有节点返回~0ull
+    //第0层之外的节点只能精确到它所在槽降层的时刻，届时醒来只做一次降层
+    uint64_t nextExpire() const;
+
+    size_t size() const { return m_size;}
+    bool empty() const { return m_size == 0;}
+private:
+    //每层的槽是一个带哨兵的双向循环链表
+    struct Slot{
+        TimerWheelNode head;
+        Slot(){
+            head.prev = head.next = &head;
+        }
+        bool empty() const { return head.next == &head;}
+    };
+
+    //根据到期时间放入对应层的槽
+    void place(TimerWheelNode* node);
+    //把第level层index槽中的节点重新分配到低层
+    void cascade(int level, size_t index);
+    //把一个槽中的节点全部摘下，追加到nodes
+    static void Drain(Slot& slot, std::vector<TimerWheelNode*>& nodes);
+private:
+    static const int LEVELS = 5;
+    static const int ROOT_BITS = 8;
+    static const int LEVEL_BITS = 6;
+    static const size_t ROOT_SIZE = 1 << ROOT_BITS;
+    static const size_t LEVEL_SIZE = 1 << LEVEL_BITS;
+    //与上次推进相差太久时，不再逐毫秒推进，直接重建
+    static const uint64_t MAX_STEP = 1 << 16;
+
+    Slot m_root[ROOT_SIZE];
+    Slot m_levels[LEVELS - 1][LEVEL_SIZE];
+    //下一个待处理的时刻，小于它的时刻都已经处理过
+    uint64_t m_current;
+    size_t m_size = 0;
+};
+
+}
+
+#endif
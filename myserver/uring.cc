@@ -0,0 +1,217 @@
+#include "uring.h"
+#include "log.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace cc{
+
+static Logger::ptr g_logger = CC_LOG_NAME("system");
+
+//内核与用户态共享的队列头尾指针
+static inline unsigned LoadAcquire(const unsigned* p){
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void StoreRelease(unsigned* p, unsigned v){
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+IoUring::IoUring(uint32_t entries){
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = entries * 4;
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(fd < 0){
+        CC_LOG_WARN(g_logger) << "io_uring_setup(" << entries << ") errno=" << errno
+                              << " " << strerror(errno);
+        return;
+    }
+    uint32_t required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP;
+    if((params.features & required) != required){
+        CC_LOG_WARN(g_logger) << "io_uring features=" << params.features << " not supported";
+        close(fd);
+        return;
+    }
+
+    //SINGLE_MMAP: 提交队列和完成队列在同一块映射中
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    m_ringSize = sq_size > cq_size ? sq_size : cq_size;
+    m_ring = mmap(nullptr, m_ringSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(m_ring == MAP_FAILED){
+        CC_LOG_ERROR(g_logger) << "io_uring mmap ring errno=" << errno << " " << strerror(errno);
+        m_ring = nullptr;
+        close(fd);
+        return;
+    }
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED){
+        CC_LOG_ERROR(g_logger) << "io_uring mmap sqes errno=" << errno << " " << strerror(errno);
+        munmap(m_ring, m_ringSize);
+        m_ring = nullptr;
+        close(fd);
+        return;
+    }
+    m_sqes = (io_uring_sqe*)sqes;
+
+    char* ring = (char*)m_ring;
+    m_sqHead = (unsigned*)(ring + params.sq_off.head);
+    m_sqTail = (unsigned*)(ring + params.sq_off.tail);
+    m_sqFlags = (unsigned*)(ring + params.sq_off.flags);
+    m_sqArray = (unsigned*)(ring + params.sq_off.array);
+    m_sqMask = *(unsigned*)(ring + params.sq_off.ring_mask);
+    m_sqEntries = params.sq_entries;
+    m_cqHead = (unsigned*)(ring + params.cq_off.head);
+    m_cqTail = (unsigned*)(ring + params.cq_off.tail);
+    m_cqes = (io_uring_cqe*)(ring + params.cq_off.cqes);
+    m_cqMask = *(unsigned*)(ring + params.cq_off.ring_mask);
+    m_fd = fd;
+
+    if(!probe() || !probeCancelFd()){
+        munmap(m_sqes, m_sqesSize);
+        munmap(m_ring, m_ringSize);
+        m_sqes = nullptr;
+        m_ring = nullptr;
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+IoUring::~IoUring(){
+    if(m_fd < 0){
+        return;
+    }
+    munmap(m_sqes, m_sqesSize);
+    munmap(m_ring, m_ringSize);
+    close(m_fd);
+}
+
+bool IoUring::probe(){
+    static const int OPS[] = {
+        IORING_OP_READ, IORING_OP_WRITE, IORING_OP_RECV, IORING_OP_SEND,
+        IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_LINK_TIMEOUT, IORING_OP_ASYNC_CANCEL
+    };
+    const size_t len = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    io_uring_probe* p = (io_uring_probe*)calloc(1, len);
+    int rt = syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, p, 256);
+    bool ok = rt == 0;
+    if(!ok){
+        CC_LOG_WARN(g_logger) << "io_uring probe errno=" << errno << " " << strerror(errno);
+    }
+    for(size_t i = 0; ok && i < sizeof(OPS) / sizeof(OPS[0]); ++i){
+        if(OPS[i] > p->last_op || !(p->ops[OPS[i]].flags & IO_URING_OP_SUPPORTED)){
+            CC_LOG_WARN(g_logger) << "io_uring op " << OPS[i] << " not supported";
+            ok = false;
+        }
+    }
+    free(p);
+    return ok;
+}
+
+//按fd取消(IORING_ASYNC_CANCEL_FD)需要5.19+内核，opcode探测不出来，
+//实际提交一次取消请求: 旧内核不认识cancel_flags，返回-EINVAL
+bool IoUring::probeCancelFd(){
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = m_fd;
+    sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    if(submit(&sqe, 1)){
+        return false;
+    }
+    io_uring_cqe cqe;
+    while(reap(&cqe, 1) == 0){
+        if(enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR){
+            CC_LOG_WARN(g_logger) << "io_uring probe cancel errno=" << errno << " " << strerror(errno);
+            return false;
+        }
+    }
+    if(cqe.res == -EINVAL){
+        CC_LOG_WARN(g_logger) << "io_uring cancel by fd not supported";
+        return false;
+    }
+    return true;
+}
+
+int IoUring::enter(unsigned to_submit, unsigned min_complete, unsigned flags){
+    return syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+int IoUring::flush(){
+    while(true){
+        unsigned pending = *m_sqTail - LoadAcquire(m_sqHead);
+        if(pending == 0){
+            return 0;
+        }
+        int rt = enter(pending, 0, 0);
+        if(rt >= 0){
+            continue;
+        }
+        if(errno == EINTR){
+            continue;
+        }
+        //EAGAIN/EBUSY: 内核资源不足或完成队列溢出，留在队列中等下一次
+        return -errno;
+    }
+}
+
+int IoUring::submit(const io_uring_sqe* sqes, size_t count){
+    Spinlock::Lock lock(m_sqMutex);
+    //每次放入后都立即提交，队列只在提交失败时才会积压
+    //链接在一起的请求要么全部放入，要么都不放入
+    if(m_sqEntries - (*m_sqTail - LoadAcquire(m_sqHead)) < count){
+        int rt = flush();
+        if(m_sqEntries - (*m_sqTail - LoadAcquire(m_sqHead)) < count){
+            CC_LOG_ERROR(g_logger) << "io_uring submit queue full, errno=" << -rt;
+            return rt < 0 ? rt : -EBUSY;
+        }
+    }
+    unsigned tail = *m_sqTail;
+    for(size_t i = 0; i < count; ++i){
+        unsigned index = (tail + i) & m_sqMask;
+        m_sqes[index] = sqes[i];
+        m_sqArray[index] = index;
+    }
+    StoreRelease(m_sqTail, tail + count);
+    int rt = flush();
+    if(rt < 0){
+        //已经放入队列，由之后的提交或收割补交
+        CC_LOG_WARN(g_logger) << "io_uring_enter errno=" << -rt << " " << strerror(-rt);
+    }
+    return 0;
+}
+
+size_t IoUring::reap(io_uring_cqe* cqes, size_t max){
+    size_t n = 0;
+    {
+        Spinlock::Lock lock(m_cqMutex);
+        unsigned head = *m_cqHead;
+        unsigned tail = LoadAcquire(m_cqTail);
+        while(head != tail && n < max){
+            cqes[n++] = m_cqes[head & m_cqMask];
+            ++head;
+        }
+        StoreRelease(m_cqHead, head);
+    }
+    //完成队列曾经溢出，内核暂存的事件需要通过io_uring_enter取回
+    //提交失败积压的请求也在这里补交
+    unsigned flags = LoadAcquire(m_sqFlags);
+    if((flags & IORING_SQ_CQ_OVERFLOW) || LoadAcquire(m_sqTail) != LoadAcquire(m_sqHead)){
+        Spinlock::Lock lock(m_sqMutex);
+        if(flags & IORING_SQ_CQ_OVERFLOW){
+            enter(0, 0, IORING_ENTER_GETEVENTS);
+        }
+        flush();
+    }
+    return n;
+}
+
+}
@@ -0,0 +1,66 @@
+#ifndef __CC_URING_H__
+#define __CC_URING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+#include "noncopyable.h"
+#include "thread.h"
+
+namespace cc{
+
+//io_uring实例的简单封装，直接使用系统调用，不依赖liburing
+//提交队列和完成队列各自加锁，多个调度线程可以同时提交和收割
+//需要内核支持IORING_FEAT_SINGLE_MMAP和IORING_FEAT_NODROP(5.5+)，
+//以及RECV/SEND/ACCEPT/CONNECT/LINK_TIMEOUT等操作和按fd取消(5.19+)，不满足时isValid()为false
+class IoUring : Noncopyable{
+public:
+    //entries 提交队列的深度，完成队列为它的4倍
+    IoUring(uint32_t entries);
+    ~IoUring();
+
+    bool isValid() const { return m_fd >= 0;}
+    //可读时表示完成队列中有事件，可以注册到epoll中
+    int getFd() const { return m_fd;}
+
+    //按顺序放入提交队列并立即提交，多个请求之间可以用IOSQE_IO_LINK链接
+    //返回0表示已经放入队列，一定会被提交(本次io_uring_enter失败时由之后的提交或收割带上)
+    //返回-errno表示队列已满，没有放入
+    int submit(const io_uring_sqe* sqes, size_t count);
+    //取出最多max个完成事件，返回取出的数量
+    size_t reap(io_uring_cqe* cqes, size_t max);
+private:
+    //检查内核是否支持需要的操作
+    bool probe();
+    //检查内核是否支持按fd取消
+    bool probeCancelFd();
+    //把提交队列中还没有提交的请求交给内核，需要持有m_sqMutex
+    int flush();
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+private:
+    int m_fd = -1;
+    //提交队列和完成队列共用一块映射
+    void* m_ring = nullptr;
+    size_t m_ringSize = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqTail = nullptr;
+    unsigned* m_sqFlags = nullptr;
+    unsigned* m_sqArray = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned m_sqEntries = 0;
+
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    io_uring_cqe* m_cqes = nullptr;
+    unsigned m_cqMask = 0;
+
+    Spinlock m_sqMutex;
+    Spinlock m_cqMutex;
+};
+
+}
+
+#endif